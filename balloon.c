@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "balloon.h"
+
+#define BALLOON_REQUEST_SIZE 17 // operation, address and size
+#define BALLOON_ERROR UINT64_MAX
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} BalloonRange;
+
+typedef struct
+{
+    uint64_t requests;
+    uint64_t released;  // pages released over lifetime of guest
+    uint64_t reclaimed; // pages guest took back with BALLOON_DEFLATE
+    uint64_t ballooned; // pages in balloon now
+    uint64_t peak;
+} BalloonStats;
+
+struct BalloonDevice
+{
+    int guestId;
+    char *mem;
+    uint64_t memSize;
+    size_t hostPageSize;
+    int advice;
+    BalloonRange ranges[BALLOON_MAX_RANGES];
+    int rangeCount;
+    uint64_t *inBalloon; // bit per guest page
+    BalloonStats stats;
+    // state of request in progress
+    uint8_t request[BALLOON_REQUEST_SIZE];
+    int requestBytes;
+    uint8_t reply[8];
+    int replyBytes;
+};
+
+BalloonDevice *createBalloonDevice(int guestId, char *mem, uint64_t memSize, size_t hostPageSize, int advice)
+{
+    BalloonDevice *device = (BalloonDevice *)calloc(1, sizeof(BalloonDevice));
+    if (!device)
+        return NULL;
+    uint64_t pages = memSize / BALLOON_PAGE_SIZE;
+    device->inBalloon = (uint64_t *)calloc((pages + 63) / 64, sizeof(uint64_t));
+    if (!device->inBalloon)
+    {
+        free(device);
+        return NULL;
+    }
+    device->guestId = guestId;
+    device->mem = mem;
+    device->memSize = memSize;
+    device->hostPageSize = (hostPageSize > BALLOON_PAGE_SIZE) ? hostPageSize : BALLOON_PAGE_SIZE;
+    device->advice = advice;
+    return device;
+}
+
+void deleteBalloonDevice(BalloonDevice *device)
+{
+    if (!device)
+        return;
+    if (device->stats.requests > 0)
+        printf("{Guest %d} Balloon: %llu KB released in %llu requests, %llu KB taken back, %llu KB in balloon (peak %llu KB)\n",
+               device->guestId, (unsigned long long)(device->stats.released * BALLOON_PAGE_SIZE / 1024),
+               (unsigned long long)device->stats.requests, (unsigned long long)(device->stats.reclaimed * BALLOON_PAGE_SIZE / 1024),
+               (unsigned long long)(device->stats.ballooned * BALLOON_PAGE_SIZE / 1024),
+               (unsigned long long)(device->stats.peak * BALLOON_PAGE_SIZE / 1024));
+    free(device->inBalloon);
+    free(device);
+}
+
+int addBalloonRange(BalloonDevice *device, uint64_t guestAddr, uint64_t size)
+{
+    if (device->rangeCount >= BALLOON_MAX_RANGES || guestAddr + size > device->memSize)
+        return -1;
+    device->ranges[device->rangeCount].start = guestAddr;
+    device->ranges[device->rangeCount].end = guestAddr + size;
+    device->rangeCount++;
+    return 0;
+}
+
+static uint64_t getBigEndian(uint8_t *bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | bytes[i];
+    return value;
+}
+
+// Changes balloon bits of pages in [start, end), returns number of pages whose bit changed
+static uint64_t markPages(BalloonDevice *device, uint64_t start, uint64_t end, int inBalloon)
+{
+    uint64_t changed = 0;
+    for (uint64_t page = start / BALLOON_PAGE_SIZE; page < end / BALLOON_PAGE_SIZE; page++)
+    {
+        uint64_t bit = 1ULL << (page % 64);
+        if (!(device->inBalloon[page / 64] & bit) == !inBalloon)
+            continue;
+        device->inBalloon[page / 64] ^= bit;
+        changed++;
+    }
+    return changed;
+}
+
+// Only whole host pages inside both reported range and guest memory are released, so guest never loses
+// memory next to the range it reported
+static uint64_t inflate(BalloonDevice *device, uint64_t start, uint64_t end)
+{
+    uint64_t released = 0;
+    for (int i = 0; i < device->rangeCount; i++)
+    {
+        uint64_t first = (start > device->ranges[i].start) ? start : device->ranges[i].start;
+        uint64_t last = (end < device->ranges[i].end) ? end : device->ranges[i].end;
+        first = (first + device->hostPageSize - 1) / device->hostPageSize * device->hostPageSize;
+        last = last / device->hostPageSize * device->hostPageSize;
+        if (first >= last)
+            continue;
+        if (madvise(device->mem + first, last - first, device->advice) != 0)
+        {
+            printf("{Guest %d} Balloon error - host couldn't release guest memory\n", device->guestId);
+            continue;
+        }
+        released += markPages(device, first, last, 1);
+    }
+    return released;
+}
+
+// Pages are given back on first touch anyway, deflating only keeps balloon size accurate
+static uint64_t deflate(BalloonDevice *device, uint64_t start, uint64_t end)
+{
+    start = start / BALLOON_PAGE_SIZE * BALLOON_PAGE_SIZE;
+    end = (end < device->memSize) ? (end + BALLOON_PAGE_SIZE - 1) / BALLOON_PAGE_SIZE * BALLOON_PAGE_SIZE : device->memSize;
+    return (start < end) ? markPages(device, start, end, 0) : 0;
+}
+
+static void serveRequest(BalloonDevice *device)
+{
+    uint64_t result = BALLOON_ERROR;
+    uint64_t addr = getBigEndian(device->request + 1);
+    uint64_t size = getBigEndian(device->request + 9);
+    int valid = (addr < device->memSize && size <= device->memSize - addr);
+    device->stats.requests++;
+    if (device->request[0] == BALLOON_INFLATE && valid)
+    {
+        result = inflate(device, addr, addr + size);
+        device->stats.released += result;
+        device->stats.ballooned += result;
+        if (device->stats.ballooned > device->stats.peak)
+            device->stats.peak = device->stats.ballooned;
+    }
+    else if (device->request[0] == BALLOON_DEFLATE && valid)
+    {
+        result = deflate(device, addr, addr + size);
+        device->stats.reclaimed += result;
+        device->stats.ballooned -= result;
+    }
+    else if (device->request[0] == BALLOON_QUERY)
+        result = device->stats.ballooned;
+    else
+        printf("{Guest %d} Balloon error - bad request\n", device->guestId);
+    for (int i = 0; i < 8; i++)
+        device->reply[i] = (uint8_t)(result >> (56 - 8 * i));
+    device->replyBytes = 8;
+    device->requestBytes = 0;
+}
+
+void balloonDeviceOut(BalloonDevice *device, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        device->request[device->requestBytes++] = data[i];
+        // query has no arguments, every other request has address and size
+        if ((device->requestBytes == 1 && data[i] == BALLOON_QUERY) || device->requestBytes == BALLOON_REQUEST_SIZE)
+            serveRequest(device);
+    }
+}
+
+void balloonDeviceIn(BalloonDevice *device, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        data[i] = (device->replyBytes > 0) ? device->reply[8 - device->replyBytes--] : 0;
+}
@@ -0,0 +1,31 @@
+#ifndef BALLOON_H
+#define BALLOON_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Memory balloon, guest reports ranges of its memory it doesn't use and host releases pages backing them.
+// Released page stays mapped into guest, the first time guest touches it again host gives it new zero-filled page
+
+#define PORT_BALLOON 0x0282
+
+#define BALLOON_INFLATE 0x1 // 8 byte address and 8 byte size follow, reply is number of pages released
+#define BALLOON_DEFLATE 0x2 // 8 byte address and 8 byte size follow, reply is number of ballooned pages guest takes back
+#define BALLOON_QUERY 0x3   // reply is number of pages currently in balloon
+
+#define BALLOON_PAGE_SIZE 4096 // unit of guest reports and replies
+#define BALLOON_MAX_RANGES 2   // guest memory is split around shared image text
+
+typedef struct BalloonDevice BalloonDevice;
+
+// hostPageSize is size of pages backing guest memory, only whole host pages are released. advice is MADV_DONTNEED
+// for private mappings and MADV_REMOVE for shared ones, where DONTNEED would leave pages in shared memory object
+BalloonDevice *createBalloonDevice(int guestId, char *mem, uint64_t memSize, size_t hostPageSize, int advice);
+// Prints statistics of balloon if guest used it
+void deleteBalloonDevice(BalloonDevice *device);
+// Guest memory that can be ballooned, pages outside of added ranges are never released
+int addBalloonRange(BalloonDevice *device, uint64_t guestAddr, uint64_t size);
+void balloonDeviceOut(BalloonDevice *device, uint8_t *data, uint32_t count);
+void balloonDeviceIn(BalloonDevice *device, uint8_t *data, uint32_t count);
+
+#endif
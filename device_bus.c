@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "device_bus.h"
+
+DeviceBus *createDeviceBus(int guestId)
+{
+    DeviceBus *bus = (DeviceBus *)calloc(1, sizeof(DeviceBus));
+    if (bus)
+        bus->guestId = guestId;
+    return bus;
+}
+
+int addDevice(DeviceBus *bus, const char *name, void *state, PortHandler out, PortHandler in, MmioHandler mmio,
+              void (*destroy)(void *state))
+{
+    if (bus->deviceCount == MAX_DEVICES)
+    {
+        printf("{Guest %d} Error: too many devices, '%s' is not added\n", bus->guestId, name);
+        if (destroy)
+            destroy(state);
+        return -1;
+    }
+    int index = ++bus->deviceCount;
+    bus->devices[index] = (Device){name, state, out, in, mmio, destroy};
+    return index;
+}
+
+int registerPorts(DeviceBus *bus, int device, uint16_t first, int count)
+{
+    if (device <= 0 || (int)first + count > PORT_PAGES * PORT_PAGE_SIZE)
+        return -1;
+    for (int port = first; port < first + count; port++)
+    {
+        uint8_t *page = bus->portPages[port / PORT_PAGE_SIZE];
+        if (page && page[port % PORT_PAGE_SIZE] != 0)
+        {
+            printf("{Guest %d} Error: port 0x%04x of device '%s' is already used by device '%s'\n", bus->guestId, port,
+                   bus->devices[device].name, bus->devices[page[port % PORT_PAGE_SIZE]].name);
+            return -1;
+        }
+    }
+    for (int port = first; port < first + count; port++)
+    {
+        uint8_t **page = &bus->portPages[port / PORT_PAGE_SIZE];
+        if (!*page && !(*page = (uint8_t *)calloc(PORT_PAGE_SIZE, sizeof(uint8_t))))
+            return -1;
+        (*page)[port % PORT_PAGE_SIZE] = (uint8_t)device;
+    }
+    return 0;
+}
+
+int registerMmio(DeviceBus *bus, int device, uint64_t base, uint64_t size)
+{
+    if (device <= 0 || size == 0 || base + size < base)
+        return -1;
+    int pos = 0;
+    while (pos < bus->mmioCount && bus->mmioRanges[pos].base < base)
+        pos++;
+    if ((pos > 0 && bus->mmioRanges[pos - 1].base + bus->mmioRanges[pos - 1].size > base) ||
+        (pos < bus->mmioCount && base + size > bus->mmioRanges[pos].base))
+    {
+        printf("{Guest %d} Error: MMIO range of device '%s' overlaps another device\n", bus->guestId, bus->devices[device].name);
+        return -1;
+    }
+    MmioRange *ranges = (MmioRange *)realloc(bus->mmioRanges, (bus->mmioCount + 1) * sizeof(MmioRange));
+    if (!ranges)
+        return -1;
+    memmove(ranges + pos + 1, ranges + pos, (bus->mmioCount - pos) * sizeof(MmioRange));
+    ranges[pos] = (MmioRange){base, size, (uint8_t)device};
+    bus->mmioRanges = ranges;
+    bus->mmioCount++;
+    return 0;
+}
+
+static Device *findMmioDevice(DeviceBus *bus, uint64_t addr, uint64_t *offset)
+{
+    int low = 0, high = bus->mmioCount - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        MmioRange *range = &bus->mmioRanges[mid];
+        if (addr < range->base)
+            high = mid - 1;
+        else if (addr >= range->base + range->size)
+            low = mid + 1;
+        else
+        {
+            *offset = addr - range->base;
+            return &bus->devices[range->device];
+        }
+    }
+    return NULL;
+}
+
+static void unhandledAccess(DeviceBus *bus, const char *kind, uint64_t addr, uint8_t *data, uint32_t length, uint8_t isWrite)
+{
+    // reads from missing devices return all ones, like on real bus
+    if (!isWrite)
+        memset(data, 0xFF, length);
+    if (bus->unhandledCount++ == 0)
+        printf("{Guest %d} Error: no device at %s 0x%llx, further unhandled accesses are only counted\n", bus->guestId, kind,
+               (unsigned long long)addr);
+}
+
+int dispatchPortExit(DeviceBus *bus, struct kvm_run *run)
+{
+    uint8_t *data = (uint8_t *)run + run->io.data_offset;
+    Device *device = findPortDevice(bus, run->io.port);
+    PortHandler handler = NULL;
+    if (device)
+        handler = (run->io.direction == KVM_EXIT_IO_OUT) ? device->out : device->in;
+    if (handler)
+        return handler(device->state, run->io.port, data, run->io.size, run->io.count);
+    if (!device)
+        unhandledAccess(bus, "port", run->io.port, data, run->io.size * run->io.count, run->io.direction == KVM_EXIT_IO_OUT);
+    return DEVICE_CONTINUE;
+}
+
+int dispatchMmioExit(DeviceBus *bus, struct kvm_run *run)
+{
+    uint64_t offset = 0;
+    Device *device = findMmioDevice(bus, run->mmio.phys_addr, &offset);
+    if (device && device->mmio)
+        return device->mmio(device->state, offset, run->mmio.data, run->mmio.len, run->mmio.is_write);
+    unhandledAccess(bus, "MMIO address", run->mmio.phys_addr, run->mmio.data, run->mmio.len, run->mmio.is_write);
+    return DEVICE_CONTINUE;
+}
+
+void deleteDeviceBus(DeviceBus *bus)
+{
+    for (int i = 1; i <= bus->deviceCount; i++)
+        if (bus->devices[i].destroy)
+            bus->devices[i].destroy(bus->devices[i].state);
+    for (int i = 0; i < PORT_PAGES; i++)
+        free(bus->portPages[i]);
+    free(bus->mmioRanges);
+    if (bus->unhandledCount > 1)
+        printf("{Guest %d} Error: %ld accesses to missing devices\n", bus->guestId, bus->unhandledCount);
+    free(bus);
+}
@@ -0,0 +1,65 @@
+#ifndef DEVICE_BUS_H
+#define DEVICE_BUS_H
+
+#include <stdint.h>
+#include <linux/kvm.h>
+
+// Registry of emulated devices of one guest. Devices register port and MMIO ranges with their handlers,
+// and exits are dispatched by direct lookup over 64K port space and by binary search over sorted MMIO ranges
+
+#define MAX_DEVICES 15 // per guest, device index 0 means no device
+#define PORT_PAGES 256 // 64K port space as 256 pages of 256 ports
+#define PORT_PAGE_SIZE 256
+
+#define DEVICE_CONTINUE 0
+#define DEVICE_STOP 1 // returned by handler when guest should stop running
+
+// Port handlers get size and count of the access, so rep outs/ins exits are handled at once
+typedef int (*PortHandler)(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count);
+typedef int (*MmioHandler)(void *state, uint64_t offset, uint8_t *data, uint32_t length, uint8_t isWrite);
+
+typedef struct
+{
+    const char *name;
+    void *state;
+    PortHandler out; // NULL - device ignores writes
+    PortHandler in;  // NULL - device ignores reads
+    MmioHandler mmio;
+    void (*destroy)(void *state);
+} Device;
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t size;
+    uint8_t device;
+} MmioRange;
+
+typedef struct
+{
+    int guestId;
+    Device devices[MAX_DEVICES + 1];
+    int deviceCount;
+    uint8_t *portPages[PORT_PAGES]; // only pages with registered ports are allocated
+    MmioRange *mmioRanges;          // sorted by base, not overlapping
+    int mmioCount;
+    long unhandledCount;
+} DeviceBus;
+
+DeviceBus *createDeviceBus(int guestId);
+void deleteDeviceBus(DeviceBus *bus);
+int addDevice(DeviceBus *bus, const char *name, void *state, PortHandler out, PortHandler in, MmioHandler mmio,
+              void (*destroy)(void *state));
+int registerPorts(DeviceBus *bus, int device, uint16_t first, int count);
+int registerMmio(DeviceBus *bus, int device, uint64_t base, uint64_t size);
+int dispatchPortExit(DeviceBus *bus, struct kvm_run *run);
+int dispatchMmioExit(DeviceBus *bus, struct kvm_run *run);
+
+static inline Device *findPortDevice(DeviceBus *bus, uint16_t port)
+{
+    uint8_t *page = bus->portPages[port / PORT_PAGE_SIZE];
+    uint8_t index = page ? page[port % PORT_PAGE_SIZE] : 0;
+    return index ? &bus->devices[index] : NULL;
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "file_device.h"
+
+// Microbenchmark of file device: drives it with the same port bytes guest library would send,
+// so file system changes can be measured without KVM
+
+static FileDevice *device;
+
+static void putBytes(uint8_t *buffer, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        buffer[i] = (uint8_t)((value >> (8 * (bytes - 1 - i))) & 0xFF);
+}
+
+static uint64_t getBytes(uint8_t *buffer, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | buffer[i];
+    return value;
+}
+
+static int benchOpen(char *name, char mode)
+{
+    uint8_t request[256];
+    int length = strlen(name);
+    request[0] = (uint8_t)mode;
+    memcpy(request + 1, name, length + 1);
+    fileDeviceOut(device, request, length + 2);
+    uint8_t reply[4];
+    fileDeviceIn(device, reply, 4);
+    return (int)getBytes(reply, 4);
+}
+
+static char benchClose(int fd)
+{
+    uint8_t request[5];
+    request[0] = FILE_CLOSE;
+    putBytes(request + 1, (uint32_t)fd, 4);
+    fileDeviceOut(device, request, 5);
+    uint8_t reply;
+    fileDeviceIn(device, &reply, 1);
+    return (char)reply;
+}
+
+static char benchWrite(int fd, char c)
+{
+    uint8_t request[6];
+    request[0] = FILE_WRITE;
+    putBytes(request + 1, (uint32_t)fd, 4);
+    request[5] = (uint8_t)c;
+    fileDeviceOut(device, request, 6);
+    uint8_t reply;
+    fileDeviceIn(device, &reply, 1);
+    return (char)reply;
+}
+
+static char benchRead(int fd)
+{
+    uint8_t request[5];
+    request[0] = FILE_READ;
+    putBytes(request + 1, (uint32_t)fd, 4);
+    fileDeviceOut(device, request, 5);
+    uint8_t reply;
+    fileDeviceIn(device, &reply, 1);
+    return (char)reply;
+}
+
+static int benchPwrite(int fd, uint8_t *data, uint32_t length, int64_t offset)
+{
+    uint8_t request[17 + FILE_IO_MAX];
+    request[0] = FILE_PWRITE;
+    putBytes(request + 1, (uint32_t)fd, 4);
+    putBytes(request + 5, (uint64_t)offset, 8);
+    putBytes(request + 13, length, 4);
+    memcpy(request + 17, data, length);
+    fileDeviceOut(device, request, 17 + length);
+    uint8_t reply[4];
+    fileDeviceIn(device, reply, 4);
+    return (int)getBytes(reply, 4);
+}
+
+static int benchPread(int fd, uint8_t *data, uint32_t length, int64_t offset)
+{
+    uint8_t request[17];
+    request[0] = FILE_PREAD;
+    putBytes(request + 1, (uint32_t)fd, 4);
+    putBytes(request + 5, (uint64_t)offset, 8);
+    putBytes(request + 13, length, 4);
+    fileDeviceOut(device, request, 17);
+    uint8_t reply[4];
+    fileDeviceIn(device, reply, 4);
+    int result = (int)getBytes(reply, 4);
+    if (result > 0)
+        fileDeviceIn(device, data, result);
+    return result;
+}
+
+static struct timespec phaseStart;
+
+static void startPhase()
+{
+    clock_gettime(CLOCK_MONOTONIC, &phaseStart);
+}
+
+static void endPhase(char *name, long operations, long failures)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - phaseStart.tv_sec) * 1000.0 + (end.tv_nsec - phaseStart.tv_nsec) / 1000000.0;
+    printf("%-22s %10ld ops %10.1f ms %12.0f ops/s", name, operations, ms, ms > 0 ? operations * 1000.0 / ms : 0.0);
+    if (failures)
+        printf("  (%ld failed)", failures);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    long files = 10000, operations = 1000000, blocks = 100000;
+    size_t scratch = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--files") == 0) && i + 1 < argc)
+            files = atol(argv[++i]);
+        else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--ops") == 0) && i + 1 < argc)
+            operations = atol(argv[++i]);
+        else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--blocks") == 0) && i + 1 < argc)
+            blocks = atol(argv[++i]);
+        else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--scratch") == 0) && i + 1 < argc)
+            scratch = (size_t)atol(argv[++i]) * 1024 * 1024;
+        else
+        {
+            printf("Usage: file_bench [-f files] [-o byte operations] [-b 4KB blocks] [-r scratch MB]\n");
+            return -1;
+        }
+    }
+    if (files < 1 || operations < 1 || blocks < 1)
+    {
+        printf("Error: counts must be positive\n");
+        return -1;
+    }
+
+    // local files are created in directory of guest, benchmark uses its own temporary one
+    char directory[] = "file_bench.XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) != 0)
+    {
+        printf("Error: cannot create working directory\n");
+        return -1;
+    }
+    FileDeviceConfig config = {0, NULL, DURABILITY_NONE, scratch, 0, NULL, NULL, NULL, NULL, NULL, "."};
+    device = createFileDevice(&config);
+    if (!device)
+    {
+        printf("Error: failed to create file device\n");
+        return -1;
+    }
+    printf("File device benchmark (%s)\n", scratch ? "scratch store" : "local files on disk");
+
+    char name[64];
+    long failures = 0;
+    startPhase();
+    for (long i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "bench%ld", i);
+        int fd = benchOpen(name, FILE_OPEN_W);
+        if (fd < 0 || benchWrite(fd, 'x') == -1 || benchClose(fd) != 0)
+            failures++;
+    }
+    endPhase("create/write/close", files, failures);
+
+    failures = 0;
+    startPhase();
+    for (long i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "bench%ld", i);
+        int fd = benchOpen(name, FILE_OPEN_R);
+        if (fd < 0 || benchRead(fd) != 'x' || benchClose(fd) != 0)
+            failures++;
+    }
+    endPhase("open/read/close", files, failures);
+
+    // same file opened again and again is served from host fd cache
+    failures = 0;
+    startPhase();
+    for (long i = 0; i < operations; i++)
+    {
+        int fd = benchOpen("bench0", FILE_OPEN_R);
+        if (fd < 0 || benchRead(fd) != 'x' || benchClose(fd) != 0)
+            failures++;
+    }
+    endPhase("reopen/read/close", operations, failures);
+
+    int fd = benchOpen("bench_data", FILE_OPEN_W);
+    failures = 0;
+    startPhase();
+    for (long i = 0; i < operations; i++)
+        if (benchWrite(fd, (char)('a' + i % 26)) == -1)
+            failures++;
+    endPhase("byte write", operations, failures);
+
+    uint8_t *block = (uint8_t *)malloc(FILE_IO_MAX);
+    memset(block, 'b', FILE_IO_MAX);
+    long blockCount = 1 + (long)(operations / FILE_IO_MAX);
+    failures = 0;
+    startPhase();
+    for (long i = 0; i < blocks; i++)
+        if (benchPwrite(fd, block, FILE_IO_MAX, (i % blockCount) * FILE_IO_MAX) != FILE_IO_MAX)
+            failures++;
+    endPhase("4KB pwrite", blocks, failures);
+    benchClose(fd);
+
+    fd = benchOpen("bench_data", FILE_OPEN_R);
+    failures = 0;
+    startPhase();
+    for (long i = 0; i < blocks; i++)
+        if (benchPread(fd, block, FILE_IO_MAX, (i % blockCount) * FILE_IO_MAX) <= 0)
+            failures++;
+    endPhase("4KB pread", blocks, failures);
+    benchClose(fd);
+
+    deleteFileDevice(device);
+    free(block);
+    FdCacheStats fdCacheStats;
+    getFdCacheStats(&fdCacheStats);
+    printf("Host fd cache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)fdCacheStats.hits,
+           (unsigned long long)fdCacheStats.misses, (unsigned long long)fdCacheStats.evictions);
+    closeFdCache();
+
+    for (long i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "bench%ld", i);
+        unlink(name);
+    }
+    unlink("bench_data");
+    if (chdir("..") == 0)
+        rmdir(directory);
+    return 0;
+}
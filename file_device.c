@@ -0,0 +1,2006 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "file_device.h"
+
+#define SCRATCH_CHUNK 0x10000 // 64KB
+#define SCRATCH_FD 0x7FFFFFFF // host fd of files kept in scratch store
+#define FILE_NAME_SIZE (MAX_PATH_LENGTH + 1) // guest's file name with terminating zero
+#define FILE_SLAB_SIZE 64 // file records allocated at once
+#define FD_CACHE_SIZE 64 // host fds kept open after guests closed their files
+#define FD_CACHE_BUCKETS 256
+#define FILE_INDEX_SIZE 64 // initial buckets of device's file indexes, doubled as guest adds records
+
+#define FSTATE1_NONE 0
+#define FSTATE1_OPEN_R 1
+#define FSTATE1_OPEN_W 2
+#define FSTATE1_CLOSE 3
+#define FSTATE1_READ 4
+#define FSTATE1_WRITE 5
+#define FSTATE2_NONE 6
+#define FSTATE2_START 7
+#define FSTATE2_FILENAME 8
+#define FSTATE2_FD 9
+#define FSTATE2_CHAR 10
+#define FSTATE1_SEEK 11
+#define FSTATE1_PREAD 12
+#define FSTATE1_PWRITE 13
+#define FSTATE1_STAT 14
+#define FSTATE2_OFFSET 15
+#define FSTATE2_WHENCE 16
+#define FSTATE2_LENGTH 17
+#define FSTATE2_DATA 18
+#define FSTATE2_REPLY 19
+#define FSTATE1_MMAP 20
+#define FSTATE2_MODE 21
+
+// File written in periodic durability mode, owned by syncer thread after guest closes it
+typedef struct
+{
+    LLNode node; // links entry into syncer's list, or into its free list once entry is released
+    int fd;      // duplicate of guest file's host fd
+    atomic_int dirty;
+    atomic_int closed;
+} SyncEntry;
+
+// Directory file names are resolved in, identified independently of path it was opened with
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} DirId;
+
+// Host fd of file opened for reading, shared by all guest files that read the same host file. Guest files keep their
+// own offsets and read with pread, so fd's offset is never used
+typedef struct FdCacheEntry
+{
+    struct FdCacheEntry *hashNext;
+    struct FdCacheEntry *lruPrev; // entries nobody uses are in LRU list, most recently released first
+    struct FdCacheEntry *lruNext;
+    DirId dir;
+    int flags;
+    char name[FILE_NAME_SIZE];
+    int fd;
+    int users;
+} FdCacheEntry;
+
+// In-memory store for guest's local files, chunks are carved from one lazily populated arena
+typedef struct
+{
+    char *arena;
+    size_t arenaSize;
+    size_t bump;
+    void *freeChunks; // linked through first word of each free chunk
+    size_t used;
+    size_t peak;
+    int spilledCount;
+    char exportOnExit; // 0 - no, 1 - yes
+    int dir;           // guest's directory, spilled and exported files are written into it
+    LinkedList *files;
+    struct MemFile **buckets; // files by name, doubled once there are more files than buckets
+    unsigned int bucketCount; // power of two
+    unsigned int fileCount;
+} ScratchStore;
+
+typedef struct MemFile
+{
+    LLNode node; // links file into store's list
+    struct MemFile *hashNext; // next file in store's bucket
+    char name[FILE_NAME_SIZE];
+    int64_t size;
+    char **chunks;
+    int chunkCount;
+    int chunkCapacity;
+    char spilled; // 0 - no, 1 - yes (moved to disk because of store size limit)
+    ScratchStore *store;
+} MemFile;
+
+typedef struct MyFile
+{
+    LLNode node; // links file into shared or local file list, or into device's free list once file is deleted
+    LLNode **link; // list head or next field of previous record, so file is unlinked without walking its list
+    struct MyFile *nameNext; // next record in bucket of name index
+    struct MyFile *fdNext;   // next record in bucket of guest fd index
+    char name[FILE_NAME_SIZE];
+    char canRead;  // 0 - no, 1 - yes
+    char canWrite; // 0 - no, 1 - yes
+    char shared;   // 0 - local file in guest's directory, 1 - shared file guest reads
+    int guestFd;
+    int hostFd;
+    long long sizeHint; // size of file when it was last closed after writing, used for preallocation
+    SyncEntry *syncEntry;
+    MemFile *memFile;  // not NULL if file is kept in scratch store (hostFd is SCRATCH_FD)
+    FdCacheEntry *cachedFd; // not NULL if hostFd is borrowed from fd cache
+    int64_t position;  // offset of sequential access for files in scratch store or with cached fd
+} MyFile;
+
+// File records are carved from slabs and reused, so opening and closing files doesn't allocate once guest runs
+typedef struct FileSlab
+{
+    struct FileSlab *next;
+    MyFile files[FILE_SLAB_SIZE];
+} FileSlab;
+
+// Records of each list are found by name and open records by guest fd, so guest with many files doesn't walk its lists
+typedef struct
+{
+    MyFile **buckets;
+    unsigned int size; // power of two
+    unsigned int count;
+} FileIndex;
+
+struct FileDevice
+{
+    int guestId;
+    int nextGuestFd;
+    int durability;
+    ScratchStore *scratch;
+    int localDir;  // guest's directory, opened once, local file names are resolved relative to it
+    int sharedDir; // working directory of hypervisor, shared file names are resolved relative to it
+    DirId localDirId;
+    DirId sharedDirId;
+    LinkedList *sharedFileSystem;
+    LinkedList *localFileSystem;
+    FileSlab *slabs;
+    LinkedList *freeFiles;
+    FileIndex sharedNames;
+    FileIndex localNames;
+    FileIndex guestFds;
+    FILE *record;
+    MapFileFunction mapFile;
+    void *mapContext;
+    LimitIoFunction limitIo;
+    void *ioContext;
+    // state of request in progress
+    int fileState1;
+    int fileState2;
+    int remainingBytes;
+    int fd;
+    char chr;
+    char filename[MAX_PATH_LENGTH + 1];
+    int filenameLength; // MAX_PATH_LENGTH + 1 once name is too long
+    int64_t offset;
+    uint32_t ioLength;
+    uint32_t ioReceived;
+    int replyLength;
+    int replyPos;
+    uint8_t ioBuffer[FILE_IO_MAX + 8]; // positional data and replies
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    LinkedList *entries;
+    LinkedList *freeEntries; // released entries, reused by files opened later
+    int interval; // ms
+    atomic_int stop;
+    pthread_t thread;
+} syncer = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, DEFAULT_SYNC_INTERVAL, 0};
+
+static SyncEntry *registerSyncEntry(int hostFd)
+{
+    int fd = dup(hostFd);
+    if (fd < 0)
+        return NULL;
+    pthread_mutex_lock(&syncer.lock);
+    SyncEntry *entry = (SyncEntry *)syncer.freeEntries;
+    if (entry)
+        syncer.freeEntries = entry->node.next;
+    else if (!(entry = (SyncEntry *)malloc(sizeof(SyncEntry))))
+    {
+        pthread_mutex_unlock(&syncer.lock);
+        close(fd);
+        return NULL;
+    }
+    entry->fd = fd;
+    atomic_init(&entry->dirty, 0);
+    atomic_init(&entry->closed, 0);
+    entry->node.data = entry;
+    entry->node.next = syncer.entries;
+    syncer.entries = &entry->node;
+    pthread_mutex_unlock(&syncer.lock);
+    return entry;
+}
+
+// Syncs all dirty files in one batch, files closed by guests are synced one last time and released. Batch is taken out
+// of the list, so guests opening files meanwhile register them without waiting for the disk
+static void syncDirtyFiles()
+{
+    pthread_mutex_lock(&syncer.lock);
+    LLNode *batch = syncer.entries;
+    syncer.entries = NULL;
+    pthread_mutex_unlock(&syncer.lock);
+
+    LLNode *kept = NULL;
+    LLNode *keptLast = NULL;
+    LLNode *released = NULL;
+    while (batch)
+    {
+        LLNode *temp = batch;
+        SyncEntry *entry = (SyncEntry *)temp->data;
+        batch = temp->next;
+        int closed = atomic_load(&entry->closed);
+        if (atomic_exchange(&entry->dirty, 0))
+            fdatasync(entry->fd);
+        if (closed)
+        {
+            close(entry->fd);
+            temp->next = released;
+            released = temp;
+        }
+        else
+        {
+            temp->next = NULL;
+            if (keptLast)
+                keptLast->next = temp;
+            else
+                kept = temp;
+            keptLast = temp;
+        }
+    }
+
+    pthread_mutex_lock(&syncer.lock);
+    if (keptLast)
+    {
+        keptLast->next = syncer.entries;
+        syncer.entries = kept;
+    }
+    while (released)
+    {
+        LLNode *temp = released;
+        released = temp->next;
+        temp->next = syncer.freeEntries;
+        syncer.freeEntries = temp;
+    }
+    pthread_mutex_unlock(&syncer.lock);
+}
+
+static void *syncerThread(void *arg)
+{
+    struct timespec interval = {syncer.interval / 1000, (syncer.interval % 1000) * 1000000L};
+    while (!atomic_load(&syncer.stop))
+    {
+        nanosleep(&interval, NULL);
+        syncDirtyFiles();
+    }
+    syncDirtyFiles();
+    return NULL;
+}
+
+int startFileSyncer(int interval)
+{
+    syncer.interval = interval;
+    atomic_store(&syncer.stop, 0);
+    return pthread_create(&syncer.thread, NULL, &syncerThread, NULL);
+}
+
+void stopFileSyncer()
+{
+    atomic_store(&syncer.stop, 1);
+    pthread_join(syncer.thread, NULL);
+    while (syncer.freeEntries)
+    {
+        LLNode *temp = syncer.freeEntries;
+        syncer.freeEntries = temp->next;
+        free(temp->data);
+    }
+}
+
+// Host fds opened for reading are reused by all guests, so guest that opens and closes same files over and over
+// does no system calls once their fds are cached
+static struct
+{
+    pthread_mutex_t lock;
+    FdCacheEntry *buckets[FD_CACHE_BUCKETS];
+    FdCacheEntry *lruFirst;
+    FdCacheEntry *lruLast;
+    int idleCount;
+    FdCacheStats stats;
+} fdCache = {PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned int fdCacheBucket(DirId *dir, char *name, int flags)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)dir->ino ^ (unsigned int)flags;
+    for (char *p = name; *p; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return hash % FD_CACHE_BUCKETS;
+}
+
+static FdCacheEntry *findCachedFd(DirId *dir, char *name, int flags)
+{
+    for (FdCacheEntry *entry = fdCache.buckets[fdCacheBucket(dir, name, flags)]; entry; entry = entry->hashNext)
+        if (entry->dir.dev == dir->dev && entry->dir.ino == dir->ino && entry->flags == flags && strcmp(entry->name, name) == 0)
+            return entry;
+    return NULL;
+}
+
+static void unlinkLru(FdCacheEntry *entry)
+{
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        fdCache.lruFirst = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        fdCache.lruLast = entry->lruPrev;
+    entry->lruPrev = entry->lruNext = NULL;
+    fdCache.idleCount--;
+}
+
+static void unlinkHash(FdCacheEntry *entry)
+{
+    FdCacheEntry **link = &fdCache.buckets[fdCacheBucket(&entry->dir, entry->name, entry->flags)];
+    while (*link != entry)
+        link = &(*link)->hashNext;
+    *link = entry->hashNext;
+}
+
+// Takes entry out of LRU list if nobody used it, caller holds lock
+static FdCacheEntry *useCachedFd(FdCacheEntry *entry)
+{
+    if (entry->users++ == 0)
+        unlinkLru(entry);
+    return entry;
+}
+
+// Returns entry whose fd file is read with, host file is opened only if no guest has it in cache
+static FdCacheEntry *acquireCachedFd(int dir, DirId *dirId, char *name, int flags)
+{
+    pthread_mutex_lock(&fdCache.lock);
+    FdCacheEntry *entry = findCachedFd(dirId, name, flags);
+    if (entry)
+    {
+        fdCache.stats.hits++;
+        useCachedFd(entry);
+        pthread_mutex_unlock(&fdCache.lock);
+        return entry;
+    }
+    fdCache.stats.misses++;
+    pthread_mutex_unlock(&fdCache.lock);
+
+    int fd = openat(dir, name, flags);
+    if (fd < 0)
+        return NULL;
+    FdCacheEntry *newEntry = (FdCacheEntry *)calloc(1, sizeof(FdCacheEntry));
+    if (!newEntry)
+    {
+        close(fd);
+        return NULL;
+    }
+    newEntry->dir = *dirId;
+    newEntry->flags = flags;
+    strcpy(newEntry->name, name);
+    newEntry->fd = fd;
+    newEntry->users = 1;
+    pthread_mutex_lock(&fdCache.lock);
+    // other guest could open same file meanwhile, then its fd is used
+    if ((entry = findCachedFd(dirId, name, flags)))
+        useCachedFd(entry);
+    else
+    {
+        unsigned int bucket = fdCacheBucket(dirId, name, flags);
+        newEntry->hashNext = fdCache.buckets[bucket];
+        fdCache.buckets[bucket] = newEntry;
+    }
+    pthread_mutex_unlock(&fdCache.lock);
+    if (entry)
+    {
+        close(fd);
+        free(newEntry);
+        return entry;
+    }
+    return newEntry;
+}
+
+// Fd stays open for next guest that opens the file, least recently used one is closed once too many are unused
+static void releaseCachedFd(FdCacheEntry *entry)
+{
+    FdCacheEntry *evicted = NULL;
+    pthread_mutex_lock(&fdCache.lock);
+    if (--entry->users == 0)
+    {
+        entry->lruNext = fdCache.lruFirst;
+        if (fdCache.lruFirst)
+            fdCache.lruFirst->lruPrev = entry;
+        else
+            fdCache.lruLast = entry;
+        fdCache.lruFirst = entry;
+        fdCache.idleCount++;
+        if (fdCache.idleCount > FD_CACHE_SIZE)
+        {
+            evicted = fdCache.lruLast;
+            unlinkLru(evicted);
+            unlinkHash(evicted);
+            fdCache.stats.evictions++;
+        }
+    }
+    pthread_mutex_unlock(&fdCache.lock);
+    if (evicted)
+    {
+        close(evicted->fd);
+        free(evicted);
+    }
+}
+
+void getFdCacheStats(FdCacheStats *stats)
+{
+    pthread_mutex_lock(&fdCache.lock);
+    *stats = fdCache.stats;
+    pthread_mutex_unlock(&fdCache.lock);
+}
+
+void closeFdCache()
+{
+    pthread_mutex_lock(&fdCache.lock);
+    while (fdCache.lruFirst)
+    {
+        FdCacheEntry *entry = fdCache.lruFirst;
+        unlinkLru(entry);
+        unlinkHash(entry);
+        close(entry->fd);
+        free(entry);
+    }
+    pthread_mutex_unlock(&fdCache.lock);
+}
+
+// Opens file for reading with cached host fd, file is read from its own offset
+static int openCachedFile(MyFile *file, int dir, DirId *dirId, char *name)
+{
+    file->cachedFd = acquireCachedFd(dir, dirId, name, O_RDONLY);
+    file->hostFd = file->cachedFd ? file->cachedFd->fd : -1;
+    file->position = 0;
+    return file->cachedFd ? 0 : -1;
+}
+
+// Guest can write into subdirectories of its directory, they are created the first time file is written into them
+static int createLocalFile(int dir, char *name)
+{
+    int fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (fd >= 0 || errno != ENOENT || name[0] == '/' || !strchr(name, '/'))
+        return fd;
+    char path[FILE_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s", name);
+    for (char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdirat(dir, path, S_IRWXU | S_IRWXG | S_IRWXO);
+        *slash = '/';
+    }
+    return openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IRWXO);
+}
+
+char *copyFilename(char *filename)
+{
+    if (!filename)
+        return NULL;
+    int l = strlen(filename);
+    char *result = (char *)malloc(l + 1);
+    if (!result)
+        return NULL;
+    strcpy(result, filename);
+    return result;
+}
+
+static unsigned int nameHash(char *name)
+{
+    unsigned int hash = 2166136261u;
+    for (char *p = name; *p; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return hash;
+}
+
+static ScratchStore *createScratchStore(size_t limit, char exportOnExit, int dir)
+{
+    ScratchStore *store = (ScratchStore *)calloc(1, sizeof(ScratchStore));
+    if (!store)
+        return NULL;
+    store->buckets = (MemFile **)calloc(FILE_INDEX_SIZE, sizeof(MemFile *));
+    store->bucketCount = FILE_INDEX_SIZE;
+    if (!store->buckets)
+    {
+        free(store);
+        return NULL;
+    }
+    store->arenaSize = (limit + SCRATCH_CHUNK - 1) / SCRATCH_CHUNK * SCRATCH_CHUNK;
+    store->arena = mmap(NULL, store->arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (store->arena == MAP_FAILED)
+    {
+        free(store->buckets);
+        free(store);
+        return NULL;
+    }
+    store->exportOnExit = exportOnExit;
+    store->dir = dir;
+    return store;
+}
+
+static char *allocChunk(ScratchStore *store)
+{
+    char *chunk;
+    if (store->freeChunks)
+    {
+        chunk = (char *)store->freeChunks;
+        store->freeChunks = *(void **)chunk;
+        memset(chunk, 0, SCRATCH_CHUNK);
+    }
+    else if (store->bump + SCRATCH_CHUNK <= store->arenaSize)
+    {
+        chunk = store->arena + store->bump;
+        store->bump += SCRATCH_CHUNK;
+    }
+    else
+        return NULL;
+    store->used += SCRATCH_CHUNK;
+    if (store->used > store->peak)
+        store->peak = store->used;
+    return chunk;
+}
+
+static void truncateMemFile(MemFile *memFile)
+{
+    ScratchStore *store = memFile->store;
+    for (int i = 0; i < memFile->chunkCount; i++)
+    {
+        *(void **)memFile->chunks[i] = store->freeChunks;
+        store->freeChunks = memFile->chunks[i];
+        store->used -= SCRATCH_CHUNK;
+    }
+    memFile->chunkCount = 0;
+    memFile->size = 0;
+}
+
+static MemFile *findMemFile(ScratchStore *store, char *name)
+{
+    for (MemFile *memFile = store->buckets[nameHash(name) & (store->bucketCount - 1)]; memFile; memFile = memFile->hashNext)
+        if (strcmp(memFile->name, name) == 0)
+            return memFile;
+    return NULL;
+}
+
+// Store keeps its buckets if larger ones can't be allocated, lookups only get slower
+static void growMemFileBuckets(ScratchStore *store)
+{
+    MemFile **buckets = (MemFile **)calloc(store->bucketCount * 2, sizeof(MemFile *));
+    if (!buckets)
+        return;
+    for (unsigned int i = 0; i < store->bucketCount; i++)
+    {
+        while (store->buckets[i])
+        {
+            MemFile *memFile = store->buckets[i];
+            MemFile **bucket = &buckets[nameHash(memFile->name) & (store->bucketCount * 2 - 1)];
+            store->buckets[i] = memFile->hashNext;
+            memFile->hashNext = *bucket;
+            *bucket = memFile;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucketCount *= 2;
+}
+
+static MemFile *createMemFile(ScratchStore *store, char *name)
+{
+    MemFile *memFile = (MemFile *)calloc(1, sizeof(MemFile));
+    if (!memFile)
+        return NULL;
+    strcpy(memFile->name, name);
+    memFile->store = store;
+    memFile->node.data = memFile;
+    memFile->node.next = store->files;
+    store->files = &memFile->node;
+    MemFile **bucket = &store->buckets[nameHash(name) & (store->bucketCount - 1)];
+    memFile->hashNext = *bucket;
+    *bucket = memFile;
+    if (++store->fileCount > store->bucketCount)
+        growMemFileBuckets(store);
+    return memFile;
+}
+
+static int memRead(MemFile *memFile, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    if (offset >= memFile->size)
+        return 0;
+    if (offset + length > memFile->size)
+        length = (uint32_t)(memFile->size - offset);
+    uint32_t done = 0;
+    while (done < length)
+    {
+        int64_t pos = offset + done;
+        uint32_t inChunk = SCRATCH_CHUNK - (uint32_t)(pos % SCRATCH_CHUNK);
+        uint32_t n = (length - done < inChunk) ? length - done : inChunk;
+        int index = (int)(pos / SCRATCH_CHUNK);
+        if (index < memFile->chunkCount)
+            memcpy(buffer + done, memFile->chunks[index] + pos % SCRATCH_CHUNK, n);
+        else
+            memset(buffer + done, 0, n);
+        done += n;
+    }
+    return (int)length;
+}
+
+// Returns -1 if store has no free chunks left
+static int memWrite(MemFile *memFile, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    int needed = (int)((offset + length + SCRATCH_CHUNK - 1) / SCRATCH_CHUNK);
+    if (needed > memFile->chunkCapacity)
+    {
+        int capacity = memFile->chunkCapacity ? memFile->chunkCapacity : 4;
+        while (capacity < needed)
+            capacity *= 2;
+        char **chunks = (char **)realloc(memFile->chunks, capacity * sizeof(char *));
+        if (!chunks)
+            return -1;
+        memFile->chunks = chunks;
+        memFile->chunkCapacity = capacity;
+    }
+    while (memFile->chunkCount < needed)
+    {
+        char *chunk = allocChunk(memFile->store);
+        if (!chunk)
+            return -1;
+        memFile->chunks[memFile->chunkCount++] = chunk;
+    }
+    uint32_t done = 0;
+    while (done < length)
+    {
+        int64_t pos = offset + done;
+        uint32_t inChunk = SCRATCH_CHUNK - (uint32_t)(pos % SCRATCH_CHUNK);
+        uint32_t n = (length - done < inChunk) ? length - done : inChunk;
+        memcpy(memFile->chunks[pos / SCRATCH_CHUNK] + pos % SCRATCH_CHUNK, buffer + done, n);
+        done += n;
+    }
+    if (offset + length > memFile->size)
+        memFile->size = offset + length;
+    return (int)length;
+}
+
+static int writeMemFileToDisk(MemFile *memFile)
+{
+    int fd = createLocalFile(memFile->store->dir, memFile->name);
+    if (fd < 0)
+        return -1;
+    for (int64_t pos = 0; pos < memFile->size;)
+    {
+        // write can be partial, so pos isn't always at start of chunk
+        uint32_t n = SCRATCH_CHUNK - (uint32_t)(pos % SCRATCH_CHUNK);
+        if (memFile->size - pos < n)
+            n = (uint32_t)(memFile->size - pos);
+        int result = write(fd, memFile->chunks[pos / SCRATCH_CHUNK] + pos % SCRATCH_CHUNK, n);
+        if (result <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        pos += result;
+    }
+    close(fd);
+    return 0;
+}
+
+static int spillMemFile(MemFile *memFile)
+{
+    if (writeMemFileToDisk(memFile) != 0)
+        return -1;
+    truncateMemFile(memFile);
+    memFile->spilled = 1;
+    memFile->store->spilledCount++;
+    return 0;
+}
+
+static void deleteScratchStore(ScratchStore *store, int guestId)
+{
+    if (!store)
+        return;
+    while (store->files)
+    {
+        LLNode *temp = store->files;
+        MemFile *memFile = (MemFile *)temp->data;
+        if (store->exportOnExit && !memFile->spilled && writeMemFileToDisk(memFile) != 0)
+            printf("{Guest %d} Error: failed to export scratch file\n", guestId);
+        store->files = temp->next;
+        free(memFile->chunks);
+        free(memFile);
+    }
+    munmap(store->arena, store->arenaSize);
+    free(store->buckets);
+    free(store);
+}
+
+// Files kept in scratch store are reopened from disk after they get spilled
+static void resolveBackend(MyFile *file)
+{
+    if (!file->memFile || !file->memFile->spilled)
+        return;
+    file->hostFd = openat(file->memFile->store->dir, file->name, file->canRead ? O_RDONLY : O_WRONLY);
+    file->memFile = NULL;
+    if (file->hostFd >= 0)
+        lseek(file->hostFd, file->position, SEEK_SET);
+}
+
+static int writeScratchFile(MyFile *file, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    ScratchStore *store = file->memFile->store;
+    while (memWrite(file->memFile, buffer, length, offset) < 0)
+    {
+        // store is full, largest file is moved to disk
+        MemFile *victim = NULL;
+        for (LLNode *temp = store->files; temp; temp = temp->next)
+        {
+            MemFile *memFile = (MemFile *)temp->data;
+            if (!memFile->spilled && memFile->chunkCount > 0 && (!victim || memFile->chunkCount > victim->chunkCount))
+                victim = memFile;
+        }
+        if (!victim || victim == file->memFile)
+            victim = file->memFile;
+        if (spillMemFile(victim) != 0)
+            return -1;
+        if (victim == file->memFile)
+        {
+            resolveBackend(file);
+            return (file->hostFd < 0) ? -1 : pwrite(file->hostFd, buffer, length, offset);
+        }
+    }
+    return (int)length;
+}
+
+static int fileRead(MyFile *file, uint8_t *buffer, uint32_t length)
+{
+    resolveBackend(file);
+    if (file->cachedFd)
+    {
+        int result = pread(file->hostFd, buffer, length, file->position);
+        if (result > 0)
+            file->position += result;
+        return result;
+    }
+    if (!file->memFile)
+        return read(file->hostFd, buffer, length);
+    int result = memRead(file->memFile, buffer, length, file->position);
+    file->position += result;
+    return result;
+}
+
+static int fileWrite(MyFile *file, uint8_t *buffer, uint32_t length)
+{
+    resolveBackend(file);
+    if (!file->memFile)
+        return write(file->hostFd, buffer, length);
+    int result = writeScratchFile(file, buffer, length, file->position);
+    if (result > 0)
+        file->position += result;
+    if (!file->memFile && file->hostFd >= 0)
+        lseek(file->hostFd, file->position, SEEK_SET);
+    return result;
+}
+
+static int filePread(MyFile *file, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    resolveBackend(file);
+    if (!file->memFile)
+        return pread(file->hostFd, buffer, length, offset);
+    return memRead(file->memFile, buffer, length, offset);
+}
+
+static int filePwrite(MyFile *file, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    resolveBackend(file);
+    if (!file->memFile)
+        return pwrite(file->hostFd, buffer, length, offset);
+    return writeScratchFile(file, buffer, length, offset);
+}
+
+static int64_t fileSize(MyFile *file)
+{
+    resolveBackend(file);
+    if (file->memFile)
+        return file->memFile->size;
+    struct stat st;
+    if (fstat(file->hostFd, &st) < 0)
+        return -1;
+    return st.st_size;
+}
+
+static int64_t fileSeek(MyFile *file, int64_t offset, int whence)
+{
+    resolveBackend(file);
+    if (!file->memFile && !file->cachedFd)
+        return lseek(file->hostFd, offset, whence);
+    int64_t base = (whence == SEEK_SET) ? 0 : ((whence == SEEK_CUR) ? file->position : fileSize(file));
+    if (base < 0 || base + offset < 0)
+        return -1;
+    file->position = base + offset;
+    return file->position;
+}
+
+static void fileClose(MyFile *file)
+{
+    if (file->cachedFd)
+        releaseCachedFd(file->cachedFd);
+    else if (!file->memFile && file->hostFd > -1)
+        close(file->hostFd);
+    file->memFile = NULL;
+    file->cachedFd = NULL;
+}
+
+// Slab is allocated only when every record is in use, records of deleted files are reused first
+static MyFile *allocFile(FileDevice *device)
+{
+    if (!device->freeFiles)
+    {
+        FileSlab *slab = (FileSlab *)calloc(1, sizeof(FileSlab));
+        if (!slab)
+            return NULL;
+        slab->next = device->slabs;
+        device->slabs = slab;
+        for (int i = FILE_SLAB_SIZE - 1; i >= 0; i--)
+        {
+            slab->files[i].node.next = device->freeFiles;
+            device->freeFiles = &slab->files[i].node;
+        }
+    }
+    MyFile *file = (MyFile *)device->freeFiles;
+    device->freeFiles = file->node.next;
+    memset(file, 0, sizeof(MyFile));
+    file->node.data = file;
+    return file;
+}
+
+static void releaseFile(FileDevice *device, MyFile *file)
+{
+    file->node.next = device->freeFiles;
+    device->freeFiles = &file->node;
+}
+
+static int initFileIndex(FileIndex *index)
+{
+    index->buckets = (MyFile **)calloc(FILE_INDEX_SIZE, sizeof(MyFile *));
+    index->size = FILE_INDEX_SIZE;
+    index->count = 0;
+    return index->buckets ? 0 : -1;
+}
+
+static MyFile **nameBucket(FileIndex *index, char *name)
+{
+    return &index->buckets[nameHash(name) & (index->size - 1)];
+}
+
+static MyFile **fdBucket(FileIndex *index, int fd)
+{
+    return &index->buckets[(unsigned int)fd & (index->size - 1)];
+}
+
+// Index keeps its buckets if larger ones can't be allocated, lookups only get slower
+static void growFileIndex(FileIndex *index, char byName)
+{
+    if (index->count <= index->size)
+        return;
+    MyFile **old = index->buckets;
+    unsigned int oldSize = index->size;
+    MyFile **buckets = (MyFile **)calloc(oldSize * 2, sizeof(MyFile *));
+    if (!buckets)
+        return;
+    index->buckets = buckets;
+    index->size = oldSize * 2;
+    for (unsigned int i = 0; i < oldSize; i++)
+    {
+        while (old[i])
+        {
+            MyFile *file = old[i];
+            if (byName)
+            {
+                MyFile **bucket = nameBucket(index, file->name);
+                old[i] = file->nameNext;
+                file->nameNext = *bucket;
+                *bucket = file;
+            }
+            else
+            {
+                MyFile **bucket = fdBucket(index, file->guestFd);
+                old[i] = file->fdNext;
+                file->fdNext = *bucket;
+                *bucket = file;
+            }
+        }
+    }
+    free(old);
+}
+
+static void indexName(FileIndex *index, MyFile *file)
+{
+    MyFile **bucket = nameBucket(index, file->name);
+    file->nameNext = *bucket;
+    *bucket = file;
+    index->count++;
+    growFileIndex(index, 1);
+}
+
+static void unindexName(FileIndex *index, MyFile *file)
+{
+    MyFile **link = nameBucket(index, file->name);
+    while (*link != file)
+        link = &(*link)->nameNext;
+    *link = file->nameNext;
+    index->count--;
+}
+
+static void indexGuestFd(FileDevice *device, MyFile *file)
+{
+    MyFile **bucket = fdBucket(&device->guestFds, file->guestFd);
+    file->fdNext = *bucket;
+    *bucket = file;
+    device->guestFds.count++;
+    growFileIndex(&device->guestFds, 0);
+}
+
+static int assignGuestFd(FileDevice *device, MyFile *file)
+{
+    file->guestFd = device->nextGuestFd;
+    device->nextGuestFd += 1;
+    indexGuestFd(device, file);
+    return file->guestFd;
+}
+
+static void releaseGuestFd(FileDevice *device, MyFile *file)
+{
+    if (file->guestFd < 0)
+        return;
+    MyFile **link = fdBucket(&device->guestFds, file->guestFd);
+    while (*link != file)
+        link = &(*link)->fdNext;
+    *link = file->fdNext;
+    device->guestFds.count--;
+    file->guestFd = -1;
+}
+
+static MyFile *findGuestFd(FileDevice *device, int fd)
+{
+    for (MyFile *file = *fdBucket(&device->guestFds, fd); file; file = file->fdNext)
+        if (file->guestFd == fd)
+            return file;
+    return NULL;
+}
+
+static FileIndex *listIndex(FileDevice *device, LinkedList **list)
+{
+    return (list == &device->sharedFileSystem) ? &device->sharedNames : &device->localNames;
+}
+
+static void pushFile(FileDevice *device, LinkedList **list, MyFile *file)
+{
+    file->node.next = *list;
+    file->link = list;
+    if (*list)
+        ((MyFile *)(*list)->data)->link = (LLNode **)&file->node.next;
+    *list = &file->node;
+    indexName(listIndex(device, list), file);
+}
+
+static void deleteFile(FileDevice *device, LinkedList **list, MyFile *file)
+{
+    *file->link = file->node.next;
+    if (file->node.next)
+        ((MyFile *)((LLNode *)file->node.next)->data)->link = file->link;
+    unindexName(listIndex(device, list), file);
+    releaseGuestFd(device, file);
+    if (file->syncEntry)
+        atomic_store(&file->syncEntry->closed, 1);
+    fileClose(file);
+    releaseFile(device, file);
+}
+
+static void deleteFileList(FileDevice *device, LinkedList **list)
+{
+    while (*list)
+    {
+        deleteFile(device, list, (*list)->data);
+    }
+}
+
+void printFileList(LinkedList *list)
+{
+    printf("File list:\n");
+    LLNode *temp = list;
+    while (temp)
+    {
+        printf("\tNew file\n");
+        MyFile *tempFile = (MyFile *)temp->data;
+        printf("\t\tName: '%s'\n", tempFile->name);
+        printf("\t\tGuest fd: %d\n", tempFile->guestFd);
+        printf("\t\tHost fd: %d\n", tempFile->hostFd);
+        printf("\t\tCan read: %d\n", tempFile->canRead);
+        printf("\t\tCan write: %d\n", tempFile->canWrite);
+        temp = temp->next;
+    }
+}
+
+// Local files of guest are kept in scratch store if it is enabled, otherwise they are opened on disk
+static int openLocalFile(MyFile *file, char *localName, char toRead, FileDevice *device)
+{
+    file->memFile = NULL;
+    file->position = 0;
+    ScratchStore *store = device->scratch;
+    if (store)
+    {
+        MemFile *memFile = findMemFile(store, localName);
+        if (memFile && memFile->spilled)
+            store = NULL;
+        else if (toRead && memFile)
+        {
+            file->memFile = memFile;
+            file->hostFd = SCRATCH_FD;
+            return 0;
+        }
+        else if (!toRead)
+        {
+            if (memFile)
+                truncateMemFile(memFile);
+            else if (!(memFile = createMemFile(store, localName)))
+                return -1;
+            file->memFile = memFile;
+            file->hostFd = SCRATCH_FD;
+            return 0;
+        }
+    }
+    if (toRead)
+        return openCachedFile(file, device->localDir, &device->localDirId, localName);
+    file->hostFd = createLocalFile(device->localDir, localName);
+    return (file->hostFd < 0) ? -1 : 0;
+}
+
+// Reused record keeps size hint of its last close, new record has none and takes it from other record of same file
+static void initOpenedFile(MyFile *file, FileDevice *device)
+{
+    file->syncEntry = NULL;
+    if (!file->canWrite || file->memFile)
+        return;
+    for (MyFile *tempFile = *nameBucket(&device->localNames, file->name); tempFile; tempFile = tempFile->nameNext)
+    {
+        if (tempFile->sizeHint > 0 && strcmp(tempFile->name, file->name) == 0)
+        {
+            // file is usually rewritten with similar size, preallocation is only a hint so errors are ignored
+            fallocate(file->hostFd, FALLOC_FL_KEEP_SIZE, 0, tempFile->sizeHint);
+            break;
+        }
+    }
+    if (device->durability == DURABILITY_PERIODIC)
+        file->syncEntry = registerSyncEntry(file->hostFd);
+}
+
+// Record of file guest closed after writing is reused when file is written again, so list of local files doesn't
+// grow with every open
+static int openLocalRecord(char *localName, char toRead, FileDevice *device)
+{
+    MyFile *file = NULL;
+    for (MyFile *tempFile = toRead ? NULL : *nameBucket(&device->localNames, localName); tempFile && !file; tempFile = tempFile->nameNext)
+    {
+        if (tempFile->guestFd < 0 && tempFile->hostFd < 0 && !tempFile->canRead && !tempFile->canWrite && !tempFile->shared &&
+            strcmp(tempFile->name, localName) == 0)
+            file = tempFile;
+    }
+    int reused = (file != NULL);
+    if (!file && !(file = allocFile(device)))
+        return -1;
+    if (openLocalFile(file, localName, toRead, device) != 0)
+    {
+        file->hostFd = -1;
+        if (!reused)
+            releaseFile(device, file);
+        return -1;
+    }
+    if (!reused)
+    {
+        strcpy(file->name, localName);
+        pushFile(device, &device->localFileSystem, file);
+    }
+    file->canRead = toRead;
+    file->canWrite = 1 - toRead;
+    initOpenedFile(file, device);
+    // printFileList(device->localFileSystem);
+    return assignGuestFd(device, file);
+}
+
+static int openFile(FileDevice *device, char *name, char toRead)
+{
+    MyFile *localFile = NULL;
+    MyFile *sharedFile = NULL;
+    for (MyFile *tempFile = *nameBucket(&device->sharedNames, name); tempFile && !sharedFile; tempFile = tempFile->nameNext)
+    {
+        if (strcmp(tempFile->name, name) == 0)
+            sharedFile = tempFile;
+    }
+    if (!sharedFile)
+    {
+        for (MyFile *tempFile = *nameBucket(&device->localNames, name); tempFile && !localFile; tempFile = tempFile->nameNext)
+        {
+            if (!tempFile->shared && strcmp(tempFile->name, name) == 0)
+                localFile = tempFile;
+        }
+        if (!localFile && toRead)
+            return -1;
+        return openLocalRecord(name, toRead, device);
+    }
+    else
+    {
+        if (sharedFile->canRead)
+        {
+            if (toRead)
+            {
+                MyFile *newFile = allocFile(device);
+                if (!newFile)
+                {
+                    return -1;
+                }
+                if (openCachedFile(newFile, device->sharedDir, &device->sharedDirId, name) != 0)
+                {
+                    releaseFile(device, newFile);
+                    return -1;
+                }
+                newFile->canRead = 1;
+                newFile->canWrite = 0;
+                newFile->shared = 1;
+                strcpy(newFile->name, name);
+                pushFile(device, &device->localFileSystem, newFile);
+                initOpenedFile(newFile, device);
+                // printFileList(device->localFileSystem);
+                return assignGuestFd(device, newFile);
+            }
+            else
+            {
+                sharedFile->canRead = 0;
+                for (MyFile *tempFile = *nameBucket(&device->localNames, name); tempFile; tempFile = tempFile->nameNext)
+                {
+                    if (tempFile->shared && strcmp(tempFile->name, name) == 0)
+                    {
+                        fileClose(tempFile);
+                        tempFile->hostFd = -1;
+                        releaseGuestFd(device, tempFile);
+                    }
+                }
+                return openLocalRecord(name, 0, device);
+            }
+        }
+        else
+            return openLocalRecord(name, toRead, device);
+    }
+}
+
+static char closeFile(FileDevice *device, int fd, int durability)
+{
+    MyFile *foundFile = findGuestFd(device, fd);
+    if (!foundFile)
+        return EOF;
+    if (foundFile->hostFd < 0)
+        return EOF;
+    else
+    {
+        if (foundFile->canWrite)
+        {
+            if (durability == DURABILITY_CLOSE && !foundFile->memFile)
+                fdatasync(foundFile->hostFd);
+            foundFile->sizeHint = fileSize(foundFile);
+        }
+        if (foundFile->syncEntry)
+        {
+            atomic_store(&foundFile->syncEntry->closed, 1);
+            foundFile->syncEntry = NULL;
+        }
+        fileClose(foundFile);
+        releaseGuestFd(device, foundFile);
+        foundFile->hostFd = -1;
+        foundFile->canRead = 0;
+        if (foundFile->canWrite)
+        {
+            foundFile->canWrite = 0;
+        }
+        else
+        {
+            deleteFile(device, &device->localFileSystem, foundFile);
+        }
+    }
+    return 0;
+}
+
+static char readFile(FileDevice *device, int fd)
+{
+    MyFile *foundFile = findGuestFd(device, fd);
+    if (!foundFile)
+        return EOF;
+    if (!foundFile->canRead)
+        return EOF;
+    if (foundFile->hostFd < 0)
+        return EOF;
+    uint8_t buffer[1];
+    int result = fileRead(foundFile, buffer, 1);
+    if (result < 1)
+        return EOF;
+    return (char)buffer[0];
+}
+
+static void markDirty(MyFile *file)
+{
+    if (file->syncEntry && !atomic_load_explicit(&file->syncEntry->dirty, memory_order_relaxed))
+        atomic_store(&file->syncEntry->dirty, 1);
+}
+
+static char writeFile(FileDevice *device, int fd, char c)
+{
+    MyFile *foundFile = findGuestFd(device, fd);
+    if (!foundFile)
+        return EOF;
+    if (!foundFile->canWrite)
+        return EOF;
+    if (foundFile->hostFd < 0)
+        return EOF;
+    uint8_t buffer[1] = {(uint8_t)c};
+    int result = fileWrite(foundFile, buffer, 1);
+    if (result < 1)
+        return EOF;
+    markDirty(foundFile);
+    return c;
+}
+
+static MyFile *findOpenFile(FileDevice *device, int fd)
+{
+    MyFile *file = findGuestFd(device, fd);
+    return (!file || file->hostFd < 0) ? NULL : file;
+}
+
+static int64_t seekFile(FileDevice *device, int fd, int64_t offset, int whence)
+{
+    MyFile *file = findOpenFile(device, fd);
+    if (!file || (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END))
+        return -1;
+    return fileSeek(file, offset, whence);
+}
+
+static int preadFile(FileDevice *device, int fd, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    MyFile *file = findOpenFile(device, fd);
+    if (!file || !file->canRead || offset < 0)
+        return -1;
+    return filePread(file, buffer, length, offset);
+}
+
+static int pwriteFile(FileDevice *device, int fd, uint8_t *buffer, uint32_t length, int64_t offset)
+{
+    MyFile *file = findOpenFile(device, fd);
+    if (!file || !file->canWrite || offset < 0)
+        return -1;
+    int result = filePwrite(file, buffer, length, offset);
+    if (result > 0)
+        markDirty(file);
+    return result;
+}
+
+static int64_t statFile(FileDevice *device, int fd)
+{
+    MyFile *file = findOpenFile(device, fd);
+    if (!file)
+        return -1;
+    return fileSize(file);
+}
+
+// Only files read from host file system can be mapped, files in scratch store have no host fd
+static int64_t mmapFile(FileDevice *device, int fd, int mode)
+{
+    MyFile *file = findOpenFile(device, fd);
+    if (!file || !file->canRead || !device->mapFile || (mode != FILE_MAP_SHARED && mode != FILE_MAP_PRIVATE))
+        return -1;
+    resolveBackend(file);
+    if (file->memFile || file->hostFd < 0)
+        return -1;
+    return device->mapFile(device->mapContext, file->hostFd, mode);
+}
+
+static void limitIo(FileDevice *device, uint32_t bytes)
+{
+    if (device->limitIo)
+        device->limitIo(device->ioContext, bytes);
+}
+
+static int putBigEndian(uint8_t *buffer, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        buffer[i] = (uint8_t)((value >> (8 * (bytes - 1 - i))) & 0xFF);
+    return bytes;
+}
+
+static void fileDeviceOutByte(FileDevice *device, char c)
+{
+    if (device->fileState2 == FSTATE2_DATA)
+    {
+        // FILE_PWRITE payload
+        device->ioBuffer[device->ioReceived++] = (uint8_t)c;
+        if (device->ioReceived == device->ioLength)
+        {
+            limitIo(device, device->ioLength);
+            int result = pwriteFile(device, device->fd, device->ioBuffer, device->ioLength, device->offset);
+            device->replyLength = putBigEndian(device->ioBuffer, (uint32_t)result, 4);
+            device->replyPos = 0;
+            device->fileState2 = FSTATE2_REPLY;
+        }
+        return;
+    }
+    switch (device->fileState1)
+    {
+    case FSTATE1_OPEN_R:
+    case FSTATE1_OPEN_W:
+        if (device->fileState2 == FSTATE2_FILENAME)
+        {
+            if (c == '\0')
+            {
+                if (device->filenameLength == 0)
+                {
+                    printf("{Guest %d} File system error - empty filename\n", device->guestId);
+                    device->fileState1 = FSTATE1_NONE;
+                    device->fileState2 = FSTATE2_NONE;
+                }
+                else if (device->filenameLength > MAX_PATH_LENGTH)
+                {
+                    printf("{Guest %d} File system error - filename longer than %d characters\n", device->guestId, MAX_PATH_LENGTH);
+                    device->fileState2 = FSTATE2_FD;
+                    device->remainingBytes = 4;
+                    device->fd = -1;
+                }
+                else
+                {
+                    device->filename[device->filenameLength] = '\0';
+                    limitIo(device, 0);
+                    device->fileState2 = FSTATE2_FD;
+                    device->remainingBytes = 4;
+                    device->fd = openFile(device, device->filename, (device->fileState1 == FSTATE1_OPEN_R) ? 1 : 0);
+                }
+            }
+            else if (device->filenameLength < MAX_PATH_LENGTH)
+                device->filename[device->filenameLength++] = c;
+            else
+                device->filenameLength = MAX_PATH_LENGTH + 1; // rest of name is dropped, open fails when it ends
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined state1 + state2 combination\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    case FSTATE1_CLOSE:
+        if (device->fileState2 == FSTATE2_FD)
+        {
+            device->remainingBytes -= 1;
+            device->fd |= ((unsigned int)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                device->fileState2 = FSTATE2_CHAR;
+                limitIo(device, 0);
+                device->chr = closeFile(device, device->fd, device->durability);
+            }
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined state1 + state2 combination\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    case FSTATE1_READ:
+        if (device->fileState2 == FSTATE2_FD)
+        {
+            device->remainingBytes -= 1;
+            device->fd |= ((unsigned int)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                device->fileState2 = FSTATE2_CHAR;
+                limitIo(device, 1);
+                device->chr = readFile(device, device->fd);
+            }
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined state1 + state2 combination\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    case FSTATE1_WRITE:
+        if (device->fileState2 == FSTATE2_FD)
+        {
+            device->remainingBytes -= 1;
+            device->fd |= ((unsigned int)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                device->fileState2 = FSTATE2_CHAR;
+            }
+        }
+        else if (device->fileState2 == FSTATE2_CHAR)
+        {
+            device->chr = c;
+            device->fileState1 = FSTATE1_READ;
+            limitIo(device, 1);
+            device->chr = writeFile(device, device->fd, device->chr);
+        }
+        break;
+    case FSTATE1_SEEK:
+    case FSTATE1_PREAD:
+    case FSTATE1_PWRITE:
+    case FSTATE1_STAT:
+    case FSTATE1_MMAP:
+        if (device->fileState2 == FSTATE2_FD)
+        {
+            device->remainingBytes -= 1;
+            device->fd |= ((unsigned int)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                if (device->fileState1 == FSTATE1_MMAP)
+                    device->fileState2 = FSTATE2_MODE;
+                else if (device->fileState1 == FSTATE1_STAT)
+                {
+                    limitIo(device, 0);
+                    device->replyLength = putBigEndian(device->ioBuffer, (uint64_t)statFile(device, device->fd), 8);
+                    device->replyPos = 0;
+                    device->fileState2 = FSTATE2_REPLY;
+                }
+                else
+                {
+                    device->fileState2 = FSTATE2_OFFSET;
+                    device->offset = 0;
+                    device->remainingBytes = 8;
+                }
+            }
+        }
+        else if (device->fileState2 == FSTATE2_OFFSET)
+        {
+            device->remainingBytes -= 1;
+            device->offset |= ((int64_t)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                if (device->fileState1 == FSTATE1_SEEK)
+                    device->fileState2 = FSTATE2_WHENCE;
+                else
+                {
+                    device->fileState2 = FSTATE2_LENGTH;
+                    device->ioLength = 0;
+                    device->remainingBytes = 4;
+                }
+            }
+        }
+        else if (device->fileState2 == FSTATE2_MODE)
+        {
+            limitIo(device, 0);
+            device->replyLength = putBigEndian(device->ioBuffer, (uint64_t)mmapFile(device, device->fd, c), 8);
+            device->replyPos = 0;
+            device->fileState2 = FSTATE2_REPLY;
+        }
+        else if (device->fileState2 == FSTATE2_WHENCE)
+        {
+            limitIo(device, 0);
+            device->replyLength = putBigEndian(device->ioBuffer, (uint64_t)seekFile(device, device->fd, device->offset, c), 8);
+            device->replyPos = 0;
+            device->fileState2 = FSTATE2_REPLY;
+        }
+        else if (device->fileState2 == FSTATE2_LENGTH)
+        {
+            device->remainingBytes -= 1;
+            device->ioLength |= ((uint32_t)c & 0xFF) << (device->remainingBytes * 8);
+            if (device->remainingBytes == 0)
+            {
+                if (device->ioLength > FILE_IO_MAX)
+                    device->ioLength = FILE_IO_MAX;
+                if (device->fileState1 == FSTATE1_PREAD)
+                {
+                    limitIo(device, device->ioLength);
+                    int result = preadFile(device, device->fd, device->ioBuffer + 4, device->ioLength, device->offset);
+                    putBigEndian(device->ioBuffer, (uint32_t)result, 4);
+                    device->replyLength = 4 + (result > 0 ? result : 0);
+                    device->replyPos = 0;
+                    device->fileState2 = FSTATE2_REPLY;
+                }
+                else if (device->ioLength == 0)
+                {
+                    device->replyLength = putBigEndian(device->ioBuffer, 0, 4);
+                    device->replyPos = 0;
+                    device->fileState2 = FSTATE2_REPLY;
+                }
+                else
+                {
+                    device->ioReceived = 0;
+                    device->fileState2 = FSTATE2_DATA;
+                }
+            }
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined state1 + state2 combination\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    case FSTATE1_NONE:
+        switch (c)
+        {
+        case FILE_OPEN_R:
+            device->fileState1 = FSTATE1_OPEN_R;
+            device->fileState2 = FSTATE2_FILENAME;
+            device->filenameLength = 0;
+            break;
+        case FILE_OPEN_W:
+            device->fileState1 = FSTATE1_OPEN_W;
+            device->fileState2 = FSTATE2_FILENAME;
+            device->filenameLength = 0;
+            break;
+        case FILE_CLOSE:
+            device->fileState1 = FSTATE1_CLOSE;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_READ:
+            device->fileState1 = FSTATE1_READ;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_WRITE:
+            device->fileState1 = FSTATE1_WRITE;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_SEEK:
+            device->fileState1 = FSTATE1_SEEK;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_PREAD:
+            device->fileState1 = FSTATE1_PREAD;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_PWRITE:
+            device->fileState1 = FSTATE1_PWRITE;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_STAT:
+            device->fileState1 = FSTATE1_STAT;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        case FILE_MMAP:
+            device->fileState1 = FSTATE1_MMAP;
+            device->fileState2 = FSTATE2_FD;
+            device->fd = 0;
+            device->remainingBytes = 4;
+            break;
+        default:
+            printf("{Guest %d} File system error - undefined syscall code\n", device->guestId);
+        }
+        break;
+    default:
+        printf("{Guest %d} File system error - undefined state1 + state2 combination\n", device->guestId);
+        device->fileState1 = FSTATE1_NONE;
+        device->fileState2 = FSTATE2_NONE;
+    }
+}
+
+static uint8_t fileDeviceInByte(FileDevice *device)
+{
+    uint8_t byte = 0;
+    if (device->fileState2 == FSTATE2_REPLY)
+    {
+        // replies of positional operations, read with rep insb
+        if (device->replyPos < device->replyLength)
+            byte = device->ioBuffer[device->replyPos++];
+        if (device->replyPos == device->replyLength)
+        {
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        return byte;
+    }
+    switch (device->fileState1)
+    {
+    case FSTATE1_OPEN_R:
+    case FSTATE1_OPEN_W:
+        if (device->fileState2 == FSTATE2_FD)
+        {
+            device->remainingBytes -= 1;
+            byte = (uint8_t)((device->fd >> (8 * device->remainingBytes)) & 0xFF);
+            if (device->remainingBytes == 0)
+            {
+                device->fileState1 = FSTATE1_NONE;
+                device->fileState2 = FSTATE2_NONE;
+            }
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined behaviour\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    case FSTATE1_CLOSE:
+    case FSTATE1_READ:
+        if (device->fileState2 == FSTATE2_CHAR)
+        {
+            byte = device->chr;
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        else
+        {
+            printf("{Guest %d} File system error - undefined behaviour\n", device->guestId);
+            device->fileState1 = FSTATE1_NONE;
+            device->fileState2 = FSTATE2_NONE;
+        }
+        break;
+    default:
+        printf("{Guest %d} File system error - undefined behaviour\n", device->guestId);
+        device->fileState1 = FSTATE1_NONE;
+        device->fileState2 = FSTATE2_NONE;
+    }
+    return byte;
+}
+
+static void recordAccess(FILE *record, char direction, uint8_t *data, uint32_t count)
+{
+    uint8_t header[5];
+    header[0] = (uint8_t)direction;
+    putBigEndian(header + 1, count, 4);
+    fwrite(header, 1, sizeof(header), record);
+    fwrite(data, 1, count, record);
+}
+
+void fileDeviceOut(FileDevice *device, uint8_t *data, uint32_t count)
+{
+    if (device->record)
+        recordAccess(device->record, RECORD_OUT, data, count);
+    for (uint32_t i = 0; i < count; i++)
+        fileDeviceOutByte(device, (char)data[i]);
+}
+
+void fileDeviceIn(FileDevice *device, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        data[i] = fileDeviceInByte(device);
+    if (device->record)
+        recordAccess(device->record, RECORD_IN, data, count);
+}
+
+FileDevice *createFileDevice(FileDeviceConfig *config)
+{
+    FileDevice *device = (FileDevice *)calloc(1, sizeof(FileDevice));
+    if (!device)
+        return NULL;
+    device->localDir = -1;
+    device->sharedDir = -1;
+    device->guestId = config->guestId;
+    device->durability = config->durability;
+    device->record = config->record;
+    device->mapFile = config->mapFile;
+    device->mapContext = config->mapContext;
+    device->limitIo = config->limitIo;
+    device->ioContext = config->ioContext;
+    if (initFileIndex(&device->sharedNames) != 0 || initFileIndex(&device->localNames) != 0 || initFileIndex(&device->guestFds) != 0)
+    {
+        deleteFileDevice(device);
+        return NULL;
+    }
+    // directories are opened once, so opening file doesn't resolve their paths again
+    char dirName[4096];
+    if (config->localDir)
+        snprintf(dirName, sizeof(dirName), "%s", config->localDir);
+    else
+        snprintf(dirName, sizeof(dirName), "guest%d", config->guestId);
+    if (mkdir(dirName, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+        device->localDir = -1;
+    else
+        device->localDir = open(dirName, O_PATH | O_DIRECTORY);
+    device->sharedDir = open(".", O_PATH | O_DIRECTORY);
+    struct stat localStat, sharedStat;
+    if (device->localDir < 0 || device->sharedDir < 0 || fstat(device->localDir, &localStat) != 0 || fstat(device->sharedDir, &sharedStat) != 0)
+    {
+        printf("{Guest %d} File system error - cannot open directory '%s'\n", device->guestId, dirName);
+        deleteFileDevice(device);
+        return NULL;
+    }
+    device->localDirId = (DirId){localStat.st_dev, localStat.st_ino};
+    device->sharedDirId = (DirId){sharedStat.st_dev, sharedStat.st_ino};
+    for (LLNode *temp = config->sharedFiles; temp; temp = temp->next)
+    {
+        // guest can't name longer file, so such file can't be shared with it
+        MyFile *file = (strlen((char *)temp->data) <= MAX_PATH_LENGTH) ? allocFile(device) : NULL;
+        if (!file)
+        {
+            deleteFileDevice(device);
+            return NULL;
+        }
+        strcpy(file->name, (char *)temp->data);
+        pushFile(device, &device->sharedFileSystem, file);
+        file->hostFd = -1;
+        file->guestFd = -1;
+        file->canRead = 1;
+        file->canWrite = 0;
+    }
+    if (config->scratchLimit > 0)
+    {
+        device->scratch = createScratchStore(config->scratchLimit, config->scratchExport, device->localDir);
+        if (!device->scratch)
+        {
+            deleteFileDevice(device);
+            return NULL;
+        }
+    }
+    return device;
+}
+
+void deleteFileDevice(FileDevice *device)
+{
+    deleteFileList(device, &device->sharedFileSystem);
+    deleteFileList(device, &device->localFileSystem);
+    if (device->scratch)
+    {
+        printf("{Guest %d} Scratch store: peak %zu KB, %d file(s) spilled to disk\n", device->guestId, device->scratch->peak / 1024, device->scratch->spilledCount);
+        deleteScratchStore(device->scratch, device->guestId);
+    }
+    if (device->localDir >= 0)
+        close(device->localDir);
+    if (device->sharedDir >= 0)
+        close(device->sharedDir);
+    while (device->slabs)
+    {
+        FileSlab *slab = device->slabs;
+        device->slabs = slab->next;
+        free(slab);
+    }
+    free(device->sharedNames.buckets);
+    free(device->localNames.buckets);
+    free(device->guestFds.buckets);
+    free(device);
+}
+
+static int saveValue(FILE *out, void *value, size_t size)
+{
+    return (fwrite(value, 1, size, out) == size) ? 0 : -1;
+}
+
+static int loadValue(FILE *in, void *value, size_t size)
+{
+    return (fread(value, 1, size, in) == size) ? 0 : -1;
+}
+
+// Strings are saved with their length, -1 for NULL
+static int saveString(FILE *out, char *string)
+{
+    int32_t length = string ? (int32_t)strlen(string) : -1;
+    return (saveValue(out, &length, sizeof(length)) == 0 && (length <= 0 || saveValue(out, string, length) == 0)) ? 0 : -1;
+}
+
+// Name is loaded into buffer of FILE_NAME_SIZE bytes, NULL is not accepted
+static int loadName(FILE *in, char *name)
+{
+    int32_t length;
+    if (loadValue(in, &length, sizeof(length)) != 0 || length < 0 || length >= FILE_NAME_SIZE || loadValue(in, name, length) != 0)
+        return -1;
+    name[length] = '\0';
+    return 0;
+}
+
+// Open files are saved with their offsets and reopened by name on restore, file contents stay on disk
+int saveFileDevice(FileDevice *device, FILE *out)
+{
+    if (device->scratch)
+        return -1;
+    int failed = 0;
+    failed |= saveValue(out, &device->nextGuestFd, sizeof(device->nextGuestFd));
+    failed |= saveValue(out, &device->fileState1, sizeof(device->fileState1));
+    failed |= saveValue(out, &device->fileState2, sizeof(device->fileState2));
+    failed |= saveValue(out, &device->remainingBytes, sizeof(device->remainingBytes));
+    failed |= saveValue(out, &device->fd, sizeof(device->fd));
+    failed |= saveValue(out, &device->chr, sizeof(device->chr));
+    failed |= saveValue(out, &device->filenameLength, sizeof(device->filenameLength));
+    failed |= saveValue(out, device->filename, sizeof(device->filename));
+    failed |= saveValue(out, &device->offset, sizeof(device->offset));
+    failed |= saveValue(out, &device->ioLength, sizeof(device->ioLength));
+    failed |= saveValue(out, &device->ioReceived, sizeof(device->ioReceived));
+    failed |= saveValue(out, &device->replyLength, sizeof(device->replyLength));
+    failed |= saveValue(out, &device->replyPos, sizeof(device->replyPos));
+    failed |= saveValue(out, device->ioBuffer, sizeof(device->ioBuffer));
+
+    int32_t count = 0;
+    for (LLNode *temp = device->sharedFileSystem; temp; temp = temp->next)
+        count++;
+    failed |= saveValue(out, &count, sizeof(count));
+    for (LLNode *temp = device->sharedFileSystem; temp; temp = temp->next)
+    {
+        MyFile *file = (MyFile *)temp->data;
+        failed |= saveString(out, file->name);
+        failed |= saveValue(out, &file->canRead, sizeof(file->canRead));
+    }
+    count = 0;
+    for (LLNode *temp = device->localFileSystem; temp; temp = temp->next)
+        count++;
+    failed |= saveValue(out, &count, sizeof(count));
+    for (LLNode *temp = device->localFileSystem; temp; temp = temp->next)
+    {
+        MyFile *file = (MyFile *)temp->data;
+        int64_t position = (file->hostFd < 0) ? -1 : (file->cachedFd ? file->position : lseek(file->hostFd, 0, SEEK_CUR));
+        failed |= saveString(out, file->name);
+        failed |= saveValue(out, &file->guestFd, sizeof(file->guestFd));
+        failed |= saveValue(out, &file->canRead, sizeof(file->canRead));
+        failed |= saveValue(out, &file->canWrite, sizeof(file->canWrite));
+        failed |= saveValue(out, &file->shared, sizeof(file->shared));
+        failed |= saveValue(out, &file->sizeHint, sizeof(file->sizeHint));
+        failed |= saveValue(out, &position, sizeof(position));
+    }
+    return failed ? -1 : 0;
+}
+
+// Device must be freshly created with same configuration as saved one
+int restoreFileDevice(FileDevice *device, FILE *in)
+{
+    if (device->scratch || device->localFileSystem)
+        return -1;
+    int failed = 0;
+    failed |= loadValue(in, &device->nextGuestFd, sizeof(device->nextGuestFd));
+    failed |= loadValue(in, &device->fileState1, sizeof(device->fileState1));
+    failed |= loadValue(in, &device->fileState2, sizeof(device->fileState2));
+    failed |= loadValue(in, &device->remainingBytes, sizeof(device->remainingBytes));
+    failed |= loadValue(in, &device->fd, sizeof(device->fd));
+    failed |= loadValue(in, &device->chr, sizeof(device->chr));
+    failed |= loadValue(in, &device->filenameLength, sizeof(device->filenameLength));
+    failed |= loadValue(in, device->filename, sizeof(device->filename));
+    failed |= loadValue(in, &device->offset, sizeof(device->offset));
+    failed |= loadValue(in, &device->ioLength, sizeof(device->ioLength));
+    failed |= loadValue(in, &device->ioReceived, sizeof(device->ioReceived));
+    failed |= loadValue(in, &device->replyLength, sizeof(device->replyLength));
+    failed |= loadValue(in, &device->replyPos, sizeof(device->replyPos));
+    failed |= loadValue(in, device->ioBuffer, sizeof(device->ioBuffer));
+    if (failed || device->ioLength > FILE_IO_MAX || device->ioReceived > FILE_IO_MAX ||
+        device->replyLength < 0 || device->replyLength > (int)sizeof(device->ioBuffer) || device->replyPos < 0 ||
+        device->filenameLength < 0 || device->filenameLength > MAX_PATH_LENGTH + 1)
+        return -1;
+
+    int32_t count;
+    if (loadValue(in, &count, sizeof(count)) != 0)
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        char name[FILE_NAME_SIZE];
+        char canRead;
+        if (loadName(in, name) != 0 || loadValue(in, &canRead, sizeof(canRead)) != 0)
+            return -1;
+        for (MyFile *file = *nameBucket(&device->sharedNames, name); file; file = file->nameNext)
+            if (strcmp(file->name, name) == 0)
+                file->canRead = canRead;
+    }
+
+    if (loadValue(in, &count, sizeof(count)) != 0)
+        return -1;
+    LLNode **last = &device->localFileSystem;
+    for (int i = 0; i < count; i++)
+    {
+        MyFile *file = allocFile(device);
+        int64_t position;
+        if (!file)
+            return -1;
+        if (loadName(in, file->name) != 0 || loadValue(in, &file->guestFd, sizeof(file->guestFd)) != 0 ||
+            loadValue(in, &file->canRead, sizeof(file->canRead)) != 0 || loadValue(in, &file->canWrite, sizeof(file->canWrite)) != 0 ||
+            loadValue(in, &file->shared, sizeof(file->shared)) != 0 || loadValue(in, &file->sizeHint, sizeof(file->sizeHint)) != 0 || loadValue(in, &position, sizeof(position)) != 0)
+        {
+            releaseFile(device, file);
+            return -1;
+        }
+        // written files are reopened without truncation, so data written before checkpoint stays
+        file->hostFd = -1;
+        if (position >= 0 && file->canRead)
+        {
+            if (openCachedFile(file, file->shared ? device->sharedDir : device->localDir, file->shared ? &device->sharedDirId : &device->localDirId, file->name) != 0)
+                printf("{Guest %d} File system error - cannot reopen '%s'\n", device->guestId, file->name);
+            file->position = position;
+        }
+        else if (position >= 0)
+        {
+            file->hostFd = openat(file->shared ? device->sharedDir : device->localDir, file->name, file->canRead ? O_RDONLY : O_WRONLY);
+            if (file->hostFd < 0 || lseek(file->hostFd, position, SEEK_SET) != position)
+                printf("{Guest %d} File system error - cannot reopen '%s'\n", device->guestId, file->name);
+            if (file->hostFd >= 0 && file->canWrite && device->durability == DURABILITY_PERIODIC)
+                file->syncEntry = registerSyncEntry(file->hostFd);
+        }
+        file->node.next = NULL;
+        file->link = last;
+        *last = &file->node;
+        last = (LLNode **)&file->node.next;
+        indexName(&device->localNames, file);
+        if (file->guestFd >= 0)
+            indexGuestFd(device, file);
+    }
+    return 0;
+}
+
+int writeRecordHeader(FILE *record, FileDeviceConfig *config)
+{
+    uint8_t header[22];
+    int count = 0;
+    for (LLNode *temp = config->sharedFiles; temp; temp = temp->next)
+        count++;
+    memcpy(header, RECORD_MAGIC, 6);
+    putBigEndian(header + 6, (uint32_t)config->guestId, 4);
+    putBigEndian(header + 10, (uint64_t)config->scratchLimit, 8);
+    header[18] = (uint8_t)config->durability;
+    header[19] = (uint8_t)config->scratchExport;
+    putBigEndian(header + 20, (uint32_t)count, 2);
+    if (fwrite(header, 1, sizeof(header), record) != sizeof(header))
+        return -1;
+    for (LLNode *temp = config->sharedFiles; temp; temp = temp->next)
+    {
+        if (fwrite(temp->data, 1, strlen((char *)temp->data) + 1, record) != strlen((char *)temp->data) + 1)
+            return -1;
+    }
+    return 0;
+}
+
+// Fills config from recording header, shared file names are allocated and released by deleteRecordConfig
+int readRecordHeader(FILE *record, FileDeviceConfig *config)
+{
+    uint8_t header[22];
+    memset(config, 0, sizeof(FileDeviceConfig));
+    if (fread(header, 1, sizeof(header), record) != sizeof(header) || memcmp(header, RECORD_MAGIC, 6) != 0)
+        return -1;
+    uint64_t value = 0;
+    for (int i = 6; i < 10; i++)
+        value = (value << 8) | header[i];
+    config->guestId = (int)value;
+    value = 0;
+    for (int i = 10; i < 18; i++)
+        value = (value << 8) | header[i];
+    config->scratchLimit = (size_t)value;
+    config->durability = header[18];
+    config->scratchExport = (char)header[19];
+    int count = (header[20] << 8) | header[21];
+    LLNode **last = &config->sharedFiles;
+    for (int i = 0; i < count; i++)
+    {
+        char name[4096];
+        int length = 0;
+        int c;
+        while ((c = fgetc(record)) != EOF && c != '\0' && length < (int)sizeof(name) - 1)
+            name[length++] = (char)c;
+        name[length] = '\0';
+        LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+        if (c != '\0' || !elem || !(elem->data = copyFilename(name)))
+        {
+            free(elem);
+            return -1;
+        }
+        elem->next = NULL;
+        *last = elem;
+        last = (LLNode **)&elem->next;
+    }
+    return 0;
+}
+
+void deleteRecordConfig(FileDeviceConfig *config)
+{
+    while (config->sharedFiles)
+    {
+        LLNode *temp = config->sharedFiles;
+        config->sharedFiles = temp->next;
+        free(temp->data);
+        free(temp);
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef FILE_DEVICE_H
+#define FILE_DEVICE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// File system device emulation, driven only by bytes guest writes to and reads from PORT_FILE,
+// so it can be used by hypervisor as well as by tools that replay recorded guest sessions
+
+#define PORT_FILE 0x0278
+
+#define FILE_OPEN_R 0x1
+#define FILE_OPEN_W 0x2
+#define FILE_CLOSE 0x3
+#define FILE_READ 0x4
+#define FILE_WRITE 0x5
+#define FILE_SEEK 0x6
+#define FILE_PREAD 0x7
+#define FILE_PWRITE 0x8
+#define FILE_STAT 0x9
+#define FILE_MMAP 0xA
+
+#define FILE_IO_MAX 4096 // max bytes transferred by one FILE_PREAD/FILE_PWRITE
+#define MAX_PATH_LENGTH 300 // longest file name guest can open, same limit as in guest library
+
+#define FILE_MAP_SHARED 0  // read-only mapping of host page cache
+#define FILE_MAP_PRIVATE 1 // writable copy-on-write mapping, changes are never written back
+
+#define DURABILITY_NONE 0     // page cache only
+#define DURABILITY_CLOSE 1    // fdatasync on close
+#define DURABILITY_PERIODIC 2 // background fdatasync every syncInterval ms
+#define DEFAULT_SYNC_INTERVAL 100
+
+// Recording of port accesses: header, then records '<' (bytes written by guest) or '>' (bytes read by guest)
+// followed by 4 byte big endian count and data bytes
+#define RECORD_MAGIC "FDREC1"
+#define RECORD_OUT '<'
+#define RECORD_IN '>'
+
+typedef struct
+{
+    void *data;
+    void *next;
+} LLNode;
+
+typedef LLNode LinkedList;
+
+// Maps host file into guest memory, returns guest physical address of the mapping or -1
+typedef int64_t (*MapFileFunction)(void *context, int hostFd, int mode);
+// Called before every request is served, may block guest to keep its I/O within limits
+typedef void (*LimitIoFunction)(void *context, uint32_t bytes);
+
+typedef struct
+{
+    int guestId;
+    LinkedList *sharedFiles; // names of shared files visible to guest
+    int durability;
+    size_t scratchLimit; // 0 - local files are on disk
+    char scratchExport;  // 0 - no, 1 - yes
+    FILE *record;        // NULL - port accesses are not recorded
+    MapFileFunction mapFile; // NULL - FILE_MMAP always fails
+    void *mapContext;
+    LimitIoFunction limitIo; // NULL - I/O is not limited
+    void *ioContext;
+    char *localDir; // directory of guest's local files, created if missing, NULL - "guestID" in working directory
+} FileDeviceConfig;
+
+typedef struct
+{
+    uint64_t hits;      // opens served with fd another open left in cache
+    uint64_t misses;    // opens that opened host file
+    uint64_t evictions; // unused fds closed because cache was full
+} FdCacheStats;
+
+typedef struct FileDevice FileDevice;
+
+FileDevice *createFileDevice(FileDeviceConfig *config);
+void deleteFileDevice(FileDevice *device);
+void fileDeviceOut(FileDevice *device, uint8_t *data, uint32_t count);
+void fileDeviceIn(FileDevice *device, uint8_t *data, uint32_t count);
+
+int startFileSyncer(int interval);
+void stopFileSyncer();
+
+// Host fds of files opened for reading are shared by all devices and kept open in LRU cache after guests close files
+void getFdCacheStats(FdCacheStats *stats);
+// Closes cached fds nobody uses, called once all devices are deleted
+void closeFdCache();
+
+// State of device (open files, request in progress) for checkpoints and migration, devices with scratch store can't be saved
+int saveFileDevice(FileDevice *device, FILE *out);
+int restoreFileDevice(FileDevice *device, FILE *in);
+
+int writeRecordHeader(FILE *record, FileDeviceConfig *config);
+int readRecordHeader(FILE *record, FileDeviceConfig *config);
+void deleteRecordConfig(FileDeviceConfig *config);
+
+char *copyFilename(char *filename);
+
+#endif
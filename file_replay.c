@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "file_device.h"
+
+// Replays port accesses recorded by mini_hypervisor (option --record) against file device, without KVM
+
+typedef struct
+{
+    char direction;
+    uint32_t count;
+    uint8_t *data;
+} Access;
+
+static double elapsedMs(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && !(argc == 4 && strcmp(argv[2], "--repeat") == 0))
+    {
+        printf("Usage: file_replay <recording> [--repeat <count>]\n");
+        return -1;
+    }
+    int repeat = (argc == 4) ? atoi(argv[3]) : 1;
+    if (repeat < 1)
+    {
+        printf("Error: bad --repeat argument\n");
+        return -1;
+    }
+    FILE *record = fopen(argv[1], "r");
+    if (!record)
+    {
+        printf("Error: cannot open recording '%s'\n", argv[1]);
+        return -1;
+    }
+    FileDeviceConfig config;
+    if (readRecordHeader(record, &config) != 0)
+    {
+        printf("Error: '%s' is not a file device recording\n", argv[1]);
+        deleteRecordConfig(&config);
+        fclose(record);
+        return -1;
+    }
+
+    // whole recording is loaded first, so replay measures only the device
+    Access *accesses = NULL;
+    int accessCount = 0, accessCapacity = 0;
+    uint64_t byteCount = 0;
+    uint8_t header[5];
+    while (fread(header, 1, sizeof(header), record) == sizeof(header))
+    {
+        if (accessCount == accessCapacity)
+        {
+            accessCapacity = accessCapacity ? 2 * accessCapacity : 1024;
+            Access *grown = (Access *)realloc(accesses, accessCapacity * sizeof(Access));
+            if (!grown)
+            {
+                printf("Error: malloc failed\n");
+                return -1;
+            }
+            accesses = grown;
+        }
+        Access *access = &accesses[accessCount];
+        access->direction = (char)header[0];
+        access->count = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 8) | header[4];
+        access->data = (uint8_t *)malloc(access->count ? access->count : 1);
+        if (!access->data || fread(access->data, 1, access->count, record) != access->count ||
+            (access->direction != RECORD_OUT && access->direction != RECORD_IN))
+        {
+            printf("Error: recording is truncated or corrupted\n");
+            return -1;
+        }
+        byteCount += access->count;
+        accessCount++;
+    }
+    fclose(record);
+
+    if (config.durability == DURABILITY_PERIODIC && startFileSyncer(DEFAULT_SYNC_INTERVAL) != 0)
+    {
+        printf("Error: failed to start file syncer\n");
+        return -1;
+    }
+    uint8_t *reply = (uint8_t *)malloc(FILE_IO_MAX + 8);
+    long mismatches = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < repeat; r++)
+    {
+        FileDevice *device = createFileDevice(&config);
+        if (!device)
+        {
+            printf("Error: failed to create file device\n");
+            return -1;
+        }
+        for (int i = 0; i < accessCount; i++)
+        {
+            Access *access = &accesses[i];
+            if (access->direction == RECORD_OUT)
+                fileDeviceOut(device, access->data, access->count);
+            else
+            {
+                uint8_t *buffer = (access->count <= FILE_IO_MAX + 8) ? reply : (uint8_t *)malloc(access->count);
+                fileDeviceIn(device, buffer, access->count);
+                if (memcmp(buffer, access->data, access->count) != 0)
+                    mismatches++;
+                if (buffer != reply)
+                    free(buffer);
+            }
+        }
+        deleteFileDevice(device);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (config.durability == DURABILITY_PERIODIC)
+        stopFileSyncer();
+    closeFdCache();
+
+    double ms = elapsedMs(&start, &end);
+    printf("Guest %d: %d port accesses (%llu bytes) replayed %d time(s) in %.1f ms, %.0f accesses/s, %ld mismatched replies\n",
+           config.guestId, accessCount, (unsigned long long)byteCount, repeat, ms,
+           ms > 0 ? (double)accessCount * repeat * 1000.0 / ms : 0.0, mismatches);
+    for (int i = 0; i < accessCount; i++)
+        free(accesses[i].data);
+    free(accesses);
+    free(reply);
+    deleteRecordConfig(&config);
+    return mismatches ? 1 : 0;
+}
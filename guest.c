@@ -1,10 +1,24 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 const char EOF = -1;
 
 const uint16_t PORT_IO = 0x00E9;
+const uint16_t PORT_IO_REQUEST = 0x00EA;
+const uint16_t PORT_SHUTDOWN = 0x00F4;
 const uint16_t PORT_FILE = 0x0278;
+const uint16_t PORT_SHM = 0x0280;
+const uint16_t PORT_MSG = 0x0281;
+const uint16_t PORT_BALLOON = 0x0282;
+const uint16_t PORT_SYNC = 0x0283;
+
+const uint8_t PIC_MASTER_CMD = 0x20;
+const uint8_t PIC_MASTER_DATA = 0x21;
+const uint8_t PIC_SLAVE_CMD = 0xA0;
+const uint8_t PIC_SLAVE_DATA = 0xA1;
+const uint8_t IRQ_BASE = 0x20; // PIC vector offset
+const uint8_t IRQ_IO = 1;      // raised by hypervisor when requested input byte is ready
 
 const int MAX_PATH_LENGTH = 300;
 
@@ -13,6 +27,68 @@ const uint8_t FILE_OPEN_W = 0x2;
 const uint8_t FILE_CLOSE = 0x3;
 const uint8_t FILE_READ = 0x4;
 const uint8_t FILE_WRITE = 0x5;
+const uint8_t FILE_SEEK = 0x6;
+const uint8_t FILE_PREAD = 0x7;
+const uint8_t FILE_PWRITE = 0x8;
+const uint8_t FILE_STAT = 0x9;
+const uint8_t FILE_MMAP = 0xA;
+
+const int FILE_IO_MAX = 4096;
+
+const uint8_t FILE_MAP_SHARED = 0;  // read-only
+const uint8_t FILE_MAP_PRIVATE = 1; // writable, changes stay in guest
+
+const int SEEK_SET = 0;
+const int SEEK_CUR = 1;
+const int SEEK_END = 2;
+
+const uint8_t MSG_OPEN = 0x1;
+const uint8_t MSG_SEND = 0x2;
+const uint8_t MSG_RECV = 0x3;
+const uint8_t MSG_NONBLOCK = 0x1;
+const uint8_t MSG_OK = 0;
+const uint8_t MSG_WOULD_BLOCK = 1;
+const uint8_t MSG_INTERRUPTED = 2;
+const int MSG_MAX_SIZE = 256;
+
+const uint8_t BALLOON_INFLATE = 0x1;
+const uint8_t BALLOON_DEFLATE = 0x2;
+const uint8_t BALLOON_QUERY = 0x3;
+const int BALLOON_PAGE_SIZE = 4096;
+
+const uint8_t SYNC_OPEN = 0x1;
+const uint8_t SYNC_BARRIER = 0x2;
+const uint8_t SYNC_SEM_WAIT = 0x3;
+const uint8_t SYNC_SEM_POST = 0x4;
+const uint8_t SYNC_EVENT_SET = 0x5;
+const uint8_t SYNC_EVENT_CLEAR = 0x6;
+const uint8_t SYNC_EVENT_WAIT = 0x7;
+const uint8_t SYNC_TYPE_BARRIER = 0;
+const uint8_t SYNC_TYPE_SEMAPHORE = 1;
+const uint8_t SYNC_TYPE_EVENT = 2;
+const int64_t SYNC_INTERRUPTED = -2;
+
+const uint32_t CPUID_TIMING_LEAF = 0x40000010;
+
+static uint64_t tscToNsMult = 0; // nanoseconds per TSC tick, 32.32 fixed point
+
+volatile uint8_t inputReady = 0; // set by interrupt handler
+
+// 0x08 - 64-bit code segment, 0x10 - data segment
+static uint64_t gdt[3] = {0, 0x00209A0000000000ULL, 0x0000920000000000ULL};
+// only PIC vectors are used, so the table ends right after them
+static uint64_t idt[2 * 0x30];
+
+void ioInterrupt(void);
+asm(".pushsection .text\n"
+    ".globl ioInterrupt\n"
+    "ioInterrupt:\n"
+    "    push %rax\n"
+    "    movb $1, inputReady(%rip)\n"
+    "    movb $0x20, %al\n" // EOI to master PIC
+    "    outb %al, $0x20\n"
+    "    pop %rax\n"
+    "    iretq\n");
 
 
 static void outb(uint16_t port, uint8_t value)
@@ -31,16 +107,193 @@ static uint8_t inb(uint16_t port)
     return value;
 }
 
+static int strlen(const char *s)
+{
+    int l = 0;
+    while (s[l])
+        l++;
+    return l;
+}
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Returns nanoseconds since guest start, or 0 if hypervisor did not report TSC frequency
+static uint64_t now_ns()
+{
+    if (tscToNsMult == 0)
+    {
+        uint32_t khz, ebx, ecx, edx;
+        cpuid(CPUID_TIMING_LEAF, &khz, &ebx, &ecx, &edx);
+        if (khz == 0)
+            return 0;
+        tscToNsMult = (1000000ULL << 32) / khz;
+    }
+    uint64_t lo, hi;
+    asm("mulq %3" : "=a"(lo), "=d"(hi) : "a"(rdtsc()), "rm"(tscToNsMult));
+    return (hi << 32) | (lo >> 32);
+}
+
+static void setupInterrupts()
+{
+    struct __attribute__((packed))
+    {
+        uint16_t limit;
+        uint64_t base;
+    } gdtr = {sizeof(gdt) - 1, (uint64_t)gdt}, idtr = {sizeof(idt) - 1, (uint64_t)idt};
+
+    asm volatile(
+        "lgdt %0\n"
+        "pushq $0x08\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "movw $0x10, %%ax\n"
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%es\n"
+        "movw %%ax, %%ss\n"
+        : /* empty */ : "m"(gdtr) : "rax", "memory");
+
+    uint64_t handler = (uint64_t)ioInterrupt;
+    int vector = IRQ_BASE + IRQ_IO;
+    idt[2 * vector] = (handler & 0xFFFF) | (0x08ULL << 16) | (0x8EULL << 40) | ((handler & 0xFFFF0000ULL) << 32);
+    idt[2 * vector + 1] = handler >> 32;
+    asm volatile("lidt %0" : /* empty */ : "m"(idtr) : "memory");
+
+    outb(PIC_MASTER_CMD, 0x11); // ICW1: init, ICW4 needed
+    outb(PIC_SLAVE_CMD, 0x11);
+    outb(PIC_MASTER_DATA, IRQ_BASE); // ICW2: vector offset
+    outb(PIC_SLAVE_DATA, IRQ_BASE + 8);
+    outb(PIC_MASTER_DATA, 0x04); // ICW3: slave on IRQ2
+    outb(PIC_SLAVE_DATA, 0x02);
+    outb(PIC_MASTER_DATA, 0x01); // ICW4: 8086 mode
+    outb(PIC_SLAVE_DATA, 0x01);
+    outb(PIC_MASTER_DATA, (uint8_t)~(1 << IRQ_IO));
+    outb(PIC_SLAVE_DATA, 0xFF);
+    asm volatile("sti");
+}
+
+// Returns address of shared memory region declared with --shm, or NULL if there is no such region
+static void *shm_open(const char *name, uint64_t *size)
+{
+    for (const char *p = name; *p; p++)
+    {
+        outb(PORT_SHM, (uint8_t)(*p));
+    }
+    outb(PORT_SHM, 0);
+    uint64_t addr = 0, sz = 0;
+    for (int i = 0; i < 8; i++)
+        addr = (addr << 8) | inb(PORT_SHM);
+    for (int i = 0; i < 8; i++)
+        sz = (sz << 8) | inb(PORT_SHM);
+    if (size)
+        *size = sz;
+    return (void *)addr;
+}
+
+static void outsb(uint16_t port, const void *buf, uint32_t count)
+{
+    asm volatile("rep outsb" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static void insb(uint16_t port, void *buf, uint32_t count)
+{
+    asm volatile("rep insb" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static void outMsgHeader(uint8_t op, bool block, int ch, uint16_t length)
+{
+    uint8_t header[8] = {op, block ? 0 : MSG_NONBLOCK,
+                         (uint8_t)(ch >> 24), (uint8_t)(ch >> 16), (uint8_t)(ch >> 8), (uint8_t)ch,
+                         (uint8_t)(length >> 8), (uint8_t)length};
+    outsb(PORT_MSG, header, 8);
+}
+
+// Opens (creating if needed) message channel shared by all guests, returns channel id or -1
+static int msg_open(const char *name)
+{
+    if (!name || strlen(name) == 0)
+        return -1;
+    outb(PORT_MSG, MSG_OPEN);
+    outsb(PORT_MSG, name, strlen(name) + 1);
+    uint8_t ret[4];
+    insb(PORT_MSG, ret, 4);
+    return (int)(((unsigned int)ret[0] << 24) | ((unsigned int)ret[1] << 16) | ((unsigned int)ret[2] << 8) | ret[3]);
+}
+
+// Returns 0 on success, 1 if channel is full and block is false, -1 on error
+static int msg_send(int ch, const void *buf, uint16_t length, bool block)
+{
+    if (ch < 0 || length > MSG_MAX_SIZE)
+        return -1;
+    // host interrupts blocking call to checkpoint, sample or migrate guest, and call is then repeated
+    uint8_t ret;
+    do
+    {
+        outMsgHeader(MSG_SEND, block, ch, length);
+        if (length > 0)
+            outsb(PORT_MSG, buf, length);
+        ret = inb(PORT_MSG);
+    } while (ret == MSG_INTERRUPTED);
+    return (ret == MSG_OK) ? 0 : ((ret == MSG_WOULD_BLOCK) ? 1 : -1);
+}
+
+// Returns length of received message (truncated to maxLength), -2 if channel is empty and block is false, -1 on error
+static int msg_recv(int ch, void *buf, uint16_t maxLength, bool block)
+{
+    if (ch < 0)
+        return -1;
+    uint8_t ret[3];
+    do
+    {
+        outMsgHeader(MSG_RECV, block, ch, maxLength);
+        insb(PORT_MSG, ret, 3);
+    } while (ret[0] == MSG_INTERRUPTED);
+    if (ret[0] != MSG_OK)
+        return (ret[0] == MSG_WOULD_BLOCK) ? -2 : -1;
+    uint16_t length = ((uint16_t)ret[1] << 8) | ret[2];
+    if (length > 0)
+        insb(PORT_MSG, buf, length);
+    return length;
+}
+
 static void putchar(char c)
 {
     outb(PORT_IO, (uint8_t)c);
 }
 
+// Guest halts until hypervisor raises IRQ_IO, instead of keeping the host thread busy
 static char getchar()
 {
+    inputReady = 0;
+    outb(PORT_IO_REQUEST, 0);
+    asm volatile("cli");
+    while (!inputReady)
+        asm volatile("sti\n"
+                     "hlt\n"
+                     "cli");
+    asm volatile("sti");
     return (char)inb(PORT_IO);
 }
 
+static void __attribute__((noreturn)) shutdown(uint8_t status)
+{
+    outb(PORT_SHUTDOWN, status);
+    for (;;)
+        asm("cli\n"
+            "hlt");
+}
+
 static int fopen(const char *s, char mode)
 {
     if (!s || strlen(s) == 0 || strlen(s) > MAX_PATH_LENGTH)
@@ -112,11 +365,216 @@ static char fwrite(char c, int fd)
     return (char)ret;
 }
 
+static void outFileRequest(uint8_t op, int fd, int64_t offset, int offsetBytes, uint32_t length, int lengthBytes)
+{
+    uint8_t request[17];
+    int l = 0;
+    unsigned int ufd = (unsigned int)fd;
+    request[l++] = op;
+    for (int i = 3; i >= 0; i--)
+        request[l++] = (uint8_t)((ufd >> (8 * i)) & 0xFF);
+    for (int i = offsetBytes - 1; i >= 0; i--)
+        request[l++] = (uint8_t)(((uint64_t)offset >> (8 * i)) & 0xFF);
+    for (int i = lengthBytes - 1; i >= 0; i--)
+        request[l++] = (uint8_t)((length >> (8 * i)) & 0xFF);
+    outsb(PORT_FILE, request, l);
+}
+
+static uint64_t inBigEndian(int bytes)
+{
+    uint8_t reply[8];
+    uint64_t value = 0;
+    insb(PORT_FILE, reply, bytes);
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | reply[i];
+    return value;
+}
+
+// Returns new offset of the file, or -1 on error
+static int64_t fseek(int fd, int64_t offset, int whence)
+{
+    if (fd < 0)
+        return -1;
+    outFileRequest(FILE_SEEK, fd, offset, 8, (uint32_t)whence, 1);
+    return (int64_t)inBigEndian(8);
+}
+
+// Returns size of the file, or -1 on error
+static int64_t fsize(int fd)
+{
+    if (fd < 0)
+        return -1;
+    outFileRequest(FILE_STAT, fd, 0, 0, 0, 0);
+    return (int64_t)inBigEndian(8);
+}
+
+// Maps whole file into guest memory, returns its address or NULL on error. Mapping stays after fclose
+static void *fmmap(int fd, uint8_t mode)
+{
+    if (fd < 0)
+        return NULL;
+    outFileRequest(FILE_MMAP, fd, mode, 1, 0, 0);
+    int64_t addr = (int64_t)inBigEndian(8);
+    return (addr < 0) ? NULL : (void *)addr;
+}
+
+// Reads up to length bytes at offset without changing file offset, returns number of bytes read or -1
+static int fpread(int fd, void *buf, int length, int64_t offset)
+{
+    if (fd < 0 || length < 0 || offset < 0)
+        return -1;
+    int total = 0;
+    while (total < length)
+    {
+        int chunk = (length - total < FILE_IO_MAX) ? length - total : FILE_IO_MAX;
+        outFileRequest(FILE_PREAD, fd, offset + total, 8, (uint32_t)chunk, 4);
+        int r = (int)(int32_t)inBigEndian(4);
+        if (r < 0)
+            return total > 0 ? total : -1;
+        if (r > 0)
+            insb(PORT_FILE, (char *)buf + total, r);
+        total += r;
+        if (r < chunk)
+            break;
+    }
+    return total;
+}
+
+// Writes length bytes at offset without changing file offset, returns number of bytes written or -1
+static int fpwrite(int fd, const void *buf, int length, int64_t offset)
+{
+    if (fd < 0 || length < 0 || offset < 0)
+        return -1;
+    int total = 0;
+    while (total < length)
+    {
+        int chunk = (length - total < FILE_IO_MAX) ? length - total : FILE_IO_MAX;
+        outFileRequest(FILE_PWRITE, fd, offset + total, 8, (uint32_t)chunk, 4);
+        outsb(PORT_FILE, (const char *)buf + total, chunk);
+        int r = (int)(int32_t)inBigEndian(4);
+        if (r < 0)
+            return total > 0 ? total : -1;
+        total += r;
+        if (r < chunk)
+            break;
+    }
+    return total;
+}
+
+static int64_t balloonRequest(uint8_t op, void *addr, uint64_t size)
+{
+    uint8_t request[17];
+    uint8_t reply[8];
+    uint64_t value = 0;
+    request[0] = op;
+    for (int i = 0; i < 8; i++)
+    {
+        request[1 + i] = (uint8_t)(((uint64_t)addr >> (56 - 8 * i)) & 0xFF);
+        request[9 + i] = (uint8_t)((size >> (56 - 8 * i)) & 0xFF);
+    }
+    outsb(PORT_BALLOON, request, (op == BALLOON_QUERY) ? 1 : 17);
+    insb(PORT_BALLOON, reply, 8);
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | reply[i];
+    return (int64_t)value;
+}
+
+// Gives memory guest doesn't need to host, returns number of 4KB pages released or -1 on error.
+// Memory stays usable, but its contents are lost and touching it again makes host back it anew
+static int64_t balloon_inflate(void *addr, uint64_t size)
+{
+    return balloonRequest(BALLOON_INFLATE, addr, size);
+}
+
+// Tells host guest uses memory again, returns number of ballooned 4KB pages taken back or -1 on error
+static int64_t balloon_deflate(void *addr, uint64_t size)
+{
+    return balloonRequest(BALLOON_DEFLATE, addr, size);
+}
+
+// Returns number of 4KB pages currently in balloon
+static int64_t balloon_pages()
+{
+    return balloonRequest(BALLOON_QUERY, NULL, 0);
+}
+
+static int64_t inSyncReply()
+{
+    uint8_t reply[8];
+    uint64_t value = 0;
+    insb(PORT_SYNC, reply, 8);
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | reply[i];
+    return (int64_t)value;
+}
+
+// Opens object of guest's group by name, object is created by first guest that opens it with given initial value
+// (semaphore count or event flags). Returns object id, or -1 if guest is in no group or object has other type
+static int sync_open(const char *name, uint8_t type, uint32_t value)
+{
+    uint8_t request[6] = {SYNC_OPEN, type, (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+    outsb(PORT_SYNC, request, 6);
+    outsb(PORT_SYNC, name, strlen(name) + 1);
+    return (int)inSyncReply();
+}
+
+static int64_t syncRequest(uint8_t op, int id, uint32_t value)
+{
+    unsigned int uid = (unsigned int)id;
+    uint8_t request[9] = {op, (uint8_t)(uid >> 24), (uint8_t)(uid >> 16), (uint8_t)(uid >> 8), (uint8_t)uid,
+                          (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+    // host interrupts long waits to checkpoint, sample or migrate guest, and request is then repeated
+    int64_t reply;
+    do
+    {
+        outsb(PORT_SYNC, request, 9);
+        reply = inSyncReply();
+    } while (reply == SYNC_INTERRUPTED);
+    return reply;
+}
+
+// Waits until every guest of group reaches the barrier, returns 0 or -1 on error
+static int sync_barrier(int id)
+{
+    return (int)syncRequest(SYNC_BARRIER, id, 0);
+}
+
+// Waits until semaphore count is positive and takes 1 from it, returns 0 or -1 on error
+static int sem_wait(int id)
+{
+    return (int)syncRequest(SYNC_SEM_WAIT, id, 0);
+}
+
+// Adds count to semaphore and wakes guests waiting on it, returns new count or -1 on error
+static int64_t sem_post(int id, uint32_t count)
+{
+    return syncRequest(SYNC_SEM_POST, id, count);
+}
+
+// Sets given bits of event flags and wakes guests waiting for them, returns new flags or -1 on error
+static int64_t event_set(int id, uint32_t flags)
+{
+    return syncRequest(SYNC_EVENT_SET, id, flags);
+}
+
+// Clears given bits of event flags, returns new flags or -1 on error
+static int64_t event_clear(int id, uint32_t flags)
+{
+    return syncRequest(SYNC_EVENT_CLEAR, id, flags);
+}
+
+// Waits until all given bits of event flags are set, returns flags or -1 on error
+static int64_t event_wait(int id, uint32_t flags)
+{
+    return syncRequest(SYNC_EVENT_WAIT, id, flags);
+}
+
 void
     __attribute__((noreturn))
     __attribute__((section(".start")))
     _start(void)
 {
+    setupInterrupts();
 
     /*
         INSERT CODE BELOW THIS LINE
@@ -133,6 +591,5 @@ void
     /*
         INSERT CODE ABOVE THIS LINE
     */
-    for (;;)
-        asm("hlt");
+    shutdown(0);
 }
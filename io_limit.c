@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "io_limit.h"
+
+#define IO_ACTIVE_WINDOW 100000000ULL // ns, guest that did I/O within it takes part in sharing
+#define IO_SHARE_PERIOD 10000000ULL   // ns between recalculations of guest's share
+
+struct IoLimiter
+{
+    IoLimit limit;
+    int weight;
+    double burst;      // seconds
+    double byteTokens; // negative while guest is in debt for operation it was let through
+    double opTokens;
+    uint64_t last;     // time of last refill
+    double fraction;   // guest's part of common capacity
+    uint64_t shareTime;
+    atomic_uint_fast64_t lastActive;
+    IoStats stats;
+    IoLimiter *next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    IoLimit total;
+    IoLimiter *limiters;
+} share = {PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int parseIoLimit(char *s, IoLimit *limit)
+{
+    char *end;
+    memset(limit, 0, sizeof(IoLimit));
+    limit->burst = IO_BURST_DEFAULT;
+    if (*s < '0' || *s > '9')
+        return -1;
+    limit->bytesPerSecond = strtoull(s, &end, 10) * 1024;
+    if (*end != ':' || end[1] < '0' || end[1] > '9')
+        return -1;
+    limit->opsPerSecond = strtoull(end + 1, &end, 10);
+    if (*end == ':' && end[1] >= '0' && end[1] <= '9')
+    {
+        long burst = strtol(end + 1, &end, 10);
+        limit->burst = (burst > 0 && burst <= 60000) ? (int)burst : -1;
+    }
+    if (*end != '\0' || limit->burst < 0 || (limit->bytesPerSecond == 0 && limit->opsPerSecond == 0))
+        return -1;
+    return 0;
+}
+
+void setIoShare(IoLimit *total)
+{
+    share.total = *total;
+}
+
+int isIoShared()
+{
+    return share.total.bytesPerSecond > 0 || share.total.opsPerSecond > 0;
+}
+
+// Without own limit guest is limited only by its share, then burst of common capacity applies
+IoLimiter *createIoLimiter(IoLimit *limit, int weight)
+{
+    IoLimiter *limiter = (IoLimiter *)calloc(1, sizeof(IoLimiter));
+    if (!limiter)
+        return NULL;
+    if (limit)
+        limiter->limit = *limit;
+    limiter->weight = (weight > 0) ? weight : 1;
+    limiter->burst = (limit ? limit->burst : share.total.burst) / 1000.0;
+    limiter->fraction = 1.0;
+    atomic_init(&limiter->lastActive, 0);
+    pthread_mutex_lock(&share.lock);
+    limiter->next = share.limiters;
+    share.limiters = limiter;
+    pthread_mutex_unlock(&share.lock);
+    return limiter;
+}
+
+void deleteIoLimiter(IoLimiter *limiter)
+{
+    if (!limiter)
+        return;
+    pthread_mutex_lock(&share.lock);
+    IoLimiter **link = &share.limiters;
+    while (*link && *link != limiter)
+        link = &(*link)->next;
+    if (*link)
+        *link = limiter->next;
+    pthread_mutex_unlock(&share.lock);
+    free(limiter);
+}
+
+// Guests idle for longer than IO_ACTIVE_WINDOW leave their part of common capacity to others
+static void updateShare(IoLimiter *limiter, uint64_t now)
+{
+    int activeWeight = 0;
+    pthread_mutex_lock(&share.lock);
+    for (IoLimiter *other = share.limiters; other; other = other->next)
+    {
+        if (other == limiter || atomic_load_explicit(&other->lastActive, memory_order_relaxed) + IO_ACTIVE_WINDOW > now)
+            activeWeight += other->weight;
+    }
+    pthread_mutex_unlock(&share.lock);
+    limiter->fraction = (double)limiter->weight / activeWeight;
+    limiter->shareTime = now;
+}
+
+// Lower of guest's own rate and its share of common rate, 0 - unlimited
+static double effectiveRate(uint64_t own, uint64_t common, double fraction)
+{
+    double rate = (double)own;
+    if (common > 0 && (rate == 0 || common * fraction < rate))
+        rate = common * fraction;
+    return rate;
+}
+
+// Refills bucket for elapsed time and takes cost from it, returns seconds until bucket is out of debt
+static double takeTokens(double *tokens, double rate, double burst, double elapsed, double cost)
+{
+    if (rate <= 0)
+        return 0;
+    *tokens += rate * elapsed;
+    if (*tokens > rate * burst)
+        *tokens = rate * burst;
+    *tokens -= cost;
+    return (*tokens < 0) ? -*tokens / rate : 0;
+}
+
+// Operation is let through at once and debt is paid by waiting, so operations larger than bucket still pass
+void chargeIo(IoLimiter *limiter, uint32_t bytes)
+{
+    uint64_t now = nowNs();
+    limiter->stats.ops++;
+    limiter->stats.bytes += bytes;
+    atomic_store_explicit(&limiter->lastActive, now, memory_order_relaxed);
+    if (isIoShared() && now - limiter->shareTime > IO_SHARE_PERIOD)
+        updateShare(limiter, now);
+    // first operation finds buckets full
+    double elapsed = limiter->last ? (now - limiter->last) / 1e9 : 1e9;
+    limiter->last = now;
+    double byteWait = takeTokens(&limiter->byteTokens, effectiveRate(limiter->limit.bytesPerSecond, share.total.bytesPerSecond, limiter->fraction),
+                                 limiter->burst, elapsed, bytes);
+    double opWait = takeTokens(&limiter->opTokens, effectiveRate(limiter->limit.opsPerSecond, share.total.opsPerSecond, limiter->fraction),
+                               limiter->burst, elapsed, 1);
+    uint64_t wait = (uint64_t)(((byteWait > opWait) ? byteWait : opWait) * 1e9);
+    if (wait == 0)
+        return;
+    limiter->stats.throttled++;
+    limiter->stats.waitNs += wait;
+    struct timespec deadline;
+    deadline.tv_sec = (now + wait) / 1000000000ULL;
+    deadline.tv_nsec = (now + wait) % 1000000000ULL;
+    // guest thread is kicked with signals, wait continues after them
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+}
+
+void getIoStats(IoLimiter *limiter, IoStats *stats)
+{
+    *stats = limiter->stats;
+}
@@ -0,0 +1,41 @@
+#ifndef IO_LIMIT_H
+#define IO_LIMIT_H
+
+#include <stdint.h>
+
+// Quality of service of guest file system I/O. Every guest has token buckets of bytes and operations refilled at
+// its own rate, and when common I/O capacity is given, guests that did I/O recently share it in proportion to weights
+
+#define IO_BURST_DEFAULT 100 // ms of refill bucket holds when burst isn't given
+#define IO_WEIGHT_MAX 1000
+
+typedef struct
+{
+    uint64_t bytesPerSecond; // 0 - unlimited
+    uint64_t opsPerSecond;   // 0 - unlimited
+    int burst;               // ms of refill that can be used at once after guest was idle
+} IoLimit;
+
+typedef struct
+{
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t throttled; // operations guest had to wait for
+    uint64_t waitNs;    // time guest spent waiting
+} IoStats;
+
+typedef struct IoLimiter IoLimiter;
+
+// Parses KB:OPS[:BURST], KB per second and operations per second (0 - unlimited) with burst in ms
+int parseIoLimit(char *s, IoLimit *limit);
+// Common capacity shared by all limiters, set before any limiter is created
+void setIoShare(IoLimit *total);
+int isIoShared();
+
+IoLimiter *createIoLimiter(IoLimit *limit, int weight);
+void deleteIoLimiter(IoLimiter *limiter);
+// Blocks calling guest thread until its buckets have enough tokens for operation of given size
+void chargeIo(IoLimiter *limiter, uint32_t bytes);
+void getIoStats(IoLimiter *limiter, IoStats *stats);
+
+#endif
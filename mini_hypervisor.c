@@ -6,16 +6,39 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sched.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <linux/kvm.h>
+#include <linux/mempolicy.h>
+#include <linux/magic.h>
+#include <elf.h>
+#include "file_device.h"
+#include "device_bus.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "io_limit.h"
+#include "balloon.h"
+#include "sync_device.h"
 
 #define SIZE_4KB (0x1000)
 #define SIZE_2MB (0x200000)
 #define SIZE_4MB (0x400000)
 #define SIZE_8MB (0x800000)
+#define SIZE_1GB (0x40000000ULL)
 #define PDE64_PRESENT 1
 #define PDE64_RW (1U << 1)
 #define PDE64_USER (1U << 2)
@@ -31,43 +54,206 @@
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
 
+// CPUID
+#define CPUID_MAX_ENTRIES 100 // first guess of supported leaves, doubled while KVM answers E2BIG
+#ifndef KVM_MAX_CPUID_ENTRIES
+#define KVM_MAX_CPUID_ENTRIES 256 // kernel limit, not exported by uapi headers
+#endif
+#define CPUID_HYPERVISOR_LEAF 0x40000000
+#define CPUID_TIMING_LEAF 0x40000010 // EAX - TSC frequency in kHz
+
 #define PORT_IO 0x00E9
-#define PORT_FILE 0x0278
-
-#define FILE_OPEN_R 0x1
-#define FILE_OPEN_W 0x2
-#define FILE_CLOSE 0x3
-#define FILE_READ 0x4
-#define FILE_WRITE 0x5
-
-#define FSTATE1_NONE 0
-#define FSTATE1_OPEN_R 1
-#define FSTATE1_OPEN_W 2
-#define FSTATE1_CLOSE 3
-#define FSTATE1_READ 4
-#define FSTATE1_WRITE 5
-#define FSTATE2_NONE 6
-#define FSTATE2_START 7
-#define FSTATE2_FILENAME 8
-#define FSTATE2_FD 9
-#define FSTATE2_CHAR 10
+#define PORT_IO_REQUEST 0x00EA
+#define PORT_SHUTDOWN 0x00F4
+#define PORT_SHM 0x0280
+
+#define SHM_BASE SIZE_1GB // shared memory regions are mapped from 1GB to 2GB
+#define SHM_NAME_LENGTH 64
+#define SHM_SLOT_BASE 3 // slots 0 - 2 hold guest memory below, inside and above shared image text
+
+#define LOW_MEMORY_SLOT 0
+#define TEXT_SLOT 1
+#define HIGH_MEMORY_SLOT 2
+
+#define FILE_MAP_BASE (2 * SIZE_1GB) // host files are mapped into guest memory from 2GB to 6GB
+#define FILE_MAP_SIZE (4 * SIZE_1GB)
+#define FILE_MAP_MAX 64 // mappings per guest, each one takes memory slot after shared memory regions
+#define FILE_MAP_PRIVATE_SUFFIX ":private"
+
+#define PORT_MSG 0x0281
+
+#define MSG_OPEN 0x1
+#define MSG_SEND 0x2
+#define MSG_RECV 0x3
+
+#define MSG_NONBLOCK 0x1
+
+#define MSG_OK 0
+#define MSG_WOULD_BLOCK 1
+#define MSG_INTERRUPTED 2 // host interrupted blocking call, guest repeats it
+#define MSG_ERROR 0xFF
+
+#define MSTATE_NONE 0
+#define MSTATE_NAME 1
+#define MSTATE_FLAGS 2
+#define MSTATE_CHANNEL 3
+#define MSTATE_LENGTH 4
+#define MSTATE_DATA 5
+
+#define MSG_MAX_SIZE 256
+#define MSG_NAME_LENGTH 64
+#define MSG_QUEUE_CAPACITY 64 // must be power of 2
+#define MSG_MAX_CHANNELS 64
+
+#define IRQ_IO 1 // raised when requested input byte is ready
+
+#define MIN_PREPARE_WORKERS 32 // threads creating VMs at launch
+
+#define MEMORY_SHARED 0   // shared anonymous mapping, pages are allocated on first touch
+#define MEMORY_LAZY 1     // private mapping without swap reservation, so guest memory can be overcommitted
+#define MEMORY_POPULATE 2 // all pages are allocated at launch, guest never waits on first touch
+
+static const char *memoryPolicyNames[] = {"shared", "lazy", "populate"};
+
+#define BACKING_NONE 0      // host backs guest memory with 4KB pages
+#define BACKING_THP 1       // madvise(MADV_HUGEPAGE), kernel uses 2MB pages when it can
+#define BACKING_2MB 2       // MAP_HUGETLB from pool of 2MB pages
+#define BACKING_1GB 3       // MAP_HUGETLB from pool of 1GB pages
+#define BACKING_HUGETLBFS 4 // unlinked file in hugetlbfs mount
+
+static const char *backingNames[] = {"4KB pages", "transparent huge pages", "2MB huge pages", "1GB huge pages", "hugetlbfs"};
+
+#define HUGETLB_2MB_FLAG (21 << MAP_HUGE_SHIFT)
+#define HUGETLB_1GB_FLAG (30 << MAP_HUGE_SHIFT)
+
+#define PLACEMENT_NONE 0    // guest threads float, unless manifest pins them
+#define PLACEMENT_LIST 1    // guests are pinned to listed cpus in round robin
+#define PLACEMENT_COMPACT 2 // guests fill allowed cpus in order, so neighbouring guests share node
+#define PLACEMENT_SPREAD 3  // guests are dealt across NUMA nodes in round robin
+
+#define CHECKPOINT_DEFAULT_INTERVAL 5 // seconds
+#define CHECKPOINT_CHAIN_MAX 32       // incremental checkpoints after full one, then new chain starts
+#define CHECKPOINT_MAGIC "MHCKPT01"
+#define SNAPSHOT_MAX_REGIONS (2 + FILE_MAP_MAX) // guest memory around shared text and private file mappings
+
+#define MIGRATION_MAGIC "MHMIGR01"
+#define MIGRATION_MAX_ROUNDS 30     // pre-copy rounds before guest is paused even if it keeps writing
+#define MIGRATION_FINAL_PAGES 256   // guest is paused once round sends fewer pages than this
+#define MIGRATION_PAUSE_TIMEOUT 5   // seconds guest has to stop after it is kicked
+
+#define MIGRATION_NO_GUEST 0 // guest isn't sent, it stays where it is
+#define MIGRATION_ROUND 1    // file mappings and pages, guest keeps running
+#define MIGRATION_FINAL 2    // mappings, pages, vCPU and device state of paused guest
+#define MIGRATION_ABORT 3    // guest stopped or couldn't be paused, it stays on source
+
+#define GUEST_RUNNING 0
+#define GUEST_PAUSED 1
+#define GUEST_MIGRATED 2 // guest runs in another hypervisor now, its thread stops
+#define GUEST_ENDED 3
 
 typedef struct
 {
-    void *data;
-    void *next;
-} LLNode;
+    char *name;
+    char *mem;
+    uint64_t size;
+    uint64_t guestAddr;
+} SharedRegion;
 
-typedef LLNode LinkedList;
+// Host file mapped into guest memory, mapping lives until guest stops
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    int mode;           // FILE_MAP_SHARED or FILE_MAP_PRIVATE
+    char *mem;
+    uint64_t size;      // file size rounded up to 2MB
+    uint64_t guestAddr;
+    char *path;         // mapping is recreated from host path when guest is restored
+} FileMapping;
 
 typedef struct
 {
-    char *name;
-    char canRead;  // 0 - no, 1 - yes
-    char canWrite; // 0 - no, 1 - yes
-    int guestFd;
-    int hostFd;
-} MyFile;
+    pthread_mutex_t lock;
+    int eventFd;  // irqfd bound to IRQ_IO
+    char state;   // INPUT_NONE, INPUT_REQUESTED, INPUT_READY
+    char byte;
+} ConsoleInput;
+
+#define INPUT_NONE 0
+#define INPUT_REQUESTED 1
+#define INPUT_READY 2
+#define INPUT_CANCELLED (EOF - 1) // not a state, result of reading stdin for request that was cancelled
+
+struct vm
+{
+    int vm_fd;
+    int vcpu_fd;
+    char *mem;
+    size_t mem_map_size; // guest memory rounded up to huge page size
+    int backing;         // BACKING_* that guest memory actually got
+    size_t page_size;    // host page backing guest memory, smallest part of it that can be released
+    struct kvm_run *kvm_run;
+    int kvm_run_size;
+};
+
+// Guest described by one line of manifest file, fields left 0/NULL take values from command line
+typedef struct
+{
+    char *image;
+    int memorySize;
+    int pageSize;
+    char filesSet;           // 0 - shared files given by --file, 1 - files listed in manifest
+    LinkedList *sharedFiles;
+    int sharedFileCount;
+    char *input;             // NULL - console
+    char *output;            // NULL - console
+    int cpu;                 // -1 - not pinned
+    int memoryPolicy;        // -1 - taken from command line
+    IoLimit ioLimit;         // both rates 0 - limit from command line
+    int ioWeight;            // 0 - default weight
+    char *directory;         // NULL - directory of guest is created in work directory
+    char *group;             // NULL - guest is in no sync group
+} GuestEntry;
+
+// Loadable segment of ELF image, file data is inside image data
+typedef struct
+{
+    uint64_t addr; // guest physical address
+    uint64_t offset;
+    uint64_t fileSize;
+    uint64_t memSize; // bytes above fileSize are .bss
+    char writable;
+} ImageSegment;
+
+// Read-only pages of image, mapped into every guest launched from it from one host copy
+typedef struct
+{
+    uint64_t start; // guest physical address, page aligned
+    uint64_t size;
+    char *mem;      // NULL - image has no shared text
+} SharedText;
+
+// Image file is read and parsed once no matter how many guests are launched from it
+typedef struct
+{
+    char *path;
+    char *data;
+    size_t size;
+    char state; // IMAGE_NONE, IMAGE_LOADED, IMAGE_FAILED
+    pthread_mutex_t lock;
+    char isElf; // 0 - flat binary loaded at address 0 and started from it
+    uint64_t entry;
+    ImageSegment *segments;
+    int segmentCount;
+    uint64_t loadEnd; // end of highest segment, page tables are placed after it
+    SharedText text;
+    SymbolTable *symbols; // loaded for profiling, NULL - no symbols
+    char symbolsLoaded;
+} GuestImage;
+
+#define IMAGE_NONE 0
+#define IMAGE_LOADED 1
+#define IMAGE_FAILED 2
 
 typedef struct
 {
@@ -75,492 +261,415 @@ typedef struct
     int memorySize;
     int pageSize;
     char *guestFile;
+    int cpu;      // -1 - thread is not pinned
+    int node;     // -1 - memory is not bound to NUMA node
+    FILE *input;  // NULL - guest reads EOF
+    FILE *output; // NULL - guest output is discarded
+    struct vm vm;
+    char ready;   // 0 - initialization failed, 1 - VM is ready to run
+    int memoryPolicy;
+    int backing;         // requested BACKING_*
+    char *hugetlbfsPath; // mount point used by BACKING_HUGETLBFS
+    size_t residentSize; // bytes of guest memory resident in host when guest stopped
     int kvmFd;
     int sharedFileCount;
-    int nextGuestFd;
     LinkedList *sharedFiles;
+    LinkedList *sharedRegions;
+    LinkedList *attachedFiles; // arguments of --attach, mapped before guest starts
+    LinkedList *fileMappings;
+    uint64_t nextMapAddr;
+    int nextMapSlot;
+    uint64_t mapTables; // guest address of page directories covering file mapping window
+    int durability;
+    size_t scratchLimit; // 0 - local files are on disk
+    char scratchExport;  // 0 - no, 1 - yes
+    char *recordPrefix;  // NULL - file device accesses are not recorded
+    char *directory;     // directory of guest's local files, NULL - "guestID" in working directory
+    IoLimit ioLimit;     // both rates 0 - guest has no own I/O limit
+    int ioWeight;        // share of common I/O capacity relative to other guests
+    IoLimiter *ioLimiter; // NULL - guest I/O is not limited
+    SyncGroup *syncGroup; // NULL - guest can't open sync objects
+    GuestProfile *profile; // NULL - guest is not profiled
+    pthread_mutex_t kickLock;
+    pthread_t thread;
+    char executing;        // 1 - thread is in run loop and can be kicked by sampler or checkpoint thread
+    ConsoleInput console;
+    SnapshotRegion snapshotRegions[SNAPSHOT_MAX_REGIONS];
+    int snapshotRegionCount;
+    FileDevice *fileDevice;
+    struct MsgDevice *msgDevice; // kick wakes guest thread waiting on channel
+    SyncDevice *syncDevice; // kick wakes guest thread waiting on sync object
+    atomic_int checkpointDue;
+    int checkpointSeq;       // sequence number of next checkpoint, 0 - next one is full and starts new chain
+    int checkpointLast;      // highest sequence number written in current chain, -1 - none
+    uint64_t checkpointBase; // chain id, every checkpoint of chain carries it
+    int checkpointCount;
+    uint64_t checkpointPages;
+    double checkpointTime;   // ms spent writing checkpoints
+    char *restoredDevice;    // saved file device state, applied once device is created
+    size_t restoredDeviceSize;
+    pthread_mutex_t snapshotLock; // held while dirty log is collected or file mappings change
+    pthread_cond_t runStateChanged;
+    char runState;           // GUEST_*, guarded by kickLock
+    char pauseRequested;     // guarded by kickLock
 } GuestSettings;
 
-static int pushString(LinkedList **list, char *s)
+// Single host thread serves input requests of all guests in FIFO order, so a guest waiting for input
+// halts inside KVM instead of blocking its own thread in scanf
+typedef struct
 {
-    char *str = (char *)malloc(strlen(s) + 1);
-    if (str == NULL)
+    pthread_mutex_t lock;
+    pthread_cond_t nonEmpty;
+    pthread_cond_t idle;      // signaled once thread no longer reads for guest in reading
+    GuestSettings **requests; // ring buffer, each guest has at most one pending request
+    int capacity;
+    int head;
+    int count;
+    GuestSettings *reading;   // guest whose byte thread is reading from stdin
+    char cancelReading;       // guest in reading stopped, byte isn't read for it
+    char stop;
+    int wakeFd;               // eventfd, interrupts wait for stdin on cancel or stop
+} InputQueue;
+
+static InputQueue inputQueue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, NULL, 0, 0, -1};
+
+static void requestInput(GuestSettings *guestSettings)
+{
+    ConsoleInput *console = &guestSettings->console;
+    pthread_mutex_lock(&console->lock);
+    if (console->state != INPUT_NONE)
     {
-        return -1;
+        pthread_mutex_unlock(&console->lock);
+        return;
     }
-    strcpy(str, s);
-    LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
-    if (elem == NULL)
+    console->state = INPUT_REQUESTED;
+    pthread_mutex_unlock(&console->lock);
+
+    if (guestSettings->input != stdin)
     {
-        free(str);
-        return -1;
+        // input file or no input never blocks, so it is served right away
+        int c = guestSettings->input ? fgetc(guestSettings->input) : EOF;
+        pthread_mutex_lock(&console->lock);
+        console->byte = (char)c;
+        console->state = INPUT_READY;
+        pthread_mutex_unlock(&console->lock);
+        uint64_t one = 1;
+        if (write(console->eventFd, &one, sizeof(one)) != sizeof(one))
+            printf("{Guest %d} Error: failed to signal input interrupt\n", guestSettings->id);
+        return;
     }
-    elem->data = str;
-    elem->next = *list;
-    *list = elem;
-    return 0;
+
+    pthread_mutex_lock(&inputQueue.lock);
+    inputQueue.requests[(inputQueue.head + inputQueue.count) % inputQueue.capacity] = guestSettings;
+    inputQueue.count++;
+    pthread_cond_signal(&inputQueue.nonEmpty);
+    pthread_mutex_unlock(&inputQueue.lock);
 }
 
-char *localizeFilename(char *filename, int id)
+// Waits until stdin is readable, so no byte is taken once request is cancelled. Stdin is unbuffered,
+// otherwise bytes already in its buffer wouldn't wake poll
+static int readStdin()
 {
-    int fl = strlen(filename);
-    int l = fl + 1;
-    l += 6; // .local
-    if (id == 0)
-        l += 1;
-    else
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {inputQueue.wakeFd, POLLIN, 0}};
+    while (1)
     {
-        int t = id;
-        while (t > 0)
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return getchar();
+        if (fds[0].revents)
+            return getchar();
+        if (fds[1].revents)
         {
-            l += 1;
-            t /= 10;
+            uint64_t count;
+            if (read(inputQueue.wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return getchar();
+            pthread_mutex_lock(&inputQueue.lock);
+            int interrupted = inputQueue.stop || inputQueue.cancelReading;
+            pthread_mutex_unlock(&inputQueue.lock);
+            if (interrupted)
+                return INPUT_CANCELLED;
         }
     }
-    char *result = (char *)malloc(l);
-    if (!result)
-        return NULL;
-    strncpy(result, filename, fl);
-    strncpy(result + fl, ".local", 6);
-    result[l - 1] = '\0';
-    if (id == 0)
-        result[l - 2] = '0';
-    else
+}
+
+static void *inputThread(void *arg)
+{
+    pthread_mutex_lock(&inputQueue.lock);
+    while (1)
     {
-        int t = id, k = l - 2;
-        while (t > 0)
+        while (inputQueue.count == 0 && !inputQueue.stop)
+            pthread_cond_wait(&inputQueue.nonEmpty, &inputQueue.lock);
+        if (inputQueue.stop)
+            break;
+        GuestSettings *guestSettings = inputQueue.requests[inputQueue.head];
+        inputQueue.head = (inputQueue.head + 1) % inputQueue.capacity;
+        inputQueue.count--;
+        inputQueue.reading = guestSettings;
+        inputQueue.cancelReading = 0;
+        pthread_mutex_unlock(&inputQueue.lock);
+
+        int c = readStdin();
+        // guest that cancels waits for idle, so its console and eventfd stay valid until then
+        pthread_mutex_lock(&inputQueue.lock);
+        if (c != INPUT_CANCELLED)
         {
-            result[k] = (char)('0' + t % 10);
-            k--;
-            t /= 10;
+            ConsoleInput *console = &guestSettings->console;
+            pthread_mutex_lock(&console->lock);
+            console->byte = (char)c;
+            console->state = INPUT_READY;
+            pthread_mutex_unlock(&console->lock);
+
+            uint64_t one = 1;
+            if (write(console->eventFd, &one, sizeof(one)) != sizeof(one))
+                printf("{Guest %d} Error: failed to signal input interrupt\n", guestSettings->id);
         }
+        inputQueue.reading = NULL;
+        pthread_cond_broadcast(&inputQueue.idle);
     }
-    return result;
+    pthread_mutex_unlock(&inputQueue.lock);
+    return NULL;
 }
 
-char *extendFilename(char *filename, char c)
+// Guest that stopped drops its pending request, so input thread never reads a byte for it
+static void cancelInput(GuestSettings *guestSettings)
 {
-    int l;
-    if (!filename)
-        l = 2;
-    else
-        l = strlen(filename) + 2;
-    char *result = (char *)malloc(l);
-    if (!result)
+    uint64_t one = 1;
+    pthread_mutex_lock(&inputQueue.lock);
+    for (int i = 0; i < inputQueue.count; i++)
     {
-        return NULL;
+        if (inputQueue.requests[(inputQueue.head + i) % inputQueue.capacity] != guestSettings)
+            continue;
+        for (int j = i; j < inputQueue.count - 1; j++)
+            inputQueue.requests[(inputQueue.head + j) % inputQueue.capacity] = inputQueue.requests[(inputQueue.head + j + 1) % inputQueue.capacity];
+        inputQueue.count--;
+        break;
     }
-    if (filename)
-        strcpy(result, filename);
-    result[l - 2] = c;
-    result[l - 1] = '\0';
-    return result;
+    if (inputQueue.reading == guestSettings)
+    {
+        inputQueue.cancelReading = 1;
+        if (write(inputQueue.wakeFd, &one, sizeof(one)) != sizeof(one))
+            printf("{Guest %d} Error: failed to cancel input request\n", guestSettings->id);
+        while (inputQueue.reading == guestSettings)
+            pthread_cond_wait(&inputQueue.idle, &inputQueue.lock);
+    }
+    pthread_mutex_unlock(&inputQueue.lock);
 }
 
-char *copyFilename(char *filename)
+static void stopInputThread(pthread_t thread)
 {
-    if (!filename)
-        return NULL;
-    int l = strlen(filename);
-    char *result = (char *)malloc(l + 1);
-    if (!result)
-        return NULL;
-    strcpy(result, filename);
-    return result;
+    uint64_t one = 1;
+    pthread_mutex_lock(&inputQueue.lock);
+    inputQueue.stop = 1;
+    pthread_cond_signal(&inputQueue.nonEmpty);
+    pthread_mutex_unlock(&inputQueue.lock);
+    if (write(inputQueue.wakeFd, &one, sizeof(one)) != sizeof(one))
+        printf("Error: failed to stop input thread\n");
+    pthread_join(thread, NULL);
+    close(inputQueue.wakeFd);
+    free(inputQueue.requests);
+}
+
+static char takeInput(GuestSettings *guestSettings)
+{
+    ConsoleInput *console = &guestSettings->console;
+    pthread_mutex_lock(&console->lock);
+    if (console->state != INPUT_READY)
+    {
+        // guest thread never waits for stdin, where kicks couldn't reach it: byte that wasn't requested or didn't
+        // arrive yet reads as EOF, and pending request stays queued. Input file doesn't block, so it is read directly
+        int requested = (console->state == INPUT_REQUESTED);
+        pthread_mutex_unlock(&console->lock);
+        if (requested || !guestSettings->input || guestSettings->input == stdin)
+            return (char)EOF;
+        return (char)fgetc(guestSettings->input);
+    }
+    char c = console->byte;
+    console->state = INPUT_NONE;
+    pthread_mutex_unlock(&console->lock);
+    return c;
 }
 
-static int pushFile(LinkedList **list, MyFile *file)
+static int pushString(LinkedList **list, char *s)
 {
+    char *str = (char *)malloc(strlen(s) + 1);
+    if (str == NULL)
+    {
+        return -1;
+    }
+    strcpy(str, s);
     LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
     if (elem == NULL)
     {
+        free(str);
         return -1;
     }
-    elem->data = file;
+    elem->data = str;
     elem->next = *list;
     *list = elem;
     return 0;
 }
 
-static void deleteFile(LinkedList **list, MyFile *file)
+static void deleteList(LinkedList *list, int deleteData)
 {
-    if (!(*list))
-        return;
-    LLNode *temp = NULL;
-    if ((*list)->data == file)
-    {
-        temp = *list;
-        *list = (*list)->next;
-    }
-    else
-    {
-        LLNode *prev = *list;
-        while (prev->next)
-        {
-            LLNode *nextNode = (LLNode *)prev->next;
-            if (nextNode->data == file)
-            {
-                temp = nextNode;
-                prev->next = temp->next;
-                break;
-            }
-            prev = nextNode;
-        }
-    }
-    if (temp)
+    while (list)
     {
-        MyFile *tempFile = (MyFile *)temp->data;
-        if (tempFile->hostFd > -1)
-            close(tempFile->hostFd);
-        free(tempFile->name);
-        free(tempFile);
+        LLNode *temp = list;
+        list = list->next;
+        if (deleteData)
+            free(temp->data);
         free(temp);
     }
 }
 
-static void deleteFileList(LinkedList **list)
+static int pushSharedRegion(LinkedList **list, char *arg, uint64_t guestAddr)
 {
-    while (*list)
+    char *separator = strchr(arg, ':');
+    if (!separator || separator == arg || separator - arg > SHM_NAME_LENGTH)
+        return -1;
+    char *end;
+    long megabytes = strtol(separator + 1, &end, 10);
+    if (*end || megabytes <= 0 || megabytes % 2 != 0 || guestAddr + megabytes * 0x100000ULL > SHM_BASE + SIZE_1GB)
+        return -1;
+    for (LLNode *temp = *list; temp; temp = temp->next)
     {
-        deleteFile(list, (*list)->data);
+        SharedRegion *other = (SharedRegion *)temp->data;
+        if (strlen(other->name) == (size_t)(separator - arg) && strncmp(other->name, arg, separator - arg) == 0)
+            return -1;
+    }
+    SharedRegion *region = (SharedRegion *)malloc(sizeof(SharedRegion));
+    if (!region)
+        return -1;
+    region->name = strndup(arg, separator - arg);
+    region->size = megabytes * 0x100000ULL;
+    region->guestAddr = guestAddr;
+    region->mem = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+    if (!region->name || region->mem == MAP_FAILED || !elem)
+    {
+        if (region->mem != MAP_FAILED)
+            munmap(region->mem, region->size);
+        free(region->name);
+        free(region);
+        free(elem);
+        return -1;
     }
+    elem->data = region;
+    elem->next = *list;
+    *list = elem;
+    return 0;
 }
 
-static void deleteList(LinkedList *list, int deleteData)
+static void deleteRegionList(LinkedList *list)
 {
     while (list)
     {
         LLNode *temp = list;
         list = list->next;
-        if (deleteData)
-            free(temp->data);
+        SharedRegion *region = (SharedRegion *)temp->data;
+        munmap(region->mem, region->size);
+        free(region->name);
+        free(region);
         free(temp);
     }
 }
 
-printFileList(LinkedList *list)
+static int set_memory_slot(struct vm *vm, int slot, uint64_t guestAddr, uint64_t size, char *mem, int flags)
 {
-    printf("File list:\n");
-    LLNode *temp = list;
-    while (temp)
-    {
-        printf("\tNew file\n");
-        MyFile *tempFile = (MyFile *)temp->data;
-        printf("\t\tName: '%s'\n", tempFile->name);
-        printf("\t\tGuest fd: %d\n", tempFile->guestFd);
-        printf("\t\tHost fd: %d\n", tempFile->hostFd);
-        printf("\t\tCan read: %d\n", tempFile->canRead);
-        printf("\t\tCan write: %d\n", tempFile->canWrite);
-        temp = temp->next;
-    }
+    struct kvm_userspace_memory_region region;
+    region.slot = slot;
+    region.flags = flags;
+    region.guest_phys_addr = guestAddr;
+    region.memory_size = size;
+    region.userspace_addr = (unsigned long)mem;
+    return ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region);
 }
 
-static int openFile(LinkedList **sharedFileSystem, LinkedList **localFileSystem, char *name, char toRead, GuestSettings *guestSettings)
+// Block size of hugetlbfs mount is its huge page size, 2MB or 1GB
+static char *mapHugetlbfs(char *directory, size_t size, int flags, size_t *mapSize, size_t *pageSize)
 {
-    char *localName = localizeFilename(name, guestSettings->id);
-    if (!localName)
-        return -1;
-    MyFile *localFile = NULL;
-    MyFile *sharedFile = NULL;
-    LLNode *temp = *sharedFileSystem;
-    while (temp)
-    {
-        MyFile *tempFile = (MyFile *)temp->data;
-        if (strcmp(tempFile->name, name) == 0)
-        {
-            sharedFile = tempFile;
-            break;
-        }
-        temp = temp->next;
-    }
-    if (!sharedFile)
-    {
-        temp = *localFileSystem;
-        while (temp)
-        {
-            MyFile *tempFile = (MyFile *)temp->data;
-            if (strcmp(tempFile->name, localName) == 0)
-            {
-                localFile = tempFile;
-                break;
-            }
-            temp = temp->next;
-        }
-        if (!localFile)
-        {
-            if (toRead)
-                return -1;
-            MyFile *newFile = (MyFile *)malloc(sizeof(MyFile));
-            if (!newFile)
-            {
-                free(localName);
-                return -1;
-            }
-            newFile->hostFd = open(localName, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IRWXO);
-            if (newFile->hostFd < 0)
-            {
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            if (pushFile(localFileSystem, newFile) != 0)
-            {
-                close(newFile->hostFd);
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            newFile->canRead = 0;
-            newFile->canWrite = 1;
-            newFile->name = localName;
-            newFile->guestFd = guestSettings->nextGuestFd;
-            guestSettings->nextGuestFd += 1;
-            // printFileList(*localFileSystem);
-            return newFile->guestFd;
-        }
-        else
-        {
-            MyFile *newFile = (MyFile *)malloc(sizeof(MyFile));
-            if (!newFile)
-            {
-                free(localName);
-                return -1;
-            }
-            newFile->hostFd = open(localName, toRead ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC), S_IRWXU | S_IRWXG | S_IRWXO);
-            if (newFile->hostFd < 0)
-            {
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            if (pushFile(localFileSystem, newFile) != 0)
-            {
-                close(newFile->hostFd);
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            newFile->canRead = toRead;
-            newFile->canWrite = 1 - toRead;
-            newFile->name = localName;
-            newFile->guestFd = guestSettings->nextGuestFd;
-            guestSettings->nextGuestFd += 1;
-            // printFileList(*localFileSystem);
-            return newFile->guestFd;
-        }
-    }
-    else
+    char path[4096];
+    struct statfs fs;
+    snprintf(path, sizeof(path), "%s/mini_hypervisor.XXXXXX", directory);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return MAP_FAILED;
+    unlink(path);
+    char *mem = MAP_FAILED;
+    if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC && fs.f_bsize > 0)
     {
-        if (sharedFile->canRead)
-        {
-            if (toRead)
-            {
-                free(localName);
-                MyFile *newFile = (MyFile *)malloc(sizeof(MyFile));
-                if (!newFile)
-                {
-                    return -1;
-                }
-                newFile->hostFd = open(name, O_RDONLY);
-                if (newFile->hostFd < 0)
-                {
-                    free(newFile);
-                    return -1;
-                }
-                if (pushFile(localFileSystem, newFile) != 0)
-                {
-                    close(newFile->hostFd);
-                    free(newFile);
-                    return -1;
-                }
-                newFile->canRead = 1;
-                newFile->canWrite = 0;
-                newFile->name = name;
-                newFile->guestFd = guestSettings->nextGuestFd;
-                guestSettings->nextGuestFd += 1;
-                // printFileList(*localFileSystem);
-                return newFile->guestFd;
-            }
-            else
-            {
-                sharedFile->canRead = 0;
-                temp = *localFileSystem;
-                while (temp)
-                {
-                    MyFile *tempFile = (MyFile *)temp->data;
-                    if (strcmp(tempFile->name, name) == 0)
-                    {
-                        close(tempFile->hostFd);
-                        tempFile->hostFd = -1;
-                        tempFile->guestFd = -1;
-                    }
-                    temp = temp->next;
-                }
-                MyFile *newFile = (MyFile *)malloc(sizeof(MyFile));
-                if (!newFile)
-                {
-                    free(localName);
-                    return -1;
-                }
-                newFile->hostFd = open(localName, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IRWXO);
-                if (newFile->hostFd < 0)
-                {
-                    free(localName);
-                    free(newFile);
-                    return -1;
-                }
-                if (pushFile(localFileSystem, newFile) != 0)
-                {
-                    close(newFile->hostFd);
-                    free(localName);
-                    free(newFile);
-                    return -1;
-                }
-                newFile->canRead = 0;
-                newFile->canWrite = 1;
-                newFile->name = localName;
-                newFile->guestFd = guestSettings->nextGuestFd;
-                guestSettings->nextGuestFd += 1;
-                // printFileList(*localFileSystem);
-                return newFile->guestFd;
-            }
-        }
-        else
-        {
-            MyFile *newFile = (MyFile *)malloc(sizeof(MyFile));
-            if (!newFile)
-            {
-                free(localName);
-                return -1;
-            }
-            newFile->hostFd = open(localName, toRead ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC), S_IRWXU | S_IRWXG | S_IRWXO);
-            if (newFile->hostFd < 0)
-            {
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            if (pushFile(localFileSystem, newFile) != 0)
-            {
-                close(newFile->hostFd);
-                free(localName);
-                free(newFile);
-                return -1;
-            }
-            newFile->canRead = toRead;
-            newFile->canWrite = 1 - toRead;
-            newFile->name = localName;
-            newFile->guestFd = guestSettings->nextGuestFd;
-            guestSettings->nextGuestFd += 1;
-            // printFileList(*localFileSystem);
-            return newFile->guestFd;
-        }
+        *pageSize = fs.f_bsize;
+        *mapSize = (size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+        if (ftruncate(fd, *mapSize) == 0)
+            mem = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, flags, fd, 0);
     }
+    close(fd);
+    return mem;
 }
 
-static char closeFile(LinkedList **localFileSystem, int fd)
+// Guest memory comes from requested source of huge pages, falling back to smaller pages when it is unavailable
+static char *allocGuestMemory(size_t size, int flags, int backing, char *hugetlbfsPath, int *obtained, size_t *mapSize, size_t *pageSize)
 {
-    LLNode *temp = *localFileSystem;
-    MyFile *foundFile = NULL;
-    while (temp)
+    char *mem = MAP_FAILED;
+    *pageSize = SIZE_4KB;
+    // huge pages are reserved at mmap, without reservation guest could fault on exhausted pool
+    int hugeFlags = flags & ~(MAP_NORESERVE | MAP_ANONYMOUS);
+    if (backing == BACKING_HUGETLBFS)
     {
-        MyFile *tempFile = (MyFile *)temp->data;
-        if (tempFile->guestFd == fd)
-        {
-            foundFile = tempFile;
-            break;
-        }
-        temp = temp->next;
+        mem = mapHugetlbfs(hugetlbfsPath, size, hugeFlags, mapSize, pageSize);
+        backing = (mem == MAP_FAILED) ? BACKING_THP : backing;
     }
-    if (!foundFile)
-        return EOF;
-    if (foundFile->hostFd < 0)
-        return EOF;
-    else
+    if (backing == BACKING_1GB)
     {
-        close(foundFile->hostFd);
-        foundFile->guestFd = -1;
-        foundFile->hostFd = -1;
-        foundFile->canRead = 0;
-        if (foundFile->canWrite)
-        {
-            foundFile->canWrite = 0;
-        }
-        else
-        {
-            deleteFile(localFileSystem, foundFile);
-        }
+        *mapSize = (size + SIZE_1GB - 1) & ~(SIZE_1GB - 1);
+        mem = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, hugeFlags | MAP_ANONYMOUS | MAP_HUGETLB | HUGETLB_1GB_FLAG, -1, 0);
+        backing = (mem == MAP_FAILED) ? BACKING_2MB : backing;
+        *pageSize = (mem == MAP_FAILED) ? *pageSize : SIZE_1GB;
     }
-    return 0;
-}
-
-static char readFile(LinkedList *localFileSystem, int fd)
-{
-    LLNode *temp = localFileSystem;
-    MyFile *foundFile = NULL;
-    while (temp)
+    if (backing == BACKING_2MB)
     {
-        MyFile *tempFile = (MyFile *)temp->data;
-        if (tempFile->guestFd == fd)
-        {
-            foundFile = tempFile;
-            break;
-        }
-        temp = temp->next;
+        *mapSize = (size + SIZE_2MB - 1) & ~((size_t)SIZE_2MB - 1);
+        mem = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, hugeFlags | MAP_ANONYMOUS | MAP_HUGETLB | HUGETLB_2MB_FLAG, -1, 0);
+        backing = (mem == MAP_FAILED) ? BACKING_THP : backing;
+        *pageSize = (mem == MAP_FAILED) ? *pageSize : SIZE_2MB;
     }
-    if (!foundFile)
-        return EOF;
-    if (!foundFile->canRead)
-        return EOF;
-    if (foundFile->hostFd < 0)
-        return EOF;
-    char buffer[1];
-    int result = read(foundFile->hostFd, (void *)(&buffer), 1);
-    if (result < 1)
-        return EOF;
-    return buffer[0];
-}
-
-static char writeFile(LinkedList *localFileSystem, int fd, char c, int id)
-{
-    LLNode *temp = localFileSystem;
-    MyFile *foundFile = NULL;
-    while (temp)
+    *mapSize = (mem == MAP_FAILED) ? size : *mapSize;
+    if (backing == BACKING_THP)
     {
-        MyFile *tempFile = (MyFile *)temp->data;
-        if (tempFile->guestFd == fd)
+        // mapping is aligned to 2MB, so every 2MB of guest memory can be one huge page
+        char *raw = mmap(NULL, size + SIZE_2MB, PROT_READ | PROT_WRITE, flags & ~MAP_POPULATE, -1, 0);
+        if (raw != MAP_FAILED)
         {
-            foundFile = tempFile;
-            break;
+            mem = (char *)(((uintptr_t)raw + SIZE_2MB - 1) & ~((uintptr_t)SIZE_2MB - 1));
+            if (mem > raw)
+                munmap(raw, mem - raw);
+            if (raw + SIZE_2MB > mem)
+                munmap(mem + size, raw + SIZE_2MB - mem);
+            if (madvise(mem, size, MADV_HUGEPAGE) != 0)
+                backing = BACKING_NONE;
+            if (flags & MAP_POPULATE)
+                madvise(mem, size, MADV_POPULATE_WRITE);
         }
-        temp = temp->next;
-    }
-    if (!foundFile)
-        return EOF;
-    if (!foundFile->canWrite)
-        return EOF;
-    if (foundFile->hostFd < 0)
-        return EOF;
-    char buffer[1] = {c};
-    int result = write(foundFile->hostFd, (void *)(&buffer), 1);
-    if (result < 1)
-        return EOF;
-    return c;
+        else
+            backing = BACKING_NONE;
+    }
+    if (mem == MAP_FAILED)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    *obtained = backing;
+    return mem;
 }
 
-struct vm
-{
-    int vm_fd;
-    int vcpu_fd;
-    char *mem;
-    struct kvm_run *kvm_run;
-};
-
-int init_vm(struct vm *vm, int kvm_fd, size_t mem_size)
+// slotFlags are added to writable memory slots, KVM_MEM_LOG_DIRTY_PAGES when guest is checkpointed
+int init_vm(struct vm *vm, int kvm_fd, size_t mem_size, int policy, SharedText *text, int backing, char *hugetlbfsPath, int slotFlags)
 {
-    struct kvm_userspace_memory_region region;
     int kvm_run_mmap_size;
+    int flags = MAP_SHARED | MAP_ANONYMOUS;
+    if (policy == MEMORY_LAZY)
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    else if (policy == MEMORY_POPULATE)
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
 
+    vm->vcpu_fd = -1;
+    vm->mem = NULL;
+    vm->kvm_run = NULL;
     vm->vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0);
     if (vm->vm_fd < 0)
     {
@@ -568,24 +677,32 @@ int init_vm(struct vm *vm, int kvm_fd, size_t mem_size)
         return -1;
     }
 
-    vm->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->mem == MAP_FAILED)
+    if (ioctl(vm->vm_fd, KVM_CREATE_IRQCHIP, 0) < 0)
     {
-        // perror("mmap mem");
+        // perror("KVM_CREATE_IRQCHIP");
         return -1;
     }
 
-    region.slot = 0;
-    region.flags = 0;
-    region.guest_phys_addr = 0;
-    region.memory_size = mem_size;
-    region.userspace_addr = (unsigned long)vm->mem;
-    if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+    vm->mem = allocGuestMemory(mem_size, flags, backing, hugetlbfsPath, &vm->backing, &vm->mem_map_size, &vm->page_size);
+    if (vm->mem == MAP_FAILED)
+    {
+        // perror("mmap mem");
+        vm->mem = NULL;
+        return -1;
+    }
+
+    // guest memory is split around shared text, pages of guest memory under it are never touched
+    uint64_t textStart = (text && text->mem) ? text->start : mem_size;
+    uint64_t textEnd = (text && text->mem) ? text->start + text->size : mem_size;
+    if (textStart > 0 && set_memory_slot(vm, LOW_MEMORY_SLOT, 0, textStart, vm->mem, slotFlags) < 0)
     {
         // perror("KVM_SET_USER_MEMORY_REGION");
         return -1;
     }
+    if (textEnd > textStart && set_memory_slot(vm, TEXT_SLOT, textStart, textEnd - textStart, text->mem, KVM_MEM_READONLY) < 0)
+        return -1;
+    if (textEnd > textStart && textEnd < mem_size && set_memory_slot(vm, HIGH_MEMORY_SLOT, textEnd, mem_size - textEnd, vm->mem + textEnd, slotFlags) < 0)
+        return -1;
 
     vm->vcpu_fd = ioctl(vm->vm_fd, KVM_CREATE_VCPU, 0);
     if (vm->vcpu_fd < 0)
@@ -606,12 +723,66 @@ int init_vm(struct vm *vm, int kvm_fd, size_t mem_size)
     if (vm->kvm_run == MAP_FAILED)
     {
         // perror("mmap kvm_run");
+        vm->kvm_run = NULL;
         return -1;
     }
+    vm->kvm_run_size = kvm_run_mmap_size;
 
     return 0;
 }
 
+// Returns number of bytes of guest memory that are currently backed by host pages
+static size_t resident_size(struct vm *vm, size_t mem_size)
+{
+    size_t pages = mem_size / SIZE_4KB;
+    unsigned char *vec = (unsigned char *)malloc(pages);
+    size_t resident = 0;
+    if (vec && mincore(vm->mem, mem_size, vec) == 0)
+    {
+        for (size_t i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    }
+    free(vec);
+    return resident * SIZE_4KB;
+}
+
+// Kernel decides which parts of THP backed memory get huge pages, so they are counted from /proc/self/smaps
+static size_t huge_resident_size(struct vm *vm)
+{
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (!smaps)
+        return 0;
+    char line[256];
+    unsigned long start, end;
+    size_t kb, total = 0;
+    int inside = 0;
+    while (fgets(line, sizeof(line), smaps))
+    {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            inside = (start == (unsigned long)vm->mem);
+        else if (inside && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 || sscanf(line, "ShmemPmdMapped: %zu kB", &kb) == 1))
+            total += kb * 1024;
+    }
+    fclose(smaps);
+    return total;
+}
+
+static void release_vm(struct vm *vm)
+{
+    if (vm->kvm_run)
+        munmap(vm->kvm_run, vm->kvm_run_size);
+    if (vm->mem)
+        munmap(vm->mem, vm->mem_map_size);
+    if (vm->vcpu_fd >= 0)
+        close(vm->vcpu_fd);
+    if (vm->vm_fd >= 0)
+        close(vm->vm_fd);
+    vm->kvm_run = NULL;
+    vm->mem = NULL;
+    vm->vcpu_fd = -1;
+    vm->vm_fd = -1;
+}
+
 static void setup_64bit_code_segment(struct kvm_sregs *sregs)
 {
     struct kvm_segment seg = {
@@ -632,32 +803,26 @@ static void setup_64bit_code_segment(struct kvm_sregs *sregs)
     sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = seg;
 }
 
-static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs, int memorySize, int pageSize)
+static uint64_t *allocPageTable(struct vm *vm, uint64_t *next, uint64_t *addr)
 {
-    uint64_t page = 0;
-    uint64_t pml4_addr = 0x1000;
-    uint64_t *pml4 = (void *)(vm->mem + pml4_addr);
-
-    uint64_t pdpt_addr = 0x2000;
-    uint64_t *pdpt = (void *)(vm->mem + pdpt_addr);
-
-    uint64_t pd_addr = 0x3000;
-    uint64_t *pd = (void *)(vm->mem + pd_addr);
-
-    pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
-    pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
+    *addr = *next;
+    *next += SIZE_4KB;
+    memset(vm->mem + *addr, 0, SIZE_4KB);
+    return (void *)(vm->mem + *addr);
+}
 
-    if (pageSize == SIZE_4KB)
+// Identity maps [guestAddr, guestAddr + size) inside 1GB covered by page directory pd
+static void mapRange(struct vm *vm, uint64_t *pd, uint64_t *next, uint64_t guestAddr, uint64_t size, int pageSize)
+{
+    uint64_t page = guestAddr;
+    int first = (int)((guestAddr % SIZE_1GB) / SIZE_2MB);
+    int pdCount = (int)((size + SIZE_2MB - 1) / SIZE_2MB);
+    for (int i = first; i < first + pdCount; i++)
     {
-        uint64_t pt_addr = 0x4000;
-        uint64_t *pt = (void *)(vm->mem + pt_addr);
-
-        int pdCount = memorySize / SIZE_2MB;
-        // page = pt_addr + pdCount * SIZE_4KB;
-        for (int i = 0; i < pdCount; i++)
+        if (pageSize == SIZE_4KB)
         {
-            pt_addr = 0x4000 + i * SIZE_4KB;
-            pt = (void *)(vm->mem + pt_addr);
+            uint64_t pt_addr;
+            uint64_t *pt = allocPageTable(vm, next, &pt_addr);
             pd[i] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pt_addr;
             for (int j = 0; j < 512; j++)
             {
@@ -665,446 +830,3001 @@ static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs, int memorySi
                 page += SIZE_4KB;
             }
         }
-    }
-    else
-    {
-        for (int i = 0; i < memorySize / SIZE_2MB; i++)
+        else
         {
             pd[i] = page | PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;
             page += SIZE_2MB;
         }
     }
+}
+
+// Page tables are placed at tableBase (right after guest image), returns address after the last table
+static uint64_t setup_long_mode(struct vm *vm, struct kvm_sregs *sregs, int memorySize, int pageSize, uint64_t tableBase, LinkedList *sharedRegions,
+                                uint64_t *mapTables)
+{
+    uint64_t next = tableBase;
+    uint64_t pml4_addr, pdpt_addr, pd_addr;
+    uint64_t *pml4 = allocPageTable(vm, &next, &pml4_addr);
+    uint64_t *pdpt = allocPageTable(vm, &next, &pdpt_addr);
+    uint64_t *pd = allocPageTable(vm, &next, &pd_addr);
+
+    pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
+    pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
+    mapRange(vm, pd, &next, 0, memorySize, pageSize);
+
+    if (sharedRegions)
+    {
+        uint64_t shm_pd_addr;
+        uint64_t *shm_pd = allocPageTable(vm, &next, &shm_pd_addr);
+        pdpt[SHM_BASE / SIZE_1GB] = PDE64_PRESENT | PDE64_RW | PDE64_USER | shm_pd_addr;
+        for (LLNode *temp = sharedRegions; temp; temp = temp->next)
+        {
+            SharedRegion *region = (SharedRegion *)temp->data;
+            mapRange(vm, shm_pd, &next, region->guestAddr, region->size, pageSize);
+        }
+    }
+
+    // page directories of file mapping window are consecutive and stay empty until files get mapped
+    *mapTables = next;
+    for (uint64_t addr = FILE_MAP_BASE; addr < FILE_MAP_BASE + FILE_MAP_SIZE; addr += SIZE_1GB)
+    {
+        uint64_t map_pd_addr;
+        allocPageTable(vm, &next, &map_pd_addr);
+        pdpt[addr / SIZE_1GB] = PDE64_PRESENT | PDE64_RW | PDE64_USER | map_pd_addr;
+    }
+
     sregs->cr3 = pml4_addr;
     sregs->cr4 = CR4_PAE;              
     sregs->cr0 = CR0_PE | CR0_PG;      
     sregs->efer = EFER_LME | EFER_LMA; 
 
     setup_64bit_code_segment(sregs);
+    return next;
 }
 
-static void *
-runGuest(void *settings)
+static int map_shared_regions(struct vm *vm, LinkedList *sharedRegions)
 {
-    GuestSettings *guestSettings = (GuestSettings *)settings;
+    int slot = SHM_SLOT_BASE;
+    for (LLNode *temp = sharedRegions; temp; temp = temp->next)
+    {
+        SharedRegion *sharedRegion = (SharedRegion *)temp->data;
+        struct kvm_userspace_memory_region region;
+        region.slot = slot++;
+        region.flags = 0;
+        region.guest_phys_addr = sharedRegion->guestAddr;
+        region.memory_size = sharedRegion->size;
+        region.userspace_addr = (unsigned long)sharedRegion->mem;
+        if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+        {
+            // perror("KVM_SET_USER_MEMORY_REGION");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    struct vm vm;
-    struct kvm_sregs sregs;
-    struct kvm_regs regs;
-    int stop = 0;
-    int ret = 0;
-    FILE *img;
+// Checkpoint thread asks every running guest to write checkpoint once per interval, guest thread then writes it
+// itself between two KVM_RUN calls, so vCPU and devices are never in the middle of an exit
+static struct
+{
+    char *directory; // NULL - checkpoints are off
+    int interval;    // seconds
+    char *restoreDirectory; // NULL - guests start from their images
+    GuestSettings *guests;
+    int count;
+    pthread_t thread;
+    atomic_int stop;
+} checkpointer = {NULL, CHECKPOINT_DEFAULT_INTERVAL, NULL, NULL, 0, 0, 0};
+
+// Hypervisor started with --migration accepts connections at path and sends its running guests to hypervisor that
+// connects, hypervisor started with --incoming takes guests from one at path instead of starting them from images
+static struct
+{
+    char *path;         // NULL - guests can't be migrated away
+    char *incomingPath; // NULL - guests start here
+    int listenFd;
+    GuestSettings *guests;
+    int count;
+    pthread_t thread;
+    atomic_int stop;
+} migration = {NULL, NULL, -1, NULL, 0, 0, 0};
+
+// Guest memory is logged for checkpoints and migration from the moment guest is created
+static int dirtyLogFlags()
+{
+    return (checkpointer.directory || migration.path) ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+}
+
+static void addSnapshotRegion(GuestSettings *guestSettings, int slot, uint64_t guestAddr, uint64_t size, char *mem)
+{
+    if (guestSettings->snapshotRegionCount >= SNAPSHOT_MAX_REGIONS)
+        return;
+    SnapshotRegion *region = &guestSettings->snapshotRegions[guestSettings->snapshotRegionCount++];
+    region->slot = slot;
+    region->guestAddr = guestAddr;
+    region->size = size;
+    region->mem = mem;
+    region->written = NULL;
+}
 
-    if (init_vm(&vm, guestSettings->kvmFd, guestSettings->memorySize))
+// Maps host file into guest memory with 2MB pages, called by file device for FILE_MMAP and for attached files
+static int64_t mapGuestFileLocked(GuestSettings *guestSettings, int hostFd, int mode)
+{
+    struct vm *vm = &guestSettings->vm;
+    struct stat st;
+    if (fstat(hostFd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return -1;
+    // same file in same mode is mapped once, so guest gets address of attached file by mapping it again
+    int count = 0;
+    for (LLNode *temp = guestSettings->fileMappings; temp; temp = temp->next, count++)
     {
-        printf("{Guest %d} Error: failed to init the VM \n", guestSettings->id);
-        return (void *)-1;
+        FileMapping *mapping = (FileMapping *)temp->data;
+        if (mapping->dev == st.st_dev && mapping->ino == st.st_ino && mapping->mode == mode)
+            return (int64_t)mapping->guestAddr;
     }
+    uint64_t size = ((uint64_t)st.st_size + SIZE_2MB - 1) & ~((uint64_t)SIZE_2MB - 1);
+    if (count >= FILE_MAP_MAX || guestSettings->nextMapAddr + size > FILE_MAP_BASE + FILE_MAP_SIZE)
+        return -1;
+    if (mode == FILE_MAP_SHARED && ioctl(guestSettings->kvmFd, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0)
+        return -1;
 
-    if (ioctl(vm.vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+    // part of the last 2MB page after end of file is anonymous memory, so guest reads zeroes there
+    int prot = (mode == FILE_MAP_PRIVATE) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    char *mem = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem != MAP_FAILED &&
+        mmap(mem, st.st_size, prot, MAP_FIXED | ((mode == FILE_MAP_PRIVATE) ? MAP_PRIVATE : MAP_SHARED), hostFd, 0) == MAP_FAILED)
     {
-        printf("{Guest %d} Error: KVM_GET_SREGS\n", guestSettings->id);
-        return (void *)-1;
+        munmap(mem, size);
+        mem = MAP_FAILED;
+    }
+    char link[64], path[4096];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", hostFd);
+    ssize_t pathLength = readlink(link, path, sizeof(path) - 1);
+    path[pathLength > 0 ? pathLength : 0] = '\0';
+    // copy-on-write pages of private mapping are guest state, so they are tracked like guest memory
+    int flags = (mode == FILE_MAP_SHARED) ? KVM_MEM_READONLY : dirtyLogFlags();
+    FileMapping *mapping = (FileMapping *)malloc(sizeof(FileMapping));
+    LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+    char *mappingPath = strdup(path);
+    uint64_t guestAddr = guestSettings->nextMapAddr;
+    if (mem == MAP_FAILED || !mapping || !elem || !mappingPath ||
+        set_memory_slot(vm, guestSettings->nextMapSlot, guestAddr, size, mem, flags) < 0)
+    {
+        if (mem != MAP_FAILED)
+            munmap(mem, size);
+        free(mapping);
+        free(elem);
+        free(mappingPath);
+        return -1;
     }
+    if (mode == FILE_MAP_PRIVATE)
+        addSnapshotRegion(guestSettings, guestSettings->nextMapSlot, guestAddr, size, mem);
+    mapping->dev = st.st_dev;
+    mapping->ino = st.st_ino;
+    mapping->mode = mode;
+    mapping->mem = mem;
+    mapping->size = size;
+    mapping->guestAddr = guestAddr;
+    mapping->path = mappingPath;
+    elem->data = mapping;
+    elem->next = guestSettings->fileMappings;
+    guestSettings->fileMappings = elem;
+    guestSettings->nextMapSlot++;
+    guestSettings->nextMapAddr += size;
+
+    // entries were not present before, so guest has no stale translations to flush
+    uint64_t *pd = (uint64_t *)(vm->mem + guestSettings->mapTables);
+    for (uint64_t page = guestAddr; page < guestAddr + size; page += SIZE_2MB)
+        pd[(page - FILE_MAP_BASE) / SIZE_2MB] = page | PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;
+    return (int64_t)guestAddr;
+}
 
-    setup_long_mode(&vm, &sregs, guestSettings->memorySize, guestSettings->pageSize);
+// Migration reads list of mappings and slots they add from another thread while guest runs
+static int64_t mapGuestFile(void *context, int hostFd, int mode)
+{
+    GuestSettings *guestSettings = (GuestSettings *)context;
+    pthread_mutex_lock(&guestSettings->snapshotLock);
+    int64_t guestAddr = mapGuestFileLocked(guestSettings, hostFd, mode);
+    pthread_mutex_unlock(&guestSettings->snapshotLock);
+    return guestAddr;
+}
+
+static void limitGuestIo(void *context, uint32_t bytes)
+{
+    chargeIo((IoLimiter *)context, bytes);
+}
 
-    if (ioctl(vm.vcpu_fd, KVM_SET_SREGS, &sregs) < 0)
+static void deleteFileMappings(GuestSettings *guestSettings)
+{
+    while (guestSettings->fileMappings)
     {
-        printf("{Guest %d} Error: KVM_SET_SREGS\n", guestSettings->id);
-        return (void *)-1;
+        LLNode *temp = guestSettings->fileMappings;
+        guestSettings->fileMappings = temp->next;
+        FileMapping *mapping = (FileMapping *)temp->data;
+        munmap(mapping->mem, mapping->size);
+        free(mapping->path);
+        free(mapping);
+        free(temp);
     }
-    memset(&regs, 0, sizeof(regs));
-    regs.rflags = 2;
-    regs.rip = 0;
-    regs.rsp = guestSettings->memorySize;
+}
 
-    if (ioctl(vm.vcpu_fd, KVM_SET_REGS, &regs) < 0)
+// Argument of --attach is path, optionally followed by ":private"
+static int attachFile(GuestSettings *guestSettings, char *arg)
+{
+    char path[4096];
+    int mode = FILE_MAP_SHARED;
+    size_t length = strlen(arg);
+    size_t suffixLength = strlen(FILE_MAP_PRIVATE_SUFFIX);
+    if (length > suffixLength && strcmp(arg + length - suffixLength, FILE_MAP_PRIVATE_SUFFIX) == 0)
     {
-        printf("{Guest %d} Error: KVM_SET_REGS\n", guestSettings->id);
-        return (void *)-1;
+        mode = FILE_MAP_PRIVATE;
+        length -= suffixLength;
     }
+    snprintf(path, sizeof(path), "%.*s", (int)length, arg);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int64_t guestAddr = mapGuestFile(guestSettings, fd, mode);
+    close(fd);
+    if (guestAddr < 0)
+        return -1;
+    printf("{Guest %d} Attached '%s' at 0x%llx\n", guestSettings->id, path, (unsigned long long)guestAddr);
+    return 0;
+}
 
-    img = fopen(guestSettings->guestFile, "r");
-    if (img == NULL)
+static SharedRegion *findSharedRegion(LinkedList *sharedRegions, char *name)
+{
+    for (LLNode *temp = sharedRegions; temp; temp = temp->next)
     {
-        printf("{Guest %d} Error: cannot open binary file\n", guestSettings->id);
-        return (void *)-1;
+        SharedRegion *region = (SharedRegion *)temp->data;
+        if (strcmp(region->name, name) == 0)
+            return region;
+    }
+    return NULL;
+}
+
+// Returns supported leaves with room for 2 more, buffer grows until KVM stops answering E2BIG
+static struct kvm_cpuid2 *getSupportedCpuid(int kvm_fd)
+{
+    for (int entries = CPUID_MAX_ENTRIES;; entries *= 2)
+    {
+        if (entries > KVM_MAX_CPUID_ENTRIES)
+            entries = KVM_MAX_CPUID_ENTRIES;
+        struct kvm_cpuid2 *cpuid = (struct kvm_cpuid2 *)calloc(1, sizeof(struct kvm_cpuid2) + (entries + 2) * sizeof(struct kvm_cpuid_entry2));
+        if (!cpuid)
+            return NULL;
+        cpuid->nent = entries;
+        if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0)
+            return cpuid;
+        free(cpuid);
+        if (errno != E2BIG || entries == KVM_MAX_CPUID_ENTRIES)
+            return NULL;
     }
+}
+
+static int setup_cpuid(struct vm *vm, int kvm_fd)
+{
+    struct kvm_cpuid2 *cpuid = getSupportedCpuid(kvm_fd);
+    if (!cpuid)
+        return -1;
 
-    char *p = vm.mem;
-    while (feof(img) == 0)
+    // invariant TSC bit (0x80000007 EDX) is passed through, frequency goes to the timing leaf
+    int tscKhz = ioctl(vm->vcpu_fd, KVM_GET_TSC_KHZ, 0);
+    if (tscKhz < 0)
+        tscKhz = 0;
+
+    struct kvm_cpuid_entry2 *hypervisorLeaf = NULL;
+    for (unsigned int i = 0; i < cpuid->nent; i++)
+    {
+        if (cpuid->entries[i].function == CPUID_HYPERVISOR_LEAF)
+            hypervisorLeaf = &cpuid->entries[i];
+    }
+    if (!hypervisorLeaf)
     {
-        int r = fread(p, 1, 1024, img);
-        p += r;
+        hypervisorLeaf = &cpuid->entries[cpuid->nent++];
+        memset(hypervisorLeaf, 0, sizeof(struct kvm_cpuid_entry2));
+        hypervisorLeaf->function = CPUID_HYPERVISOR_LEAF;
     }
-    fclose(img);
+    hypervisorLeaf->eax = CPUID_TIMING_LEAF;
+
+    struct kvm_cpuid_entry2 *timingLeaf = &cpuid->entries[cpuid->nent++];
+    memset(timingLeaf, 0, sizeof(struct kvm_cpuid_entry2));
+    timingLeaf->function = CPUID_TIMING_LEAF;
+    timingLeaf->eax = (uint32_t)tscKhz;
 
-    LinkedList *sharedFileSystem = NULL;
-    LinkedList *localFileSystem = NULL;
-    for (LLNode *temp = guestSettings->sharedFiles; temp; temp = temp->next)
+    int ret = ioctl(vm->vcpu_fd, KVM_SET_CPUID2, cpuid);
+    free(cpuid);
+    if (ret < 0)
     {
-        MyFile *file = (MyFile *)malloc(sizeof(MyFile));
-        if (!file)
+        // perror("KVM_SET_CPUID2");
+        return -1;
+    }
+    return tscKhz;
+}
+
+typedef struct
+{
+    atomic_size_t sequence;
+    uint16_t length;
+    char data[MSG_MAX_SIZE];
+} MsgCell;
+
+// Bounded lock-free MPMC queue (sequence number per cell), blocking is done only on the slow path
+typedef struct
+{
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) atomic_size_t dequeuePos;
+    _Alignas(64) atomic_int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // guarded by lock
+    int sendWaiters;
+    int recvWaiters;
+    uint64_t failRound; // changes when waits fail because no running guest can end them
+    char name[MSG_NAME_LENGTH + 1];
+    MsgCell cells[MSG_QUEUE_CAPACITY];
+} MsgChannel;
+
+static MsgChannel *msgChannels[MSG_MAX_CHANNELS];
+static atomic_int msgChannelCount = 0;
+static pthread_mutex_t msgChannelsLock = PTHREAD_MUTEX_INITIALIZER;
+// Guest that hasn't opened channel yet can still open it, so waits can end as long as some guest runs
+static atomic_int msgLiveGuests = 0;   // guests that didn't stop yet
+static atomic_int msgBlockedGuests = 0; // guests sleeping in blocking send or receive
+
+static int openChannel(char *name)
+{
+    pthread_mutex_lock(&msgChannelsLock);
+    int count = atomic_load(&msgChannelCount);
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(msgChannels[i]->name, name) == 0)
         {
-            printf("{Guest %d} Error: malloc failed\n", guestSettings->id);
-            deleteList(sharedFileSystem, 1);
-            return (void *)-1;
+            pthread_mutex_unlock(&msgChannelsLock);
+            return i;
         }
-        file->hostFd = -1;
-        file->guestFd = -1;
-        file->name = (char *)temp->data;
-        file->canRead = 1;
-        file->canWrite = 0;
-        if (pushFile(&sharedFileSystem, file) != 0)
+    }
+    MsgChannel *channel = NULL;
+    if (count == MSG_MAX_CHANNELS || posix_memalign((void **)&channel, 64, sizeof(MsgChannel)) != 0)
+    {
+        pthread_mutex_unlock(&msgChannelsLock);
+        return -1;
+    }
+    memset(channel, 0, sizeof(MsgChannel));
+    strcpy(channel->name, name);
+    for (size_t i = 0; i < MSG_QUEUE_CAPACITY; i++)
+        atomic_init(&channel->cells[i].sequence, i);
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->changed, NULL);
+    msgChannels[count] = channel;
+    atomic_store(&msgChannelCount, count + 1);
+    pthread_mutex_unlock(&msgChannelsLock);
+    return count;
+}
+
+static MsgChannel *getChannel(uint32_t id)
+{
+    if (id >= (uint32_t)atomic_load(&msgChannelCount))
+        return NULL;
+    return msgChannels[id];
+}
+
+static int tryEnqueue(MsgChannel *channel, char *data, uint16_t length)
+{
+    size_t pos = atomic_load_explicit(&channel->enqueuePos, memory_order_relaxed);
+    MsgCell *cell;
+    while (1)
+    {
+        cell = &channel->cells[pos & (MSG_QUEUE_CAPACITY - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
         {
-            printf("{Guest %d} Error: malloc failed\n", guestSettings->id);
-            deleteList(sharedFileSystem, 1);
-            return (void *)-1;
+            if (atomic_compare_exchange_weak_explicit(&channel->enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return 0; // full
+        else
+            pos = atomic_load_explicit(&channel->enqueuePos, memory_order_relaxed);
+    }
+    memcpy(cell->data, data, length);
+    cell->length = length;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+static int tryDequeue(MsgChannel *channel, char *data, uint16_t maxLength, uint16_t *length)
+{
+    size_t pos = atomic_load_explicit(&channel->dequeuePos, memory_order_relaxed);
+    MsgCell *cell;
+    while (1)
+    {
+        cell = &channel->cells[pos & (MSG_QUEUE_CAPACITY - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->dequeuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
         }
+        else if (diff < 0)
+            return 0; // empty
+        else
+            pos = atomic_load_explicit(&channel->dequeuePos, memory_order_relaxed);
+    }
+    *length = (cell->length < maxLength) ? cell->length : maxLength;
+    memcpy(data, cell->data, *length);
+    atomic_store_explicit(&cell->sequence, pos + MSG_QUEUE_CAPACITY, memory_order_release);
+    return 1;
+}
+
+static void wakeChannelWaiters(MsgChannel *channel)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&channel->waiters) > 0)
+    {
+        pthread_mutex_lock(&channel->lock);
+        pthread_cond_broadcast(&channel->changed);
+        pthread_mutex_unlock(&channel->lock);
     }
+}
 
-    int fileState1 = 0;
-    int fileState2 = 0;
-    int remainingBytes = 0;
-    int fd = 0;
-    char chr;
-    char *filename = NULL;
+// Waiter can still make progress when receivers wait on nonempty queue or senders on queue that isn't full.
+// Caller holds channel lock
+static int channelWaitersStuck(MsgChannel *channel)
+{
+    size_t used = atomic_load(&channel->enqueuePos) - atomic_load(&channel->dequeuePos);
+    return !((channel->recvWaiters > 0 && used > 0) || (channel->sendWaiters > 0 && used < MSG_QUEUE_CAPACITY));
+}
 
-    while (stop == 0)
+// Once every guest still running waits on a channel and none of them can make progress, only they could end
+// each other's waits, so all of them fail. Nobody changes queues in that state, so channels are checked one by one
+static void failStuckChannels()
+{
+    if (atomic_load(&msgBlockedGuests) < atomic_load(&msgLiveGuests))
+        return;
+    int count = atomic_load(&msgChannelCount);
+    for (int i = 0; i < count; i++)
     {
-        ret = ioctl(vm.vcpu_fd, KVM_RUN, 0);
-        if (ret == -1)
+        pthread_mutex_lock(&msgChannels[i]->lock);
+        int stuck = channelWaitersStuck(msgChannels[i]);
+        pthread_mutex_unlock(&msgChannels[i]->lock);
+        if (!stuck)
+            return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&msgChannels[i]->lock);
+        if (msgChannels[i]->sendWaiters + msgChannels[i]->recvWaiters > 0)
         {
-            printf("{Guest %d} Error: KVM_RUN failed\n", guestSettings->id);
-            return (void *)1;
+            msgChannels[i]->failRound++;
+            pthread_cond_broadcast(&msgChannels[i]->changed);
         }
+        pthread_mutex_unlock(&msgChannels[i]->lock);
+    }
+}
 
-        switch (vm.kvm_run->exit_reason)
+// Called once for every guest that stopped or never ran
+static void leaveChannels()
+{
+    atomic_fetch_sub(&msgLiveGuests, 1);
+    failStuckChannels();
+}
+
+// Per-guest state of message port protocol
+typedef struct MsgDevice
+{
+    int state;
+    uint8_t op;
+    uint8_t flags;
+    int remaining;
+    uint32_t channel;
+    uint16_t length;
+    int received;
+    char name[MSG_NAME_LENGTH + 1];
+    char data[MSG_MAX_SIZE];
+    uint8_t reply[MSG_MAX_SIZE + 3];
+    int replyLength;
+    int replyPos;
+    int guestId;
+    volatile uint8_t *kickPending; // nonzero while host wants guest thread out of its wait
+    _Atomic(MsgChannel *) waitingOn;
+} MsgDevice;
+
+static void interruptMsgDevice(MsgDevice *dev)
+{
+    if (!dev)
+        return;
+    // kickPending is set before, waiter checks it under channel lock after publishing waitingOn
+    atomic_thread_fence(memory_order_seq_cst);
+    MsgChannel *channel = atomic_load(&dev->waitingOn);
+    if (channel)
+    {
+        pthread_mutex_lock(&channel->lock);
+        pthread_cond_broadcast(&channel->changed);
+        pthread_mutex_unlock(&channel->lock);
+    }
+}
+
+// Sleeps until queue of channel changes. Returns MSG_OK to try again, MSG_ERROR when no running guest can end
+// the wait or MSG_INTERRUPTED when host kicked guest thread. Caller holds channel lock
+static uint8_t waitOnChannel(MsgDevice *dev, MsgChannel *channel, uint64_t round)
+{
+    if (channel->failRound != round)
+        return MSG_ERROR;
+    if (*dev->kickPending)
+        return MSG_INTERRUPTED;
+    pthread_cond_wait(&channel->changed, &channel->lock);
+    return MSG_OK;
+}
+
+static uint8_t sendMessage(MsgDevice *dev, MsgChannel *channel, char *data, uint16_t length, int block)
+{
+    uint8_t result = MSG_OK;
+    if (!tryEnqueue(channel, data, length))
+    {
+        if (!block)
+            return MSG_WOULD_BLOCK;
+        pthread_mutex_lock(&channel->lock);
+        atomic_fetch_add(&channel->waiters, 1);
+        atomic_store(&dev->waitingOn, channel);
+        channel->sendWaiters++;
+        uint64_t round = channel->failRound;
+        pthread_mutex_unlock(&channel->lock);
+        atomic_fetch_add(&msgBlockedGuests, 1);
+        failStuckChannels();
+        pthread_mutex_lock(&channel->lock);
+        while (!tryEnqueue(channel, data, length) && (result = waitOnChannel(dev, channel, round)) == MSG_OK)
+            ;
+        channel->sendWaiters--;
+        atomic_fetch_sub(&msgBlockedGuests, 1);
+        atomic_store(&dev->waitingOn, NULL);
+        atomic_fetch_sub(&channel->waiters, 1);
+        pthread_mutex_unlock(&channel->lock);
+    }
+    if (result == MSG_OK)
+        wakeChannelWaiters(channel);
+    return result;
+}
+
+static uint8_t receiveMessage(MsgDevice *dev, MsgChannel *channel, char *data, uint16_t maxLength, uint16_t *length, int block)
+{
+    uint8_t result = MSG_OK;
+    if (!tryDequeue(channel, data, maxLength, length))
+    {
+        if (!block)
+            return MSG_WOULD_BLOCK;
+        pthread_mutex_lock(&channel->lock);
+        atomic_fetch_add(&channel->waiters, 1);
+        atomic_store(&dev->waitingOn, channel);
+        channel->recvWaiters++;
+        uint64_t round = channel->failRound;
+        pthread_mutex_unlock(&channel->lock);
+        atomic_fetch_add(&msgBlockedGuests, 1);
+        failStuckChannels();
+        pthread_mutex_lock(&channel->lock);
+        while (!tryDequeue(channel, data, maxLength, length) && (result = waitOnChannel(dev, channel, round)) == MSG_OK)
+            ;
+        channel->recvWaiters--;
+        atomic_fetch_sub(&msgBlockedGuests, 1);
+        atomic_store(&dev->waitingOn, NULL);
+        atomic_fetch_sub(&channel->waiters, 1);
+        pthread_mutex_unlock(&channel->lock);
+    }
+    if (result == MSG_OK)
+        wakeChannelWaiters(channel);
+    else
+        *length = 0;
+    return result;
+}
+
+static void setReply32(MsgDevice *dev, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        dev->reply[i] = (uint8_t)((value >> (24 - 8 * i)) & 0xFF);
+    dev->replyLength = 4;
+    dev->replyPos = 0;
+}
+
+static void finishMsgRequest(MsgDevice *dev)
+{
+    MsgChannel *channel = getChannel(dev->channel);
+    int block = (dev->flags & MSG_NONBLOCK) == 0;
+    dev->replyPos = 0;
+    dev->replyLength = 1;
+    if (!channel)
+    {
+        dev->reply[0] = MSG_ERROR;
+    }
+    else if (dev->op == MSG_SEND)
+    {
+        dev->reply[0] = sendMessage(dev, channel, dev->data, dev->length, block);
+    }
+    else
+    {
+        uint16_t length = 0;
+        dev->reply[0] = receiveMessage(dev, channel, (char *)dev->reply + 3, dev->length, &length, block);
+        dev->reply[1] = (uint8_t)(length >> 8);
+        dev->reply[2] = (uint8_t)(length & 0xFF);
+        dev->replyLength = 3 + length;
+    }
+    dev->state = MSTATE_NONE;
+}
+
+static void msgDeviceOut(MsgDevice *dev, uint8_t c, int guestId)
+{
+    switch (dev->state)
+    {
+    case MSTATE_NONE:
+        dev->op = c;
+        dev->replyLength = 0;
+        if (c == MSG_OPEN)
         {
-        case KVM_EXIT_IO:
-            if (vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == PORT_IO)
-            {
-                char *p = (char *)vm.kvm_run;
-                printf("%c", *(p + vm.kvm_run->io.data_offset));
-            }
-            else if (vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == PORT_IO)
-            {
-                char c;
-                scanf("%c", &c);
-                char *data_in = (((char *)vm.kvm_run) + vm.kvm_run->io.data_offset);
-                *data_in = c;
-            }
-            else if (vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == PORT_FILE)
-            {
-                char *p = (char *)vm.kvm_run;
-                char c = *(p + vm.kvm_run->io.data_offset);
-                switch (fileState1)
-                {
-                case FSTATE1_OPEN_R:
-                case FSTATE1_OPEN_W:
-                    if (fileState2 == FSTATE2_FILENAME)
-                    {
-                        if (c == '\0')
-                        {
-                            if (!filename)
-                            {
-                                printf("{Guest %d} File system error - empty filename\n", guestSettings->id);
-                                fileState1 = FSTATE1_NONE;
-                                fileState2 = FSTATE2_NONE;
-                            }
-                            else
-                            {
-                                fileState2 = FSTATE2_FD;
-                                remainingBytes = 4;
-                                fd = openFile(&sharedFileSystem, &localFileSystem, filename, (fileState1 == FSTATE1_OPEN_R) ? 1 : 0, guestSettings);
-                            }
-                        }
-                        else
-                        {
-                            char *newFilename = extendFilename(filename, c);
-                            if (!newFilename)
-                            {
-                                free(filename);
-                                printf("{Guest %d} File system error - failed to extend filename\n", guestSettings->id);
-                                fileState1 = FSTATE1_NONE;
-                                fileState2 = FSTATE2_NONE;
-                            }
-                            else
-                            {
-                                free(filename);
-                                filename = newFilename;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        printf("{Guest %d} File system error - undefined state1 + state2 combination\n", guestSettings->id);
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    break;
-                case FSTATE1_CLOSE:
-                    if (fileState2 == FSTATE2_FD)
-                    {
-                        remainingBytes -= 1;
-                        fd |= ((unsigned int)c & 0xFF) << (remainingBytes * 8);
-                        if (remainingBytes == 0)
-                        {
-                            fileState2 = FSTATE2_CHAR;
-                            chr = closeFile(&localFileSystem, fd);
-                        }
-                    }
-                    else
-                    {
-                        printf("{Guest %d} File system error - undefined state1 + state2 combination\n", guestSettings->id);
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    break;
-                case FSTATE1_READ:
-                    if (fileState2 == FSTATE2_FD)
-                    {
-                        remainingBytes -= 1;
-                        fd |= ((unsigned int)c & 0xFF) << (remainingBytes * 8);
-                        if (remainingBytes == 0)
-                        {
-                            fileState2 = FSTATE2_CHAR;
-                            chr = readFile(localFileSystem, fd);
-                        }
-                    }
-                    else
-                    {
-                        printf("{Guest %d} File system error - undefined state1 + state2 combination\n", guestSettings->id);
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    break;
-                case FSTATE1_WRITE:
-                    if (fileState2 == FSTATE2_FD)
-                    {
-                        remainingBytes -= 1;
-                        fd |= ((unsigned int)c & 0xFF) << (remainingBytes * 8);
-                        if (remainingBytes == 0)
-                        {
-                            fileState2 = FSTATE2_CHAR;
-                        }
-                    }
-                    else if (fileState2 == FSTATE2_CHAR)
-                    {
-                        chr = c;
-                        fileState1 = FSTATE1_READ;
-                        chr = writeFile(localFileSystem, fd, chr, guestSettings->id);
-                    }
-                    break;
-                case FSTATE1_NONE:
-                    switch (c)
-                    {
-                    case FILE_OPEN_R:
-                        fileState1 = FSTATE1_OPEN_R;
-                        fileState2 = FSTATE2_FILENAME;
-                        filename = NULL;
-                        break;
-                    case FILE_OPEN_W:
-                        fileState1 = FSTATE1_OPEN_W;
-                        fileState2 = FSTATE2_FILENAME;
-                        filename = NULL;
-                        break;
-                    case FILE_CLOSE:
-                        fileState1 = FSTATE1_CLOSE;
-                        fileState2 = FSTATE2_FD;
-                        fd = 0;
-                        remainingBytes = 4;
-                        break;
-                    case FILE_READ:
-                        fileState1 = FSTATE1_READ;
-                        fileState2 = FSTATE2_FD;
-                        fd = 0;
-                        remainingBytes = 4;
-                        break;
-                    case FILE_WRITE:
-                        fileState1 = FSTATE1_WRITE;
-                        fileState2 = FSTATE2_FD;
-                        fd = 0;
-                        remainingBytes = 4;
-                        break;
-                    default:
-                        printf("{Guest %d} File system error - undefined syscall code\n", guestSettings->id);
-                    }
-                    break;
-                default:
-                    printf("{Guest %d} File system error - undefined state1 + state2 combination\n", guestSettings->id);
-                    fileState1 = FSTATE1_NONE;
-                    fileState2 = FSTATE2_NONE;
-                }
+            dev->state = MSTATE_NAME;
+            dev->received = 0;
+        }
+        else if (c == MSG_SEND || c == MSG_RECV)
+            dev->state = MSTATE_FLAGS;
+        else
+            printf("{Guest %d} Message device error - undefined operation code\n", guestId);
+        break;
+    case MSTATE_NAME:
+        if (c == '\0')
+        {
+            dev->name[dev->received <= MSG_NAME_LENGTH ? dev->received : MSG_NAME_LENGTH] = '\0';
+            int id = (dev->received > 0 && dev->received <= MSG_NAME_LENGTH) ? openChannel(dev->name) : -1;
+            setReply32(dev, (uint32_t)id);
+            dev->state = MSTATE_NONE;
+        }
+        else
+        {
+            if (dev->received < MSG_NAME_LENGTH)
+                dev->name[dev->received] = (char)c;
+            if (dev->received <= MSG_NAME_LENGTH)
+                dev->received++;
+        }
+        break;
+    case MSTATE_FLAGS:
+        dev->flags = c;
+        dev->channel = 0;
+        dev->remaining = 4;
+        dev->state = MSTATE_CHANNEL;
+        break;
+    case MSTATE_CHANNEL:
+        dev->remaining--;
+        dev->channel |= ((uint32_t)c) << (dev->remaining * 8);
+        if (dev->remaining == 0)
+        {
+            dev->length = 0;
+            dev->remaining = 2;
+            dev->state = MSTATE_LENGTH;
+        }
+        break;
+    case MSTATE_LENGTH:
+        dev->remaining--;
+        dev->length |= ((uint16_t)c) << (dev->remaining * 8);
+        if (dev->remaining == 0)
+        {
+            if (dev->length > MSG_MAX_SIZE)
+                dev->length = MSG_MAX_SIZE;
+            dev->received = 0;
+            if (dev->op == MSG_SEND && dev->length > 0)
+                dev->state = MSTATE_DATA;
+            else
+                finishMsgRequest(dev);
+        }
+        break;
+    case MSTATE_DATA:
+        dev->data[dev->received++] = (char)c;
+        if (dev->received == dev->length)
+            finishMsgRequest(dev);
+        break;
+    }
+}
+
+static uint8_t msgDeviceIn(MsgDevice *dev)
+{
+    if (dev->replyPos < dev->replyLength)
+        return dev->reply[dev->replyPos++];
+    return 0;
+}
+
+// Console device: guest output, input and input requests on PORT_IO and PORT_IO_REQUEST
+static int consoleOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    GuestSettings *guestSettings = (GuestSettings *)state;
+    if (port == PORT_IO_REQUEST)
+        requestInput(guestSettings);
+    else if (guestSettings->output)
+        for (uint32_t i = 0; i < size * count; i++)
+            fputc(data[i], guestSettings->output);
+    return DEVICE_CONTINUE;
+}
+
+static int consoleIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    GuestSettings *guestSettings = (GuestSettings *)state;
+    if (port == PORT_IO)
+        for (uint32_t i = 0; i < size * count; i++)
+            data[i] = (uint8_t)takeInput(guestSettings);
+    return DEVICE_CONTINUE;
+}
+
+static int shutdownOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    GuestSettings *guestSettings = (GuestSettings *)state;
+    printf("{Guest %d} Shutdown, status %d\n", guestSettings->id, (int)data[0]);
+    return DEVICE_STOP;
+}
+
+// Shared memory device: guest writes region name terminated with '\0', then reads its address and size
+typedef struct
+{
+    LinkedList *sharedRegions;
+    char name[SHM_NAME_LENGTH + 1];
+    int nameLength;
+    uint8_t reply[16];
+    int replyBytes;
+} ShmDevice;
+
+static int shmOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    ShmDevice *dev = (ShmDevice *)state;
+    for (uint32_t i = 0; i < size * count; i++)
+    {
+        char c = (char)data[i];
+        if (c == '\0')
+        {
+            dev->name[dev->nameLength <= SHM_NAME_LENGTH ? dev->nameLength : SHM_NAME_LENGTH] = '\0';
+            SharedRegion *region = (dev->nameLength <= SHM_NAME_LENGTH) ? findSharedRegion(dev->sharedRegions, dev->name) : NULL;
+            uint64_t addr = region ? region->guestAddr : 0;
+            uint64_t regionSize = region ? region->size : 0;
+            for (int j = 0; j < 8; j++)
+            {
+                dev->reply[j] = (uint8_t)((addr >> (56 - 8 * j)) & 0xFF);
+                dev->reply[8 + j] = (uint8_t)((regionSize >> (56 - 8 * j)) & 0xFF);
+            }
+            dev->replyBytes = 16;
+            dev->nameLength = 0;
+        }
+        else
+        {
+            if (dev->nameLength < SHM_NAME_LENGTH)
+                dev->name[dev->nameLength] = c;
+            if (dev->nameLength <= SHM_NAME_LENGTH)
+                dev->nameLength++;
+        }
+    }
+    return DEVICE_CONTINUE;
+}
+
+static int shmIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    ShmDevice *dev = (ShmDevice *)state;
+    for (uint32_t i = 0; i < size * count; i++)
+        data[i] = (dev->replyBytes > 0) ? dev->reply[16 - dev->replyBytes--] : 0;
+    return DEVICE_CONTINUE;
+}
+
+static int msgOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    MsgDevice *dev = (MsgDevice *)state;
+    for (uint32_t i = 0; i < size * count; i++)
+        msgDeviceOut(dev, data[i], dev->guestId);
+    return DEVICE_CONTINUE;
+}
+
+static int msgIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    MsgDevice *dev = (MsgDevice *)state;
+    for (uint32_t i = 0; i < size * count; i++)
+        data[i] = msgDeviceIn(dev);
+    return DEVICE_CONTINUE;
+}
+
+static int fileOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    fileDeviceOut((FileDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static int fileIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    fileDeviceIn((FileDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static void destroyFileDevice(void *state)
+{
+    deleteFileDevice((FileDevice *)state);
+}
+
+static int balloonOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    balloonDeviceOut((BalloonDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static int balloonIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    balloonDeviceIn((BalloonDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static void destroyBalloonDevice(void *state)
+{
+    deleteBalloonDevice((BalloonDevice *)state);
+}
+
+static int syncOut(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    syncDeviceOut((SyncDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static int syncIn(void *state, uint16_t port, uint8_t *data, uint32_t size, uint32_t count)
+{
+    syncDeviceIn((SyncDevice *)state, data, size * count);
+    return DEVICE_CONTINUE;
+}
+
+static void destroySyncDevice(void *state)
+{
+    deleteSyncDevice((SyncDevice *)state);
+}
+
+// Guest memory in shared mapping stays in shared memory object after MADV_DONTNEED, so it is removed from the object
+static BalloonDevice *createGuestBalloon(GuestSettings *guestSettings)
+{
+    struct vm *vm = &guestSettings->vm;
+    BalloonDevice *device = createBalloonDevice(guestSettings->id, vm->mem, guestSettings->memorySize, vm->page_size,
+                                                (guestSettings->memoryPolicy == MEMORY_SHARED) ? MADV_REMOVE : MADV_DONTNEED);
+    // shared image text and mapped files are not guest's own memory
+    for (int i = 0; device && i < guestSettings->snapshotRegionCount; i++)
+    {
+        SnapshotRegion *region = &guestSettings->snapshotRegions[i];
+        if (region->slot == LOW_MEMORY_SLOT || region->slot == HIGH_MEMORY_SLOT)
+            addBalloonRange(device, region->guestAddr, region->size);
+    }
+    return device;
+}
+
+// Registers standard devices of guest, new devices are added here
+static DeviceBus *createGuestDevices(GuestSettings *guestSettings, FileDeviceConfig *fileConfig)
+{
+    DeviceBus *bus = createDeviceBus(guestSettings->id);
+    if (!bus)
+        return NULL;
+    int failed = 0;
+
+    int console = addDevice(bus, "console", guestSettings, &consoleOut, &consoleIn, NULL, NULL);
+    failed |= registerPorts(bus, console, PORT_IO, 2); // PORT_IO and PORT_IO_REQUEST
+    int shutdown = addDevice(bus, "shutdown", guestSettings, &shutdownOut, NULL, NULL, NULL);
+    failed |= registerPorts(bus, shutdown, PORT_SHUTDOWN, 1);
+
+    ShmDevice *shmDevice = (ShmDevice *)calloc(1, sizeof(ShmDevice));
+    if (shmDevice)
+    {
+        shmDevice->sharedRegions = guestSettings->sharedRegions;
+        failed |= registerPorts(bus, addDevice(bus, "shm", shmDevice, &shmOut, &shmIn, NULL, &free), PORT_SHM, 1);
+    }
+    MsgDevice *msgDevice = (MsgDevice *)calloc(1, sizeof(MsgDevice));
+    if (msgDevice)
+    {
+        msgDevice->guestId = guestSettings->id;
+        // guest restored or migrated in the middle of blocking call reads reply of new device, so it repeats the call
+        msgDevice->reply[0] = MSG_INTERRUPTED;
+        msgDevice->replyLength = 3;
+        msgDevice->kickPending = &guestSettings->vm.kvm_run->immediate_exit;
+        guestSettings->msgDevice = msgDevice;
+        failed |= registerPorts(bus, addDevice(bus, "msg", msgDevice, &msgOut, &msgIn, NULL, &free), PORT_MSG, 1);
+    }
+    FileDevice *fileDevice = createFileDevice(fileConfig);
+    guestSettings->fileDevice = fileDevice;
+    if (fileDevice)
+        failed |= registerPorts(bus, addDevice(bus, "file", fileDevice, &fileOut, &fileIn, NULL, &destroyFileDevice), PORT_FILE, 1);
+    BalloonDevice *balloonDevice = createGuestBalloon(guestSettings);
+    if (balloonDevice)
+        failed |= registerPorts(bus, addDevice(bus, "balloon", balloonDevice, &balloonOut, &balloonIn, NULL, &destroyBalloonDevice), PORT_BALLOON, 1);
+    SyncDevice *syncDevice = createSyncDevice(guestSettings->id, guestSettings->syncGroup, &guestSettings->vm.kvm_run->immediate_exit);
+    guestSettings->syncDevice = syncDevice;
+    if (syncDevice)
+        failed |= registerPorts(bus, addDevice(bus, "sync", syncDevice, &syncOut, &syncIn, NULL, &destroySyncDevice), PORT_SYNC, 1);
+
+    if (failed || !shmDevice || !msgDevice || !fileDevice || !balloonDevice || !syncDevice)
+    {
+        printf("{Guest %d} Error: failed to create devices\n", guestSettings->id);
+        deleteDeviceBus(bus);
+        guestSettings->msgDevice = NULL;
+        guestSettings->syncDevice = NULL;
+        return NULL;
+    }
+    return bus;
+}
+
+// Placement of guest threads on host cpus and of guest memory on NUMA nodes
+typedef struct
+{
+    int cpuCount;
+    int cpus[CPU_SETSIZE];   // cpus hypervisor is allowed to run on, in ascending order
+    int nodeOf[CPU_SETSIZE]; // NUMA node of every cpu, 0 when topology is unknown
+    int nodeCount;
+} CpuTopology;
+
+// Parses cpu list in sysfs format, i.e. "0,2,4-7"
+static int parseCpuList(char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    char *p = s;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p)
+            return -1;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1)
+                return -1;
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void loadTopology(CpuTopology *topology)
+{
+    cpu_set_t allowed;
+    memset(topology, 0, sizeof(CpuTopology));
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        CPU_ZERO(&allowed);
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            topology->cpus[topology->cpuCount++] = cpu;
+
+    topology->nodeCount = 1;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        int node;
+        char path[300], list[4096];
+        if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0)
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+        cpu_set_t nodeCpus;
+        if (fgets(list, sizeof(list), file) && parseCpuList(list, &nodeCpus) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &nodeCpus))
+                    topology->nodeOf[cpu] = node;
+            if (node + 1 > topology->nodeCount)
+                topology->nodeCount = node + 1;
+        }
+        fclose(file);
+    }
+    closedir(dir);
+}
+
+static int parsePlacement(char *s, int *placement, cpu_set_t *list, char *isolate)
+{
+    char value[256];
+    snprintf(value, sizeof(value), "%s", s);
+    char *colon = strchr(value, ':');
+    *isolate = 0;
+    if (colon)
+    {
+        if (strcmp(colon + 1, "isolate") != 0)
+            return -1;
+        *colon = '\0';
+        *isolate = 1;
+    }
+    if (strcmp(value, "none") == 0)
+        *placement = PLACEMENT_NONE;
+    else if (strcmp(value, "compact") == 0)
+        *placement = PLACEMENT_COMPACT;
+    else if (strcmp(value, "spread") == 0)
+        *placement = PLACEMENT_SPREAD;
+    else if (parseCpuList(value, list) == 0)
+        *placement = PLACEMENT_LIST;
+    else
+        return -1;
+    return (*isolate && *placement == PLACEMENT_NONE) ? -1 : 0;
+}
+
+// Pins guests not pinned by manifest according to placement, and sets node of every pinned guest
+static void placeGuests(GuestSettings *settingsArr, int count, int placement, cpu_set_t *list, CpuTopology *topology)
+{
+    int order[CPU_SETSIZE];
+    int orderCount = 0;
+    if (placement == PLACEMENT_LIST)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, list))
+                order[orderCount++] = cpu;
+    }
+    else if (placement == PLACEMENT_COMPACT)
+    {
+        for (int i = 0; i < topology->cpuCount; i++)
+            order[orderCount++] = topology->cpus[i];
+    }
+    else if (placement == PLACEMENT_SPREAD)
+    {
+        // cpus are taken from nodes in turns, so consecutive guests land on different nodes
+        int taken[CPU_SETSIZE] = {0};
+        while (orderCount < topology->cpuCount)
+        {
+            for (int node = 0; node < topology->nodeCount; node++)
+            {
+                for (int i = 0; i < topology->cpuCount; i++)
+                {
+                    if (topology->nodeOf[topology->cpus[i]] == node && !taken[i])
+                    {
+                        taken[i] = 1;
+                        order[orderCount++] = topology->cpus[i];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    int next = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (settingsArr[i].cpu < 0 && orderCount > 0)
+            settingsArr[i].cpu = order[next++ % orderCount];
+        settingsArr[i].node = (settingsArr[i].cpu >= 0) ? topology->nodeOf[settingsArr[i].cpu] : -1;
+    }
+}
+
+// Housekeeping threads (input, syncer, workers) inherit affinity of main thread, so they are kept off guest cpus
+static void isolateHousekeeping(GuestSettings *settingsArr, int count, CpuTopology *topology)
+{
+    cpu_set_t housekeeping;
+    CPU_ZERO(&housekeeping);
+    for (int i = 0; i < topology->cpuCount; i++)
+        CPU_SET(topology->cpus[i], &housekeeping);
+    for (int i = 0; i < count; i++)
+        if (settingsArr[i].cpu >= 0)
+            CPU_CLR(settingsArr[i].cpu, &housekeeping);
+    if (CPU_COUNT(&housekeeping) == 0)
+        printf("Warning: all cpus run guests, housekeeping threads are not isolated\n");
+    else if (pthread_setaffinity_np(pthread_self(), sizeof(housekeeping), &housekeeping) != 0)
+        printf("Warning: failed to isolate housekeeping threads\n");
+    else
+        printf("Housekeeping threads run on %d cpu(s)\n", CPU_COUNT(&housekeeping));
+}
+
+static int bindMemory(char *mem, size_t size, int node)
+{
+    unsigned long nodeMask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+    if (node < 0 || node >= CPU_SETSIZE)
+        return -1;
+    nodeMask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    // pages already allocated (populate policy) are moved to the node
+    return (int)syscall(SYS_mbind, mem, size, MPOL_BIND, nodeMask, CPU_SETSIZE + 1, MPOL_MF_MOVE);
+}
+
+static LinkedList *guestImages = NULL;
+static pthread_mutex_t guestImagesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parses ELF64 program headers, and copies read-only segment into shared text if its pages hold nothing else
+static int parseElfImage(GuestImage *image, int kvmFd)
+{
+    Elf64_Ehdr *header = (Elf64_Ehdr *)image->data;
+    if (image->size < sizeof(Elf64_Ehdr) || header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_machine != EM_X86_64 ||
+        header->e_phentsize != sizeof(Elf64_Phdr) || header->e_phoff + (uint64_t)header->e_phnum * sizeof(Elf64_Phdr) > image->size)
+        return -1;
+    Elf64_Phdr *programHeaders = (Elf64_Phdr *)(image->data + header->e_phoff);
+    image->segments = (ImageSegment *)calloc(header->e_phnum ? header->e_phnum : 1, sizeof(ImageSegment));
+    if (!image->segments)
+        return -1;
+    image->isElf = 1;
+    image->entry = header->e_entry;
+    for (int i = 0; i < header->e_phnum; i++)
+    {
+        Elf64_Phdr *ph = &programHeaders[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0)
+            continue;
+        if (ph->p_filesz > ph->p_memsz || ph->p_offset + ph->p_filesz > image->size || ph->p_paddr + ph->p_memsz < ph->p_paddr)
+            return -1;
+        ImageSegment *segment = &image->segments[image->segmentCount++];
+        segment->addr = ph->p_paddr;
+        segment->offset = ph->p_offset;
+        segment->fileSize = ph->p_filesz;
+        segment->memSize = ph->p_memsz;
+        segment->writable = (ph->p_flags & PF_W) != 0;
+        if (segment->addr + segment->memSize > image->loadEnd)
+            image->loadEnd = segment->addr + segment->memSize;
+    }
+    if (image->segmentCount == 0)
+        return -1;
+
+    // read-only memory slots are not supported everywhere, guests then get private copies of text
+    if (ioctl(kvmFd, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0)
+        return 0;
+    for (int i = 0; i < image->segmentCount; i++)
+    {
+        ImageSegment *segment = &image->segments[i];
+        if (segment->writable)
+            continue;
+        uint64_t start = segment->addr & ~((uint64_t)SIZE_4KB - 1);
+        uint64_t end = (segment->addr + segment->memSize + SIZE_4KB - 1) & ~((uint64_t)SIZE_4KB - 1);
+        int sharesPages = 0;
+        for (int j = 0; j < image->segmentCount; j++)
+            if (j != i && image->segments[j].addr < end && image->segments[j].addr + image->segments[j].memSize > start)
+                sharesPages = 1;
+        if (sharesPages)
+            continue;
+        char *mem = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return 0;
+        memcpy(mem + (segment->addr - start), image->data + segment->offset, segment->fileSize);
+        mprotect(mem, end - start, PROT_READ);
+        image->text.start = start;
+        image->text.size = end - start;
+        image->text.mem = mem;
+        printf("Image '%s': %llu KB of read-only text shared between guests\n", image->path, (unsigned long long)(image->text.size / 1024));
+        break;
+    }
+    return 0;
+}
+
+static GuestImage *loadGuestImage(char *path, int kvmFd)
+{
+    GuestImage *image = NULL;
+    pthread_mutex_lock(&guestImagesLock);
+    for (LLNode *temp = guestImages; temp; temp = temp->next)
+    {
+        if (strcmp(((GuestImage *)temp->data)->path, path) == 0)
+        {
+            image = (GuestImage *)temp->data;
+            break;
+        }
+    }
+    if (!image)
+    {
+        image = (GuestImage *)calloc(1, sizeof(GuestImage));
+        LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+        if (!image || !elem || !(image->path = copyFilename(path)))
+        {
+            pthread_mutex_unlock(&guestImagesLock);
+            free(image);
+            free(elem);
+            return NULL;
+        }
+        pthread_mutex_init(&image->lock, NULL);
+        elem->data = image;
+        elem->next = guestImages;
+        guestImages = elem;
+    }
+    pthread_mutex_unlock(&guestImagesLock);
+
+    // different images are read in parallel, guests launched from same image wait for the first reader
+    pthread_mutex_lock(&image->lock);
+    if (image->state == IMAGE_NONE)
+    {
+        image->state = IMAGE_FAILED;
+        FILE *img = fopen(path, "r");
+        if (img)
+        {
+            long size = (fseek(img, 0, SEEK_END) == 0) ? ftell(img) : -1;
+            if (size >= 0 && fseek(img, 0, SEEK_SET) == 0 && (image->data = (char *)malloc(size + 1)) != NULL)
+            {
+                image->size = fread(image->data, 1, size, img);
+                image->loadEnd = image->size;
+                image->state = IMAGE_LOADED;
+                if (image->size >= SELFMAG && memcmp(image->data, ELFMAG, SELFMAG) == 0 && parseElfImage(image, kvmFd) != 0)
+                {
+                    printf("Error: '%s' is not valid ELF64 x86-64 executable\n", path);
+                    image->state = IMAGE_FAILED;
+                }
+            }
+            fclose(img);
+        }
+    }
+    pthread_mutex_unlock(&image->lock);
+    return (image->state == IMAGE_LOADED) ? image : NULL;
+}
+
+// Symbols are taken from image itself if it is ELF file, otherwise from ELF file built alongside it ("guest.img" - "guest.elf")
+static SymbolTable *getImageSymbols(GuestImage *image)
+{
+    pthread_mutex_lock(&image->lock);
+    if (!image->symbolsLoaded)
+    {
+        image->symbolsLoaded = 1;
+        if (image->size >= 4 && memcmp(image->data, "\177ELF", 4) == 0)
+            image->symbols = loadSymbols(image->path);
+        else
+        {
+            char elfPath[4096];
+            int length = strlen(image->path);
+            if (length > 4 && strcmp(image->path + length - 4, ".img") == 0)
+                length -= 4;
+            snprintf(elfPath, sizeof(elfPath), "%.*s.elf", length, image->path);
+            image->symbols = loadSymbols(elfPath);
+        }
+    }
+    pthread_mutex_unlock(&image->lock);
+    return image->symbols;
+}
+
+static void deleteGuestImages()
+{
+    while (guestImages)
+    {
+        LLNode *temp = guestImages;
+        GuestImage *image = (GuestImage *)temp->data;
+        guestImages = temp->next;
+        pthread_mutex_destroy(&image->lock);
+        deleteSymbols(image->symbols);
+        if (image->text.mem)
+            munmap(image->text.mem, image->text.size);
+        free(image->segments);
+        free(image->data);
+        free(image->path);
+        free(image);
+        free(temp);
+    }
+}
+
+// Sampler thread kicks every running guest out of KVM_RUN rate times per second, guest thread then takes sample itself
+static struct
+{
+    int rate; // samples per second, 0 - profiling is off
+    char *prefix;
+    int syncRegs; // 1 - registers come with every exit (KVM_CAP_SYNC_REGS), no KVM_GET_REGS is needed
+    GuestSettings *guests;
+    int count;
+    pthread_t thread;
+    atomic_int stop;
+} profiler = {0, "profile", 0, NULL, 0, 0, 0};
+
+static void kickHandler(int signal)
+{
+}
+
+// Gets guest thread out of KVM_RUN: immediate_exit catches guest that is outside of KVM_RUN, signal interrupts guest
+// that is inside, and message and sync devices wake guest waiting on channel or sync object. Caller holds kickLock
+static void kickLocked(GuestSettings *guestSettings)
+{
+    if (guestSettings->executing)
+    {
+        guestSettings->vm.kvm_run->immediate_exit = 1;
+        pthread_kill(guestSettings->thread, SIGUSR1);
+        interruptMsgDevice(guestSettings->msgDevice);
+        interruptSyncDevice(guestSettings->syncDevice);
+    }
+}
+
+static void kickGuest(GuestSettings *guestSettings)
+{
+    pthread_mutex_lock(&guestSettings->kickLock);
+    kickLocked(guestSettings);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+}
+
+static void *samplerThread(void *arg)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long period = 1000000000L / profiler.rate;
+    while (!atomic_load(&profiler.stop))
+    {
+        next.tv_nsec += period;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        for (int i = 0; i < profiler.count; i++)
+            kickGuest(&profiler.guests[i]);
+    }
+    return NULL;
+}
+
+static void takeSample(GuestSettings *guestSettings, struct vm *vm)
+{
+    struct kvm_regs regs;
+    struct kvm_regs *sampled = &regs;
+    if (profiler.syncRegs)
+        sampled = &vm->kvm_run->s.regs.regs;
+    else if (ioctl(vm->vcpu_fd, KVM_GET_REGS, &regs) < 0)
+        return;
+    profileSample(guestSettings->profile, sampled->rip, sampled->rbp, vm->mem, guestSettings->memorySize);
+}
+
+static void *checkpointThread(void *arg)
+{
+    struct timespec step = {0, 100000000L}; // stop request is checked every 100 ms
+    int elapsed = 0;
+    while (!atomic_load(&checkpointer.stop))
+    {
+        nanosleep(&step, NULL);
+        if (++elapsed < checkpointer.interval * 10)
+            continue;
+        elapsed = 0;
+        for (int i = 0; i < checkpointer.count; i++)
+        {
+            atomic_store(&checkpointer.guests[i].checkpointDue, 1);
+            kickGuest(&checkpointer.guests[i]);
+        }
+    }
+    return NULL;
+}
+
+static void checkpointPath(char *path, size_t size, char *directory, int guestId, int seq)
+{
+    snprintf(path, size, "%s/guest%d.%d.ckpt", directory, guestId, seq);
+}
+
+static void deleteCheckpoints(GuestSettings *guestSettings, int from, int to)
+{
+    char path[4096];
+    for (int seq = from; seq <= to; seq++)
+    {
+        checkpointPath(path, sizeof(path), checkpointer.directory, guestSettings->id, seq);
+        unlink(path);
+    }
+}
+
+// Mappings are written oldest first, mapping them again in same order gives same guest addresses
+static int writeMappings(GuestSettings *guestSettings, FILE *out)
+{
+    FileMapping *mappings[FILE_MAP_MAX];
+    int32_t mappingCount = 0;
+    for (LLNode *temp = guestSettings->fileMappings; temp && mappingCount < FILE_MAP_MAX; temp = temp->next)
+        mappings[mappingCount++] = (FileMapping *)temp->data;
+    if (fwrite(&mappingCount, sizeof(mappingCount), 1, out) != 1)
+        return -1;
+    for (int i = mappingCount - 1; i >= 0; i--)
+    {
+        int32_t record[2] = {mappings[i]->mode, (int32_t)strlen(mappings[i]->path)};
+        if (fwrite(record, sizeof(record), 1, out) != 1 || fwrite(&mappings[i]->guestAddr, sizeof(uint64_t), 1, out) != 1 ||
+            fwrite(mappings[i]->path, 1, record[1], out) != (size_t)record[1])
+            return -1;
+    }
+    return 0;
+}
+
+// Console state, positions in input and output files and file device state. Output is flushed, so file on disk
+// holds everything guest wrote until now
+static int writeDeviceState(GuestSettings *guestSettings, FILE *out)
+{
+    int64_t streams[2] = {-1, -1};
+    if (guestSettings->input && guestSettings->input != stdin)
+        streams[0] = ftell(guestSettings->input);
+    if (guestSettings->output && guestSettings->output != stdout && fflush(guestSettings->output) == 0)
+        streams[1] = ftell(guestSettings->output);
+    pthread_mutex_lock(&guestSettings->console.lock);
+    char console[2] = {guestSettings->console.state, guestSettings->console.byte};
+    pthread_mutex_unlock(&guestSettings->console.lock);
+    char *device = NULL;
+    size_t deviceSize = 0;
+    FILE *deviceStream = open_memstream(&device, &deviceSize);
+    int failed = (!deviceStream || saveFileDevice(guestSettings->fileDevice, deviceStream) != 0);
+    if (deviceStream)
+        fclose(deviceStream);
+    uint64_t length = deviceSize;
+    failed |= (failed || fwrite(streams, sizeof(streams), 1, out) != 1 || fwrite(console, sizeof(console), 1, out) != 1 ||
+               fwrite(&length, sizeof(length), 1, out) != 1 || fwrite(device, 1, deviceSize, out) != deviceSize);
+    free(device);
+    return failed ? -1 : 0;
+}
+
+// Checkpoint file: header, file mappings, pages written since previous checkpoint of chain (all pages guest ever
+// wrote for full checkpoint), vCPU state, console state and file device state. Full checkpoint is guest<id>.0.ckpt,
+// incremental ones follow it in order. Guest image and page tables are not saved, restore rebuilds them from image
+static void writeCheckpoint(GuestSettings *guestSettings)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int full = (guestSettings->checkpointSeq == 0);
+    if (full)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        guestSettings->checkpointBase = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+    char path[4096], tempPath[4200];
+    checkpointPath(path, sizeof(path), checkpointer.directory, guestSettings->id, guestSettings->checkpointSeq);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE *out = fopen(tempPath, "w");
+    if (!out)
+    {
+        printf("{Guest %d} Error: cannot create checkpoint '%s'\n", guestSettings->id, tempPath);
+        return;
+    }
+
+    int failed = 0;
+    int32_t header[3] = {guestSettings->id, guestSettings->checkpointSeq, guestSettings->memorySize};
+    failed |= (fwrite(CHECKPOINT_MAGIC, 8, 1, out) != 1 || fwrite(header, sizeof(header), 1, out) != 1 ||
+               fwrite(&guestSettings->checkpointBase, sizeof(uint64_t), 1, out) != 1);
+
+    uint64_t pages = 0;
+    pthread_mutex_lock(&guestSettings->snapshotLock);
+    failed |= (!failed && writeMappings(guestSettings, out) != 0);
+    failed |= (!failed && writeDirtyPages(out, guestSettings->vm.vm_fd, guestSettings->snapshotRegions,
+                                          guestSettings->snapshotRegionCount, full, &pages) != 0);
+    pthread_mutex_unlock(&guestSettings->snapshotLock);
+    failed |= (!failed && writeVcpuState(out, guestSettings->vm.vm_fd, guestSettings->vm.vcpu_fd) != 0);
+    failed |= (!failed && writeDeviceState(guestSettings, out) != 0);
+    failed |= (fflush(out) != 0 || fsync(fileno(out)) != 0);
+    failed |= (fclose(out) != 0);
+    if (failed || rename(tempPath, path) != 0)
+    {
+        unlink(tempPath);
+        printf("{Guest %d} Error: failed to write checkpoint %d\n", guestSettings->id, guestSettings->checkpointSeq);
+        // dirty log was already collected, so only full checkpoint can follow
+        guestSettings->checkpointSeq = 0;
+        return;
+    }
+
+    // incremental checkpoints of previous chain are left from before, restore would skip them anyway
+    if (full && guestSettings->checkpointLast > 0)
+        deleteCheckpoints(guestSettings, 1, guestSettings->checkpointLast);
+    guestSettings->checkpointLast = guestSettings->checkpointSeq;
+    guestSettings->checkpointSeq = (guestSettings->checkpointSeq < CHECKPOINT_CHAIN_MAX) ? guestSettings->checkpointSeq + 1 : 0;
+    guestSettings->checkpointCount++;
+    guestSettings->checkpointPages += pages;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    guestSettings->checkpointTime += (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+// Output file is cut to length it had at checkpoint, guest writes it again from there
+static void rewindOutput(GuestSettings *guestSettings, int64_t offset)
+{
+    if (!guestSettings->output || guestSettings->output == stdout || offset < 0)
+        return;
+    if (ftruncate(fileno(guestSettings->output), offset) != 0 || fseek(guestSettings->output, offset, SEEK_SET) != 0)
+        printf("{Guest %d} Warning: cannot rewind output file\n", guestSettings->id);
+}
+
+// Console state is taken over right away, pending input request is made again once guest runs. File device state
+// is kept until device is created, positions in input and output files are applied by applyStreams
+static int readDeviceState(GuestSettings *guestSettings, FILE *in, int64_t *streams)
+{
+    char console[2];
+    uint64_t length;
+    free(guestSettings->restoredDevice);
+    guestSettings->restoredDevice = NULL;
+    if (fread(streams, sizeof(int64_t), 2, in) != 2 || fread(console, sizeof(console), 1, in) != 1 ||
+        fread(&length, sizeof(length), 1, in) != 1 || length > SIZE_1GB)
+        return -1;
+    guestSettings->console.state = console[0];
+    guestSettings->console.byte = console[1];
+    guestSettings->restoredDevice = (char *)malloc(length ? length : 1);
+    guestSettings->restoredDeviceSize = length;
+    return (guestSettings->restoredDevice && fread(guestSettings->restoredDevice, 1, length, in) == length) ? 0 : -1;
+}
+
+static void applyStreams(GuestSettings *guestSettings, int64_t *streams)
+{
+    if (streams[0] >= 0 && guestSettings->input && fseek(guestSettings->input, streams[0], SEEK_SET) != 0)
+        printf("{Guest %d} Warning: cannot seek input file\n", guestSettings->id);
+    rewindOutput(guestSettings, streams[1]);
+}
+
+static int restoreMappings(GuestSettings *guestSettings, FILE *in)
+{
+    int32_t count;
+    if (fread(&count, sizeof(count), 1, in) != 1 || count < 0 || count > FILE_MAP_MAX)
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        int32_t record[2];
+        uint64_t guestAddr;
+        char path[4096];
+        if (fread(record, sizeof(record), 1, in) != 1 || fread(&guestAddr, sizeof(guestAddr), 1, in) != 1 ||
+            record[1] < 0 || record[1] >= (int32_t)sizeof(path) || fread(path, 1, record[1], in) != (size_t)record[1])
+            return -1;
+        path[record[1]] = '\0';
+        if (guestAddr < guestSettings->nextMapAddr)
+            continue; // mapped by earlier checkpoint of chain or attached at launch
+        int fd = open(path, O_RDONLY);
+        int64_t mapped = (fd >= 0) ? mapGuestFile(guestSettings, fd, record[0]) : -1;
+        if (fd >= 0)
+            close(fd);
+        if (mapped != (int64_t)guestAddr)
+        {
+            printf("{Guest %d} Error: cannot map '%s' again at 0x%llx\n", guestSettings->id, path, (unsigned long long)guestAddr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Applies checkpoint chain from restore directory to freshly prepared guest, stops at first checkpoint that is missing
+// or belongs to another chain. Returns -1 if checkpoint is damaged, guest memory is then in unknown state
+static int restoreCheckpoint(GuestSettings *guestSettings)
+{
+    char path[4096];
+    uint64_t base = 0;
+    int seq = 0;
+    int64_t streams[2] = {-1, -1};
+    while (1)
+    {
+        checkpointPath(path, sizeof(path), checkpointer.restoreDirectory, guestSettings->id, seq);
+        FILE *in = fopen(path, "r");
+        if (!in)
+            break;
+        char magic[8];
+        int32_t header[3];
+        uint64_t fileBase;
+        if (fread(magic, 8, 1, in) != 1 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 || fread(header, sizeof(header), 1, in) != 1 ||
+            fread(&fileBase, sizeof(fileBase), 1, in) != 1 || header[0] != guestSettings->id || header[1] != seq ||
+            header[2] != guestSettings->memorySize || (seq > 0 && fileBase != base))
+        {
+            fclose(in);
+            if (seq == 0)
+            {
+                printf("{Guest %d} Error: '%s' is not checkpoint of this guest\n", guestSettings->id, path);
+                return -1;
+            }
+            break;
+        }
+        base = fileBase;
+        int failed = (restoreMappings(guestSettings, in) != 0 ||
+                      readPages(in, guestSettings->snapshotRegions, guestSettings->snapshotRegionCount, NULL) != 0 ||
+                      readVcpuState(in, guestSettings->vm.vm_fd, guestSettings->vm.vcpu_fd) != 0 ||
+                      readDeviceState(guestSettings, in, streams) != 0);
+        fclose(in);
+        if (failed)
+        {
+            printf("{Guest %d} Error: checkpoint '%s' is damaged\n", guestSettings->id, path);
+            return -1;
+        }
+        seq++;
+    }
+    if (seq == 0)
+    {
+        rewindOutput(guestSettings, 0);
+        printf("{Guest %d} No checkpoint found, starting from image\n", guestSettings->id);
+        return 0;
+    }
+    applyStreams(guestSettings, streams);
+    printf("{Guest %d} Restored from checkpoint %d\n", guestSettings->id, seq - 1);
+    return 0;
+}
+
+// Called by guest thread after kick, returns 1 if guest was migrated away while it was paused
+static int waitWhilePaused(GuestSettings *guestSettings)
+{
+    pthread_mutex_lock(&guestSettings->kickLock);
+    if (!guestSettings->pauseRequested)
+    {
+        pthread_mutex_unlock(&guestSettings->kickLock);
+        return 0;
+    }
+    guestSettings->runState = GUEST_PAUSED;
+    pthread_cond_broadcast(&guestSettings->runStateChanged);
+    while (guestSettings->runState == GUEST_PAUSED)
+        pthread_cond_wait(&guestSettings->runStateChanged, &guestSettings->kickLock);
+    int migrated = (guestSettings->runState == GUEST_MIGRATED);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+    return migrated;
+}
+
+// Returns 0 once guest thread is paused between two KVM_RUN calls, -1 if guest stopped or didn't pause in time
+static int pauseGuest(GuestSettings *guestSettings)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MIGRATION_PAUSE_TIMEOUT;
+    pthread_mutex_lock(&guestSettings->kickLock);
+    guestSettings->pauseRequested = 1;
+    kickLocked(guestSettings);
+    int timedOut = 0;
+    while (guestSettings->runState == GUEST_RUNNING && guestSettings->executing && !timedOut)
+        timedOut = (pthread_cond_timedwait(&guestSettings->runStateChanged, &guestSettings->kickLock, &deadline) == ETIMEDOUT);
+    guestSettings->pauseRequested = 0;
+    int paused = (guestSettings->runState == GUEST_PAUSED);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+    return paused ? 0 : -1;
+}
+
+static void resumeGuest(GuestSettings *guestSettings, int migrated)
+{
+    pthread_mutex_lock(&guestSettings->kickLock);
+    guestSettings->runState = migrated ? GUEST_MIGRATED : GUEST_RUNNING;
+    pthread_cond_broadcast(&guestSettings->runStateChanged);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+}
+
+// Migration stream over socket counts bytes that pass through it
+typedef struct
+{
+    int fd;
+    uint64_t bytes;
+} SocketStream;
+
+static ssize_t socketRead(void *cookie, char *buffer, size_t size)
+{
+    SocketStream *stream = (SocketStream *)cookie;
+    ssize_t length;
+    while ((length = read(stream->fd, buffer, size)) < 0 && errno == EINTR)
+        ;
+    if (length > 0)
+        stream->bytes += length;
+    return length;
+}
+
+static ssize_t socketWrite(void *cookie, const char *buffer, size_t size)
+{
+    SocketStream *stream = (SocketStream *)cookie;
+    size_t written = 0;
+    while (written < size)
+    {
+        // peer that went away is reported as failed write, not SIGPIPE that would end all guests
+        ssize_t length = send(stream->fd, buffer + written, size - written, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            return written ? (ssize_t)written : -1;
+        written += length;
+    }
+    stream->bytes += written;
+    return written;
+}
+
+static FILE *openSocketStream(SocketStream *stream, int fd, char *mode)
+{
+    cookie_io_functions_t functions = {&socketRead, &socketWrite, NULL, NULL};
+    stream->fd = fd;
+    stream->bytes = 0;
+    return fopencookie(stream, mode, functions);
+}
+
+// Pre-copy: pages are sent in rounds while guest runs, each round has pages written during previous one. Guest is
+// paused only for last round, with vCPU and device state. Returns -1 if connection failed
+static int migrateGuest(GuestSettings *guestSettings, FILE *out, FILE *in, SocketStream *sent)
+{
+    uint8_t type = MIGRATION_NO_GUEST;
+    pthread_mutex_lock(&guestSettings->kickLock);
+    int running = (guestSettings->executing && guestSettings->runState == GUEST_RUNNING);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+    if (!running)
+        return (fwrite(&type, 1, 1, out) == 1 && fflush(out) == 0) ? 0 : -1;
+
+    uint64_t startBytes = sent->bytes;
+    uint64_t pages = 0, totalPages = 0;
+    int rounds = 0;
+    int failed = 0;
+    do
+    {
+        type = MIGRATION_ROUND;
+        pthread_mutex_lock(&guestSettings->snapshotLock);
+        failed = (fwrite(&type, 1, 1, out) != 1 || writeMappings(guestSettings, out) != 0 ||
+                  writeDirtyPages(out, guestSettings->vm.vm_fd, guestSettings->snapshotRegions, guestSettings->snapshotRegionCount,
+                                  rounds == 0, &pages) != 0);
+        // dirty log now belongs to migration, checkpoint after it must be full
+        guestSettings->checkpointSeq = 0;
+        pthread_mutex_unlock(&guestSettings->snapshotLock);
+        failed |= (fflush(out) != 0);
+        totalPages += pages;
+        rounds++;
+    } while (!failed && pages > MIGRATION_FINAL_PAGES && rounds < MIGRATION_MAX_ROUNDS);
+    if (failed)
+        return -1;
+
+    struct timespec pauseStart, pauseEnd;
+    clock_gettime(CLOCK_MONOTONIC, &pauseStart);
+    if (pauseGuest(guestSettings) != 0)
+    {
+        type = MIGRATION_ABORT;
+        printf("{Guest %d} Not migrated, guest stopped or didn't pause in %d seconds\n", guestSettings->id, MIGRATION_PAUSE_TIMEOUT);
+        return (fwrite(&type, 1, 1, out) == 1 && fflush(out) == 0) ? 0 : -1;
+    }
+    type = MIGRATION_FINAL;
+    pthread_mutex_lock(&guestSettings->snapshotLock);
+    failed = (fwrite(&type, 1, 1, out) != 1 || writeMappings(guestSettings, out) != 0 ||
+              writeDirtyPages(out, guestSettings->vm.vm_fd, guestSettings->snapshotRegions, guestSettings->snapshotRegionCount, 0,
+                              &pages) != 0);
+    pthread_mutex_unlock(&guestSettings->snapshotLock);
+    uint8_t ack = 0;
+    failed = (failed || writeVcpuState(out, guestSettings->vm.vm_fd, guestSettings->vm.vcpu_fd) != 0 ||
+              writeDeviceState(guestSettings, out) != 0 || fflush(out) != 0 || fread(&ack, 1, 1, in) != 1 || ack != 1);
+    // guest runs here again unless other side confirmed it took over
+    resumeGuest(guestSettings, !failed);
+    if (failed)
+    {
+        printf("{Guest %d} Error: migration failed, guest keeps running here\n", guestSettings->id);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pauseEnd);
+    printf("{Guest %d} Migrated: %d pre-copy round(s), %llu pages, %llu KB sent, downtime %.2f ms\n", guestSettings->id, rounds,
+           (unsigned long long)(totalPages + pages), (unsigned long long)(sent->bytes - startBytes) / 1024,
+           (pauseEnd.tv_sec - pauseStart.tv_sec) * 1000.0 + (pauseEnd.tv_nsec - pauseStart.tv_nsec) / 1000000.0);
+    return 0;
+}
+
+// Other side starts by sending number of its guests with memory size and readiness of every one,
+// guest is sent only if same guest is prepared there
+static void serveMigration(int fd)
+{
+    SocketStream sent, received;
+    FILE *out = openSocketStream(&sent, fd, "w");
+    FILE *in = openSocketStream(&received, fd, "r");
+    char magic[8];
+    int32_t count = -1;
+    if (!out || !in || fread(magic, 8, 1, in) != 1 || memcmp(magic, MIGRATION_MAGIC, 8) != 0 ||
+        fread(&count, sizeof(count), 1, in) != 1 || count != migration.count)
+    {
+        printf("Error: migration request doesn't match guests of this hypervisor\n");
+        if (out)
+            fclose(out);
+        if (in)
+            fclose(in);
+        return;
+    }
+    // whole request is read before anything is sent, acks that follow must not be mistaken for it
+    int32_t(*peers)[2] = (int32_t(*)[2])malloc(count * sizeof(*peers));
+    if (!peers || fread(peers, sizeof(*peers), count, in) != (size_t)count)
+    {
+        printf("Error: incomplete migration request\n");
+        free(peers);
+        fclose(out);
+        fclose(in);
+        return;
+    }
+    int migrated = 0;
+    for (int i = 0; i < count; i++)
+    {
+        GuestSettings *guestSettings = &migration.guests[i];
+        if (peers[i][0] != guestSettings->memorySize || !peers[i][1])
+        {
+            uint8_t type = MIGRATION_NO_GUEST;
+            if (fwrite(&type, 1, 1, out) != 1 || fflush(out) != 0)
+                break;
+            continue;
+        }
+        if (migrateGuest(guestSettings, out, in, &sent) != 0)
+            break;
+        pthread_mutex_lock(&guestSettings->kickLock);
+        migrated += (guestSettings->runState == GUEST_MIGRATED);
+        pthread_mutex_unlock(&guestSettings->kickLock);
+    }
+    printf("Migration: %d guest(s) migrated, %llu KB sent\n", migrated, (unsigned long long)sent.bytes / 1024);
+    free(peers);
+    fclose(out);
+    fclose(in);
+}
+
+static void *migrationThread(void *arg)
+{
+    while (!atomic_load(&migration.stop))
+    {
+        struct pollfd listener = {migration.listenFd, POLLIN, 0};
+        if (poll(&listener, 1, 100) <= 0)
+            continue;
+        int fd = accept4(migration.listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serveMigration(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int openMigrationSocket(char *path, int listening)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (listening)
+        unlink(path);
+    if ((listening && (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0)) ||
+        (!listening && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Applies rounds sent by migrateGuest to prepared guest, returns 0 once guest is taken over, 1 if it wasn't sent
+static int receiveGuest(GuestSettings *guestSettings, FILE *in, FILE *out)
+{
+    uint8_t type;
+    int64_t streams[2];
+    while (fread(&type, 1, 1, in) == 1)
+    {
+        if (type == MIGRATION_NO_GUEST || type == MIGRATION_ABORT)
+            return 1;
+        if ((type != MIGRATION_ROUND && type != MIGRATION_FINAL) || restoreMappings(guestSettings, in) != 0 ||
+            readPages(in, guestSettings->snapshotRegions, guestSettings->snapshotRegionCount, NULL) != 0)
+            return -1;
+        if (type == MIGRATION_ROUND)
+            continue;
+        if (readVcpuState(in, guestSettings->vm.vm_fd, guestSettings->vm.vcpu_fd) != 0 ||
+            readDeviceState(guestSettings, in, streams) != 0)
+            return -1;
+        applyStreams(guestSettings, streams);
+        uint8_t ack = 1;
+        return (fwrite(&ack, 1, 1, out) == 1 && fflush(out) == 0) ? 0 : -1;
+    }
+    return -1;
+}
+
+// Hypervisor with --incoming asks for all its guests at once, then takes them over one by one
+static struct
+{
+    int fd;
+    FILE *in;
+    FILE *out;
+    SocketStream sent;
+    SocketStream received;
+    int taken;
+} incoming = {-1, NULL, NULL, {-1, 0}, {-1, 0}, 0};
+
+static int connectIncoming(GuestSettings *settingsArr, int count)
+{
+    incoming.fd = openMigrationSocket(migration.incomingPath, 0);
+    if (incoming.fd < 0)
+        return -1;
+    incoming.out = openSocketStream(&incoming.sent, incoming.fd, "w");
+    incoming.in = openSocketStream(&incoming.received, incoming.fd, "r");
+    int32_t count32 = count;
+    int failed = (!incoming.out || !incoming.in || fwrite(MIGRATION_MAGIC, 8, 1, incoming.out) != 1 ||
+                  fwrite(&count32, sizeof(count32), 1, incoming.out) != 1);
+    for (int i = 0; i < count && !failed; i++)
+    {
+        int32_t guest[2] = {settingsArr[i].memorySize, settingsArr[i].ready};
+        failed = (fwrite(guest, sizeof(guest), 1, incoming.out) != 1);
+    }
+    return (failed || fflush(incoming.out) != 0) ? -1 : 0;
+}
+
+// Guest runs here only if it was taken over, otherwise it stays with hypervisor it would come from
+static void takeIncomingGuest(GuestSettings *guestSettings)
+{
+    if (!guestSettings->ready)
+        return;
+    int result = incoming.in ? receiveGuest(guestSettings, incoming.in, incoming.out) : -1;
+    guestSettings->ready = (result == 0);
+    if (result == 0)
+        incoming.taken++;
+    else if (result < 0 && incoming.in)
+    {
+        printf("{Guest %d} Error: migration failed\n", guestSettings->id);
+        fclose(incoming.in);
+        fclose(incoming.out);
+        incoming.in = incoming.out = NULL;
+    }
+    else if (result > 0)
+        printf("{Guest %d} Guest was not migrated, it is not started\n", guestSettings->id);
+}
+
+static void closeIncoming()
+{
+    printf("Migration: %d guest(s) taken over, %llu KB received\n", incoming.taken, (unsigned long long)incoming.received.bytes / 1024);
+    if (incoming.in)
+        fclose(incoming.in);
+    if (incoming.out)
+        fclose(incoming.out);
+    if (incoming.fd >= 0)
+        close(incoming.fd);
+}
+
+static int prepareGuest(GuestSettings *guestSettings)
+{
+    struct vm *vm = &guestSettings->vm;
+    struct kvm_sregs sregs;
+    struct kvm_regs regs;
+
+    GuestImage *image = loadGuestImage(guestSettings->guestFile, guestSettings->kvmFd);
+    if (image == NULL)
+    {
+        printf("{Guest %d} Error: cannot open binary file\n", guestSettings->id);
+        return -1;
+    }
+    if (image->isElf && image->loadEnd > (uint64_t)guestSettings->memorySize)
+    {
+        printf("{Guest %d} Error: image segments don't fit in guest memory\n", guestSettings->id);
+        return -1;
+    }
+    if (init_vm(vm, guestSettings->kvmFd, guestSettings->memorySize, guestSettings->memoryPolicy, &image->text,
+                guestSettings->backing, guestSettings->hugetlbfsPath, dirtyLogFlags()))
+    {
+        printf("{Guest %d} Error: failed to init the VM \n", guestSettings->id);
+        return -1;
+    }
+    uint64_t textStart = image->text.mem ? image->text.start : (uint64_t)guestSettings->memorySize;
+    uint64_t textEnd = image->text.mem ? image->text.start + image->text.size : (uint64_t)guestSettings->memorySize;
+    if (textStart > 0)
+        addSnapshotRegion(guestSettings, LOW_MEMORY_SLOT, 0, textStart, vm->mem);
+    if (textEnd < (uint64_t)guestSettings->memorySize)
+        addSnapshotRegion(guestSettings, HIGH_MEMORY_SLOT, textEnd, guestSettings->memorySize - textEnd, vm->mem + textEnd);
+    if (vm->backing != guestSettings->backing)
+        printf("{Guest %d} Warning: %s are not available, guest memory uses %s\n", guestSettings->id,
+               backingNames[guestSettings->backing], backingNames[vm->backing]);
+    if (guestSettings->node >= 0 && bindMemory(vm->mem, guestSettings->memorySize, guestSettings->node) != 0)
+        printf("{Guest %d} Warning: cannot bind memory to NUMA node %d\n", guestSettings->id, guestSettings->node);
+
+    struct kvm_irqfd irqfd;
+    memset(&irqfd, 0, sizeof(irqfd));
+    irqfd.fd = guestSettings->console.eventFd;
+    irqfd.gsi = IRQ_IO;
+    if (ioctl(vm->vm_fd, KVM_IRQFD, &irqfd) < 0)
+    {
+        printf("{Guest %d} Error: KVM_IRQFD\n", guestSettings->id);
+        return -1;
+    }
+
+    if (map_shared_regions(vm, guestSettings->sharedRegions))
+    {
+        printf("{Guest %d} Error: failed to map shared memory regions\n", guestSettings->id);
+        return -1;
+    }
+
+    // guest runs without timing leaf as it did before guest clock existed
+    int tscKhz = setup_cpuid(vm, guestSettings->kvmFd);
+    if (tscKhz < 0)
+        printf("{Guest %d} Warning: CPUID setup failed, guest clock is disabled\n", guestSettings->id);
+    else if (tscKhz == 0)
+        printf("{Guest %d} Warning: TSC frequency is unknown, guest clock is disabled\n", guestSettings->id);
+
+    if (profiler.rate > 0)
+    {
+        SymbolTable *symbols = getImageSymbols(image);
+        if (!symbols)
+            printf("{Guest %d} Warning: no symbols found for '%s', profile shows addresses\n", guestSettings->id, guestSettings->guestFile);
+        guestSettings->profile = createProfile(symbols);
+        if (!guestSettings->profile)
+        {
+            printf("{Guest %d} Error: failed to create profile\n", guestSettings->id);
+            return -1;
+        }
+    }
+    uint64_t loadEnd = image->loadEnd;
+    if (image->isElf)
+    {
+        // guest memory is fresh anonymous mapping, so .bss (memory size above file size) is already zero
+        for (int i = 0; i < image->segmentCount; i++)
+        {
+            ImageSegment *segment = &image->segments[i];
+            if (image->text.mem && segment->addr >= image->text.start && segment->addr + segment->memSize <= image->text.start + image->text.size)
+                continue;
+            memcpy(vm->mem + segment->addr, image->data + segment->offset, segment->fileSize);
+        }
+    }
+    else
+    {
+        loadEnd = (image->size < (size_t)guestSettings->memorySize) ? image->size : (size_t)guestSettings->memorySize;
+        memcpy(vm->mem, image->data, loadEnd);
+    }
+
+    if (ioctl(vm->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+    {
+        printf("{Guest %d} Error: KVM_GET_SREGS\n", guestSettings->id);
+        return -1;
+    }
+
+    uint64_t tableBase = (loadEnd + SIZE_4KB - 1) & ~((uint64_t)SIZE_4KB - 1);
+    // worst case: 3 fixed tables, one page table per 2MB of memory and regions, shared page directory,
+    // page directories of file mapping window
+    uint64_t tableLimit = tableBase + (4 + FILE_MAP_SIZE / SIZE_1GB + guestSettings->memorySize / SIZE_2MB) * SIZE_4KB;
+    for (LLNode *temp = guestSettings->sharedRegions; temp; temp = temp->next)
+        tableLimit += (((SharedRegion *)temp->data)->size / SIZE_2MB) * SIZE_4KB;
+    if (tableLimit > (uint64_t)guestSettings->memorySize)
+    {
+        printf("{Guest %d} Error: no memory left for page tables after guest image\n", guestSettings->id);
+        return -1;
+    }
+    setup_long_mode(vm, &sregs, guestSettings->memorySize, guestSettings->pageSize, tableBase, guestSettings->sharedRegions,
+                    &guestSettings->mapTables);
+
+    guestSettings->nextMapAddr = FILE_MAP_BASE;
+    guestSettings->nextMapSlot = SHM_SLOT_BASE;
+    for (LLNode *temp = guestSettings->sharedRegions; temp; temp = temp->next)
+        guestSettings->nextMapSlot++;
+    for (LLNode *temp = guestSettings->attachedFiles; temp; temp = temp->next)
+    {
+        if (attachFile(guestSettings, (char *)temp->data) != 0)
+        {
+            printf("{Guest %d} Error: cannot attach file '%s'\n", guestSettings->id, (char *)temp->data);
+            return -1;
+        }
+    }
+
+    if (ioctl(vm->vcpu_fd, KVM_SET_SREGS, &sregs) < 0)
+    {
+        printf("{Guest %d} Error: KVM_SET_SREGS\n", guestSettings->id);
+        return -1;
+    }
+    memset(&regs, 0, sizeof(regs));
+    regs.rflags = 2;
+    regs.rip = image->isElf ? image->entry : 0;
+    regs.rsp = guestSettings->memorySize;
+
+    if (ioctl(vm->vcpu_fd, KVM_SET_REGS, &regs) < 0)
+    {
+        printf("{Guest %d} Error: KVM_SET_REGS\n", guestSettings->id);
+        return -1;
+    }
+    if (checkpointer.restoreDirectory)
+        return restoreCheckpoint(guestSettings);
+    return 0;
+}
+
+// Guests are initialized by pool of workers, each worker takes next guest until all are prepared
+static struct
+{
+    GuestSettings *guests;
+    int count;
+    atomic_int next;
+} prepareQueue;
+
+static void *prepareWorker(void *arg)
+{
+    int i;
+    while ((i = atomic_fetch_add(&prepareQueue.next, 1)) < prepareQueue.count)
+        prepareQueue.guests[i].ready = (prepareGuest(&prepareQueue.guests[i]) == 0);
+    return NULL;
+}
+
+// All guests start running at the same time, after every guest has been prepared
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+    int isOpen;
+} startGate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+
+static void *executeGuest(GuestSettings *guestSettings)
+{
+    struct vm vm = guestSettings->vm;
+    int stop = 0;
+    int ret = 0;
+
+    int limited = (guestSettings->ioLimit.bytesPerSecond || guestSettings->ioLimit.opsPerSecond);
+    if ((limited || isIoShared()) && !(guestSettings->ioLimiter = createIoLimiter(limited ? &guestSettings->ioLimit : NULL, guestSettings->ioWeight)))
+        printf("{Guest %d} Error: cannot limit I/O of guest\n", guestSettings->id);
+    FileDeviceConfig fileConfig = {guestSettings->id, guestSettings->sharedFiles, guestSettings->durability,
+                                   guestSettings->scratchLimit, guestSettings->scratchExport, NULL,
+                                   &mapGuestFile, guestSettings,
+                                   guestSettings->ioLimiter ? &limitGuestIo : NULL, guestSettings->ioLimiter,
+                                   guestSettings->directory};
+    if (guestSettings->recordPrefix)
+    {
+        char recordName[4096];
+        snprintf(recordName, sizeof(recordName), "%s.%d", guestSettings->recordPrefix, guestSettings->id);
+        fileConfig.record = fopen(recordName, "w");
+        if (!fileConfig.record || writeRecordHeader(fileConfig.record, &fileConfig) != 0)
+        {
+            printf("{Guest %d} Error: cannot create recording file\n", guestSettings->id);
+            if (fileConfig.record)
+                fclose(fileConfig.record);
+            return (void *)-1;
+        }
+    }
+    DeviceBus *bus = createGuestDevices(guestSettings, &fileConfig);
+    if (!bus)
+    {
+        if (fileConfig.record)
+            fclose(fileConfig.record);
+        return (void *)-1;
+    }
+    if (guestSettings->restoredDevice)
+    {
+        FILE *saved = fmemopen(guestSettings->restoredDevice, guestSettings->restoredDeviceSize, "r");
+        int restored = (saved && restoreFileDevice(guestSettings->fileDevice, saved) == 0);
+        if (saved)
+            fclose(saved);
+        free(guestSettings->restoredDevice);
+        guestSettings->restoredDevice = NULL;
+        if (!restored)
+        {
+            printf("{Guest %d} Error: cannot restore file device state\n", guestSettings->id);
+            deleteDeviceBus(bus);
+            if (fileConfig.record)
+                fclose(fileConfig.record);
+            return (void *)-1;
+        }
+    }
+    if (guestSettings->console.state == INPUT_REQUESTED)
+    {
+        // request was saved in checkpoint, byte it asked for was never read
+        guestSettings->console.state = INPUT_NONE;
+        requestInput(guestSettings);
+    }
+    if (guestSettings->profile || checkpointer.directory || migration.path)
+    {
+        if (profiler.syncRegs)
+            vm.kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS;
+        pthread_mutex_lock(&guestSettings->kickLock);
+        guestSettings->thread = pthread_self();
+        guestSettings->executing = 1;
+        pthread_mutex_unlock(&guestSettings->kickLock);
+    }
+
+    while (stop == 0)
+    {
+        ret = ioctl(vm.vcpu_fd, KVM_RUN, 0);
+        if (ret == -1 && errno == EINTR)
+        {
+            // kicked by sampler, checkpoint thread or migration
+            vm.kvm_run->immediate_exit = 0;
+            if (guestSettings->profile)
+                takeSample(guestSettings, &vm);
+            if (atomic_exchange(&guestSettings->checkpointDue, 0))
+                writeCheckpoint(guestSettings);
+            if (waitWhilePaused(guestSettings))
+                break;
+            continue;
+        }
+        if (ret == -1)
+        {
+            printf("{Guest %d} Error: KVM_RUN failed\n", guestSettings->id);
+            break;
+        }
+
+        switch (vm.kvm_run->exit_reason)
+        {
+        case KVM_EXIT_IO:
+            stop = dispatchPortExit(bus, vm.kvm_run);
+            break;
+        case KVM_EXIT_MMIO:
+            stop = dispatchMmioExit(bus, vm.kvm_run);
+            break;
+        case KVM_EXIT_INTERNAL_ERROR:
+            printf("{Guest %d} Error: internal error = 0x%x\n", guestSettings->id, vm.kvm_run->internal.suberror);
+            stop = 1;
+            break;
+        case KVM_EXIT_SHUTDOWN:
+            printf("{Guest %d} Shutdown\n", guestSettings->id);
+            stop = 1;
+            break;
+        default:
+            printf("{Guest %d} Exit reason: %d\n", guestSettings->id, vm.kvm_run->exit_reason);
+            stop = 1;
+            break;
+        }
+    }
+    pthread_mutex_lock(&guestSettings->kickLock);
+    guestSettings->executing = 0;
+    if (guestSettings->runState != GUEST_MIGRATED)
+        guestSettings->runState = GUEST_ENDED;
+    pthread_cond_broadcast(&guestSettings->runStateChanged);
+    pthread_mutex_unlock(&guestSettings->kickLock);
+    deleteDeviceBus(bus);
+    guestSettings->fileDevice = NULL;
+    guestSettings->msgDevice = NULL;
+    guestSettings->syncDevice = NULL;
+    if (fileConfig.record)
+        fclose(fileConfig.record);
+    // guest that stopped by itself has nothing left to resume
+    if (stop && checkpointer.directory)
+        deleteCheckpoints(guestSettings, 0, CHECKPOINT_CHAIN_MAX);
+    return (void *)0;
+}
+
+static void *
+runGuest(void *settings)
+{
+    GuestSettings *guestSettings = (GuestSettings *)settings;
+    void *result = (void *)-1;
+
+    pthread_mutex_lock(&startGate.lock);
+    while (!startGate.isOpen)
+        pthread_cond_wait(&startGate.opened, &startGate.lock);
+    pthread_mutex_unlock(&startGate.lock);
+    if (guestSettings->ready)
+    {
+        result = executeGuest(guestSettings);
+        guestSettings->residentSize = resident_size(&guestSettings->vm, guestSettings->memorySize);
+        char backing[64] = "";
+        if (guestSettings->vm.backing == BACKING_THP)
+            snprintf(backing, sizeof(backing), ", %zu KB in huge pages", huge_resident_size(&guestSettings->vm) / 1024);
+        else if (guestSettings->backing != BACKING_NONE)
+            snprintf(backing, sizeof(backing), ", %s", backingNames[guestSettings->vm.backing]);
+        printf("{Guest %d} Memory: %zu KB resident of %d KB (%s%s)\n", guestSettings->id, guestSettings->residentSize / 1024,
+               guestSettings->memorySize / 1024, memoryPolicyNames[guestSettings->memoryPolicy], backing);
+        if (guestSettings->profile && writeProfile(guestSettings->profile, profiler.prefix, guestSettings->id) == 0)
+            printf("{Guest %d} Profile: %ld samples written to %s.%d.txt and %s.%d.folded\n", guestSettings->id,
+                   profileSampleCount(guestSettings->profile), profiler.prefix, guestSettings->id, profiler.prefix, guestSettings->id);
+        else if (guestSettings->profile)
+            printf("{Guest %d} Error: cannot write profile\n", guestSettings->id);
+        if (guestSettings->checkpointCount > 0)
+            printf("{Guest %d} Checkpoints: %d written, %llu pages, %.2f ms on average\n", guestSettings->id,
+                   guestSettings->checkpointCount, (unsigned long long)guestSettings->checkpointPages,
+                   guestSettings->checkpointTime / guestSettings->checkpointCount);
+        if (guestSettings->ioLimiter)
+        {
+            IoStats stats;
+            getIoStats(guestSettings->ioLimiter, &stats);
+            printf("{Guest %d} I/O: %llu operations, %llu KB, throttled %llu times for %.1f ms\n", guestSettings->id,
+                   (unsigned long long)stats.ops, (unsigned long long)stats.bytes / 1024, (unsigned long long)stats.throttled,
+                   stats.waitNs / 1000000.0);
+        }
+    }
+    deleteIoLimiter(guestSettings->ioLimiter);
+    guestSettings->ioLimiter = NULL;
+    cancelInput(guestSettings);
+    leaveChannels();
+    // guest that stopped doesn't hold back barriers of other members
+    leaveSyncGroup(guestSettings->syncGroup);
+    guestSettings->syncGroup = NULL;
+    deleteProfile(guestSettings->profile);
+    guestSettings->profile = NULL;
+    release_vm(&guestSettings->vm);
+    deleteFileMappings(guestSettings);
+    releaseSnapshotRegions(guestSettings->snapshotRegions, guestSettings->snapshotRegionCount);
+    guestSettings->snapshotRegionCount = 0;
+    free(guestSettings->restoredDevice);
+    guestSettings->restoredDevice = NULL;
+    return result;
+}
+
+int isDigit(char *s)
+{
+    if (*s < '0' || *s > '9' || *(s + 1))
+        return 0;
+    else
+        return 1;
+}
+
+static int parseMemoryPolicy(char *s)
+{
+    for (int i = MEMORY_SHARED; i <= MEMORY_POPULATE; i++)
+    {
+        if (strcmp(s, memoryPolicyNames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Argument of --hugepages is none, thp, 2mb, 1gb or path to hugetlbfs mount, other directory gets transparent huge pages
+static int parseBacking(char *s, char **hugetlbfsPath)
+{
+    for (int i = BACKING_NONE; i <= BACKING_1GB; i++)
+    {
+        static const char *names[] = {"none", "thp", "2mb", "1gb"};
+        if (strcmp(s, names[i]) == 0)
+            return i;
+    }
+    struct stat st;
+    if (stat(s, &st) != 0 || !S_ISDIR(st.st_mode))
+        return -1;
+    struct statfs fs;
+    if (statfs(s, &fs) != 0 || fs.f_type != HUGETLBFS_MAGIC)
+    {
+        printf("Warning: '%s' is not a hugetlbfs mount, transparent huge pages are used instead\n", s);
+        return BACKING_THP;
+    }
+    *hugetlbfsPath = s;
+    return BACKING_HUGETLBFS;
+}
+
+static void deleteEntryList(LinkedList *list)
+{
+    while (list)
+    {
+        LLNode *temp = list;
+        GuestEntry *entry = (GuestEntry *)temp->data;
+        list = temp->next;
+        free(entry->image);
+        deleteList(entry->sharedFiles, 1);
+        free(entry->input);
+        free(entry->output);
+        free(entry->directory);
+        free(entry->group);
+        free(entry);
+        free(temp);
+    }
+}
+
+// Creates entry of guest with given image, settings not given later are taken from command line
+static GuestEntry *createGuestEntry(char *image)
+{
+    GuestEntry *entry = (GuestEntry *)calloc(1, sizeof(GuestEntry));
+    if (!entry || !(entry->image = copyFilename(image)))
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->cpu = -1;
+    entry->memoryPolicy = -1;
+    return entry;
+}
+
+// Applies one setting of guest in form key=value, same settings are accepted in manifest and after --guest images:
+// [memory=2|4|8] [page=2|4] [policy=shared|lazy|populate] [files=<name>,<name>,...] [input=console|none|<file>]
+// [output=console|none|<file>] [cpu=<core>] [io=<KB>:<ops>[:<burst>]] [weight=<weight>] [dir=<directory>]
+// [group=<name>]
+static int parseGuestSetting(GuestEntry *entry, char *token)
+{
+    char *value = strchr(token, '=');
+    if (!value || value[1] == '\0')
+        return -1;
+    *value++ = '\0';
+    if (strcmp(token, "memory") == 0 && isDigit(value) && (atoi(value) == 2 || atoi(value) == 4 || atoi(value) == 8))
+        entry->memorySize = atoi(value) * 0x100000;
+    else if (strcmp(token, "page") == 0 && isDigit(value) && (atoi(value) == 2 || atoi(value) == 4))
+        entry->pageSize = (atoi(value) == 2) ? 0x200000 : 0x1000;
+    else if (strcmp(token, "files") == 0)
+    {
+        // later files setting replaces earlier one
+        deleteList(entry->sharedFiles, 1);
+        entry->sharedFiles = NULL;
+        entry->sharedFileCount = 0;
+        entry->filesSet = 1;
+        char *fileSave;
+        for (char *name = strtok_r(value, ",", &fileSave); name && strcmp(name, "none") != 0; name = strtok_r(NULL, ",", &fileSave))
+        {
+            if (strlen(name) > MAX_PATH_LENGTH || pushString(&entry->sharedFiles, name) != 0)
+                return -1;
+            entry->sharedFileCount++;
+        }
+    }
+    else if (strcmp(token, "input") == 0)
+    {
+        free(entry->input);
+        entry->input = NULL;
+        return (strcmp(value, "console") == 0 || (entry->input = copyFilename(value))) ? 0 : -1;
+    }
+    else if (strcmp(token, "output") == 0)
+    {
+        free(entry->output);
+        entry->output = NULL;
+        return (strcmp(value, "console") == 0 || (entry->output = copyFilename(value))) ? 0 : -1;
+    }
+    else if (strcmp(token, "policy") == 0)
+        return ((entry->memoryPolicy = parseMemoryPolicy(value)) < 0) ? -1 : 0;
+    else if (strcmp(token, "cpu") == 0)
+    {
+        char *end;
+        long cpu = strtol(value, &end, 10);
+        if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE)
+            return -1;
+        entry->cpu = (int)cpu;
+    }
+    else if (strcmp(token, "io") == 0)
+        return parseIoLimit(value, &entry->ioLimit);
+    else if (strcmp(token, "weight") == 0)
+    {
+        char *end;
+        long weight = strtol(value, &end, 10);
+        if (*end != '\0' || weight < 1 || weight > IO_WEIGHT_MAX)
+            return -1;
+        entry->ioWeight = (int)weight;
+    }
+    else if (strcmp(token, "dir") == 0)
+    {
+        free(entry->directory);
+        entry->directory = NULL;
+        return (strlen(value) <= MAX_PATH_LENGTH && (entry->directory = copyFilename(value))) ? 0 : -1;
+    }
+    else if (strcmp(token, "group") == 0)
+    {
+        free(entry->group);
+        entry->group = NULL;
+        return (strlen(value) <= SYNC_NAME_LENGTH && (entry->group = copyFilename(value))) ? 0 : -1;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+// Parses manifest file where every non-empty line (except comments starting with '#') describes one guest:
+// <image> [<key>=<value> ...], with settings accepted by parseGuestSetting
+static int parseManifest(char *path, LinkedList **entries, int *count)
+{
+    FILE *manifest = fopen(path, "r");
+    if (!manifest)
+    {
+        printf("Error: cannot open manifest file '%s'\n", path);
+        return -1;
+    }
+    LLNode *last = NULL;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int lineNumber = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &lineCapacity, manifest) != -1)
+    {
+        lineNumber++;
+        char *save;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        if (!token || token[0] == '#')
+            continue;
+        GuestEntry *entry = createGuestEntry(token);
+        LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+        if (!entry || !elem)
+        {
+            printf("Error: malloc failed\n");
+            if (entry)
+                free(entry->image);
+            free(entry);
+            free(elem);
+            result = -1;
+            break;
+        }
+        elem->data = entry;
+        elem->next = NULL;
+        if (last)
+            last->next = elem;
+        else
+            *entries = elem;
+        last = elem;
+        (*count)++;
+        while (result == 0 && (token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+            result = parseGuestSetting(entry, token);
+        if (result != 0)
+            printf("Error: bad manifest entry on line %d\n", lineNumber);
+    }
+    free(line);
+    fclose(manifest);
+    return result;
+}
+
+// Opens input/output routing of guest, console is used if entry doesn't specify it
+static FILE *openGuestStream(char *name, char *mode, FILE *console)
+{
+    if (!name)
+        return console;
+    if (strcmp(name, "none") == 0)
+        return NULL;
+    return fopen(name, mode);
+}
+
+static void deleteSettings(GuestSettings *settingsArr, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(settingsArr[i].guestFile);
+        free(settingsArr[i].directory);
+        close(settingsArr[i].console.eventFd);
+        pthread_mutex_destroy(&settingsArr[i].kickLock);
+        pthread_mutex_destroy(&settingsArr[i].snapshotLock);
+        pthread_cond_destroy(&settingsArr[i].runStateChanged);
+        if (settingsArr[i].input && settingsArr[i].input != stdin)
+            fclose(settingsArr[i].input);
+        if (settingsArr[i].output && settingsArr[i].output != stdout)
+            fclose(settingsArr[i].output);
+    }
+    free(settingsArr);
+    // only guests in settings join groups
+    deleteSyncGroups();
+}
+
+int main(int argc, char **argv)
+{
+    int kvmFd = open("/dev/kvm", O_RDWR);
+    if (kvmFd < 0)
+    {
+        printf("Error: failed to open /dev/kvm");
+        return -1;
+    }
+    int memorySize = 0, pageSize = 0;
+    char memorySet = 0, pageSet = 0; // 0, 1, 2
+    char guestSet = 0;               // 0, 1, 2, 3
+    int guestCount = 0;
+    char sharedSet = 0; // 0, 1, 2, 3
+    int sharedCount = 0;
+    char shmSet = 0; // 0, 1, 2, 3
+    char durabilitySet = 0; // 0, 1, 2
+    int durability = DURABILITY_NONE;
+    int syncInterval = DEFAULT_SYNC_INTERVAL;
+    char scratchSet = 0; // 0, 1, 2
+    size_t scratchLimit = 0;
+    char scratchExport = 0;
+    char manifestSet = 0; // 0, 1, 2
+    char *manifestPath = NULL;
+    LinkedList *manifestEntries = NULL;
+    char policySet = 0; // 0, 1, 2
+    int memoryPolicy = MEMORY_SHARED;
+    char recordSet = 0; // 0, 1, 2
+    char *recordPrefix = NULL;
+    char placementSet = 0; // 0, 1, 2
+    int placement = PLACEMENT_NONE;
+    cpu_set_t placementList;
+    char isolate = 0;
+    char profileSet = 0; // 0, 1, 2
+    char attachSet = 0;  // 0, 1, 2, 3
+    char hugeSet = 0;    // 0, 1, 2
+    char checkpointSet = 0; // 0, 1, 2
+    char restoreSet = 0;    // 0, 1, 2
+    char migrationSet = 0;  // 0, 1, 2
+    char incomingSet = 0;   // 0, 1, 2
+    char ioLimitSet = 0;    // 0, 1, 2
+    char ioShareSet = 0;    // 0, 1, 2
+    char workDirSet = 0;    // 0, 1, 2
+    char *workDir = NULL;   // NULL - directories of guests are created in working directory
+    IoLimit ioLimit = {0, 0, IO_BURST_DEFAULT};
+    IoLimit ioShare;
+    int backing = BACKING_NONE;
+    char *hugetlbfsPath = NULL;
+    int manifestCount = 0;
+    uint64_t nextShmAddr = SHM_BASE;
+    LinkedList *guestEntries = NULL; // guests from --guest with their settings, last given guest first
+    LinkedList *sharedFilenames = NULL;
+    LinkedList *sharedRegions = NULL;
+    LinkedList *attachedFilenames = NULL;
+    LLNode *temp;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0)
+        {
+            if (guestSet == 1 || pageSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || memorySet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet == 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            memorySet = 1;
+        }
+        else if (strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0)
+        {
+            if (guestSet == 1 || memorySet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || pageSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet == 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            pageSet = 1;
+        }
+        else if (strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || guestSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (sharedSet == 2)
+                sharedSet == 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            guestSet = 1;
+        }
+        else if (strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || sharedSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            sharedSet = 1;
+        }
+        else if (strcmp(argv[i], "--shm") == 0 || strcmp(argv[i], "-s") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || shmSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            shmSet = 1;
+        }
+        else if (strcmp(argv[i], "--durability") == 0 || strcmp(argv[i], "-d") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || durabilitySet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            durabilitySet = 1;
+        }
+        else if (strcmp(argv[i], "--scratch") == 0 || strcmp(argv[i], "-r") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || scratchSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            scratchSet = 1;
+        }
+        else if (strcmp(argv[i], "--manifest") == 0 || strcmp(argv[i], "-c") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || manifestSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            manifestSet = 1;
+        }
+        else if (strcmp(argv[i], "--mem-policy") == 0 || strcmp(argv[i], "-l") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || policySet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            policySet = 1;
+        }
+        else if (strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "-t") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || recordSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            recordSet = 1;
+        }
+        else if (strcmp(argv[i], "--placement") == 0 || strcmp(argv[i], "-a") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || placementSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            placementSet = 1;
+        }
+        else if (strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "-o") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || profileSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            profileSet = 1;
+        }
+        else if (strcmp(argv[i], "--attach") == 0 || strcmp(argv[i], "-x") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || attachSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            attachSet = 1;
+        }
+        else if (strcmp(argv[i], "--hugepages") == 0 || strcmp(argv[i], "-u") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || hugeSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            hugeSet = 1;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 || strcmp(argv[i], "-k") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || checkpointSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            checkpointSet = 1;
+        }
+        else if (strcmp(argv[i], "--restore") == 0 || strcmp(argv[i], "-w") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || restoreSet > 0)
+            {
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
             }
-            else if (vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == PORT_FILE)
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            restoreSet = 1;
+        }
+        else if (strcmp(argv[i], "--migration") == 0 || strcmp(argv[i], "-e") == 0)
+        {
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || migrationSet > 0)
             {
-                char *data_in = (((char *)vm.kvm_run) + vm.kvm_run->io.data_offset);
-                switch (fileState1)
-                {
-                case FSTATE1_OPEN_R:
-                case FSTATE1_OPEN_W:
-                    if (fileState2 == FSTATE2_FD)
-                    {
-                        remainingBytes -= 1;
-                        uint8_t byte = (uint8_t)((fd >> (8 * remainingBytes)) & 0xFF);
-                        *data_in = (char)(byte);
-                        if (remainingBytes == 0)
-                        {
-                            fileState1 = FSTATE1_NONE;
-                            fileState2 = FSTATE2_NONE;
-                        }
-                    }
-                    else
-                    {
-                        printf("{Guest %d} File system error - undefined behaviour\n", guestSettings->id);
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    break;
-                case FSTATE1_CLOSE:
-                case FSTATE1_READ:
-                    if (fileState2 == FSTATE2_CHAR)
-                    {
-                        *data_in = chr;
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    else
-                    {
-                        printf("{Guest %d} File system error - undefined behaviour\n", guestSettings->id);
-                        fileState1 = FSTATE1_NONE;
-                        fileState2 = FSTATE2_NONE;
-                    }
-                    break;
-                default:
-                    printf("{Guest %d} File system error - undefined behaviour\n", guestSettings->id);
-                    fileState1 = FSTATE1_NONE;
-                    fileState2 = FSTATE2_NONE;
-                }
+                printf("Error: bad command line arguments\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
             }
-            break;
-        case KVM_EXIT_HLT:
-            printf("{Guest %d} KVM_EXIT_HLT\n", guestSettings->id);
-            stop = 1;
-            break;
-        case KVM_EXIT_INTERNAL_ERROR:
-            printf("{Guest %d} Error: internal error = 0x%x\n", guestSettings->id, vm.kvm_run->internal.suberror);
-            stop = 1;
-            break;
-        case KVM_EXIT_SHUTDOWN:
-            printf("{Guest %d} Shutdown\n", guestSettings->id);
-            stop = 1;
-            break;
-        default:
-            printf("{Guest %d} Exit reason: %d\n", guestSettings->id, vm.kvm_run->exit_reason);
-            stop = 1;
-            break;
+            if (guestSet == 2)
+                guestSet = 3;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            migrationSet = 1;
         }
-    }
-    deleteFileList(&sharedFileSystem);
-    deleteFileList(&localFileSystem);
-    return (void *)0;
-}
-
-int isDigit(char *s)
-{
-    if (*s < '0' || *s > '9' || *(s + 1))
-        return 0;
-    else
-        return 1;
-}
-
-int main(int argc, char **argv)
-{
-    int kvmFd = open("/dev/kvm", O_RDWR);
-    if (kvmFd < 0)
-    {
-        printf("Error: failed to open /dev/kvm");
-        return -1;
-    }
-    int memorySize, pageSize;
-    char memorySet = 0, pageSet = 0; // 0, 1, 2
-    char guestSet = 0;               // 0, 1, 2, 3
-    int guestCount = 0;
-    char sharedSet = 0; // 0, 1, 2, 3
-    int sharedCount = 0;
-    LinkedList *guestFilenames = NULL;
-    LinkedList *sharedFilenames = NULL;
-    LLNode *temp;
-    for (int i = 1; i < argc; i++)
-    {
-        if (strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0)
+        else if (strcmp(argv[i], "--incoming") == 0 || strcmp(argv[i], "-i") == 0)
         {
-            if (guestSet == 1 || pageSet == 1 || sharedSet == 1 || memorySet > 0)
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 || incomingSet > 0)
             {
                 printf("Error: bad command line arguments\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             if (guestSet == 2)
                 guestSet = 3;
             if (sharedSet == 2)
-                sharedSet == 3;
-            memorySet = 1;
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            incomingSet = 1;
         }
-        else if (strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0)
+        else if (strcmp(argv[i], "--io-limit") == 0 || strcmp(argv[i], "-b") == 0)
         {
-            if (guestSet == 1 || memorySet == 1 || sharedSet == 1 || pageSet > 0)
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioShareSet == 1 || workDirSet == 1 || ioLimitSet > 0)
             {
                 printf("Error: bad command line arguments\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             if (guestSet == 2)
                 guestSet = 3;
             if (sharedSet == 2)
-                sharedSet == 3;
-            pageSet = 1;
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            ioLimitSet = 1;
         }
-        else if (strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0)
+        else if (strcmp(argv[i], "--io-share") == 0 || strcmp(argv[i], "-q") == 0)
         {
-            if (memorySet == 1 || pageSet == 1 || sharedSet == 1 || guestSet > 0)
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || workDirSet == 1 || ioShareSet > 0)
             {
                 printf("Error: bad command line arguments\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
+            if (guestSet == 2)
+                guestSet = 3;
             if (sharedSet == 2)
-                sharedSet == 3;
-            guestSet = 1;
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            ioShareSet = 1;
         }
-        else if (strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0)
+        else if (strcmp(argv[i], "--work-dir") == 0 || strcmp(argv[i], "-n") == 0)
         {
-            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet > 0)
+            if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet > 0)
             {
                 printf("Error: bad command line arguments\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             if (guestSet == 2)
                 guestSet = 3;
-            sharedSet = 1;
+            if (sharedSet == 2)
+                sharedSet = 3;
+            if (shmSet == 2)
+                shmSet = 3;
+            if (attachSet == 2)
+                attachSet = 3;
+            workDirSet = 1;
         }
         else if (memorySet == 1)
         {
             if (!isDigit(argv[i]))
             {
                 printf("Error: bad --memory argument\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             int m = atoi(argv[i]);
             if (m != 2 && m != 4 && m != 8)
             {
                 printf("Error: bad --memory argument\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             memorySize = m * 0x100000;
@@ -1115,16 +3835,20 @@ int main(int argc, char **argv)
             if (!isDigit(argv[i]))
             {
                 printf("Error: bad --page argument\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             int p = atoi(argv[i]);
             if (p != 2 && p != 4)
             {
                 printf("Error: bad --page argument\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             pageSize = (p == 2) ? 0x200000 : 0x1000;
@@ -1136,17 +3860,45 @@ int main(int argc, char **argv)
             if (l > 200)
             {
                 printf("Error: guest file's name length must be less than or equal to 200\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
-            if (pushString(&guestFilenames, argv[i]) != 0)
+            // setting given after image belongs to that image
+            if (guestSet == 2 && strchr(argv[i], '='))
+            {
+                GuestEntry *entry = (GuestEntry *)guestEntries->data;
+                if (parseGuestSetting(entry, argv[i]) != 0)
+                {
+                    printf("Error: bad setting of guest '%s'\n", entry->image);
+                    deleteEntryList(guestEntries);
+                    deleteList(sharedFilenames, 1);
+                    deleteList(attachedFilenames, 1);
+                    deleteRegionList(sharedRegions);
+                    return -1;
+                }
+                continue;
+            }
+            GuestEntry *entry = createGuestEntry(argv[i]);
+            LLNode *elem = (LLNode *)malloc(sizeof(LLNode));
+            if (!entry || !elem)
             {
                 printf("Error: malloc failed\n");
-                deleteList(guestFilenames, 1);
+                if (entry)
+                    free(entry->image);
+                free(entry);
+                free(elem);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
+            elem->data = entry;
+            elem->next = guestEntries;
+            guestEntries = elem;
             guestSet = 2;
             guestCount++;
         }
@@ -1156,80 +3908,612 @@ int main(int argc, char **argv)
             if (l > 300)
             {
                 printf("Error: path to shared file mustn't be longer than %d characters\n", 300);
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             if (pushString(&sharedFilenames, argv[i]) != 0)
             {
                 printf("Error: malloc failed\n");
-                deleteList(guestFilenames, 1);
+                deleteEntryList(guestEntries);
                 deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
                 return -1;
             }
             sharedSet = 2;
             sharedCount++;
         }
+        else if (durabilitySet == 1)
+        {
+            int valid = 1;
+            if (strcmp(argv[i], "none") == 0)
+                durability = DURABILITY_NONE;
+            else if (strcmp(argv[i], "close") == 0)
+                durability = DURABILITY_CLOSE;
+            else if (strcmp(argv[i], "periodic") == 0)
+                durability = DURABILITY_PERIODIC;
+            else if (strncmp(argv[i], "periodic:", 9) == 0)
+            {
+                char *end;
+                durability = DURABILITY_PERIODIC;
+                syncInterval = (int)strtol(argv[i] + 9, &end, 10);
+                valid = (*end == '\0' && syncInterval > 0);
+            }
+            else
+                valid = 0;
+            if (!valid)
+            {
+                printf("Error: bad --durability argument, expected none, close or periodic[:milliseconds]\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            durabilitySet = 2;
+        }
+        else if (scratchSet == 1)
+        {
+            char *end;
+            long size = strtol(argv[i], &end, 10);
+            if (strcmp(end, ":export") == 0)
+                scratchExport = 1;
+            else if (*end != '\0')
+                size = 0;
+            if (end == argv[i] || size <= 0 || size > 4096)
+            {
+                printf("Error: bad --scratch argument, expected size in MB (1 - 4096) with optional ':export'\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            scratchLimit = (size_t)size * 0x100000;
+            scratchSet = 2;
+        }
+        else if (manifestSet == 1)
+        {
+            manifestPath = argv[i];
+            manifestSet = 2;
+        }
+        else if (policySet == 1)
+        {
+            memoryPolicy = parseMemoryPolicy(argv[i]);
+            if (memoryPolicy < 0)
+            {
+                printf("Error: bad --mem-policy argument, expected shared, lazy or populate\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            policySet = 2;
+        }
+        else if (recordSet == 1)
+        {
+            recordPrefix = argv[i];
+            recordSet = 2;
+        }
+        else if (profileSet == 1)
+        {
+            char *end;
+            long rate = strtol(argv[i], &end, 10);
+            if (*end == ':' && end[1] != '\0')
+                profiler.prefix = end + 1;
+            else if (*end != '\0')
+                rate = 0;
+            if (end == argv[i] || rate <= 0 || rate > PROFILE_MAX_RATE)
+            {
+                printf("Error: bad --profile argument, expected samples per second (1 - %d) with optional ':prefix'\n", PROFILE_MAX_RATE);
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            profiler.rate = (int)rate;
+            profileSet = 2;
+        }
+        else if (placementSet == 1)
+        {
+            if (parsePlacement(argv[i], &placement, &placementList, &isolate) != 0)
+            {
+                printf("Error: bad --placement argument, expected none, compact, spread or cpu list, optionally followed by ':isolate'\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            placementSet = 2;
+        }
+        else if (hugeSet == 1)
+        {
+            backing = parseBacking(argv[i], &hugetlbfsPath);
+            if (backing < 0)
+            {
+                printf("Error: bad --hugepages argument, expected none, thp, 2mb, 1gb or hugetlbfs directory\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            hugeSet = 2;
+        }
+        else if (checkpointSet == 1)
+        {
+            char *colon = strrchr(argv[i], ':');
+            if (colon && colon != argv[i] && isDigit(colon + 1) && colon[1] != '\0')
+            {
+                *colon = '\0';
+                checkpointer.interval = atoi(colon + 1);
+            }
+            if (argv[i][0] == '\0' || checkpointer.interval <= 0)
+            {
+                printf("Error: bad --checkpoint argument, expected directory with optional ':seconds'\n");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            checkpointer.directory = argv[i];
+            checkpointSet = 2;
+        }
+        else if (restoreSet == 1)
+        {
+            checkpointer.restoreDirectory = argv[i];
+            restoreSet = 2;
+        }
+        else if (migrationSet == 1)
+        {
+            migration.path = argv[i];
+            migrationSet = 2;
+        }
+        else if (incomingSet == 1)
+        {
+            migration.incomingPath = argv[i];
+            incomingSet = 2;
+        }
+        else if (workDirSet == 1)
+        {
+            workDir = argv[i];
+            workDirSet = 2;
+        }
+        else if (ioLimitSet == 1 || ioShareSet == 1)
+        {
+            if (parseIoLimit(argv[i], (ioLimitSet == 1) ? &ioLimit : &ioShare) != 0)
+            {
+                printf("Error: bad %s argument, expected KB per second and operations per second (0 - unlimited) with optional ':burst' in ms\n",
+                       (ioLimitSet == 1) ? "--io-limit" : "--io-share");
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            if (ioLimitSet == 1)
+                ioLimitSet = 2;
+            else
+            {
+                setIoShare(&ioShare);
+                ioShareSet = 2;
+            }
+        }
+        else if (attachSet == 1 || attachSet == 2)
+        {
+            if (strlen(argv[i]) > 300 || pushString(&attachedFilenames, argv[i]) != 0)
+            {
+                printf("Error: bad --attach argument '%s'\n", argv[i]);
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            attachSet = 2;
+        }
+        else if (shmSet == 1 || shmSet == 2)
+        {
+            if (pushSharedRegion(&sharedRegions, argv[i], nextShmAddr) != 0)
+            {
+                printf("Error: bad --shm argument '%s', expected unique name:size with size in MB, multiple of 2\n", argv[i]);
+                deleteEntryList(guestEntries);
+                deleteList(sharedFilenames, 1);
+                deleteList(attachedFilenames, 1);
+                deleteRegionList(sharedRegions);
+                return -1;
+            }
+            nextShmAddr += ((SharedRegion *)sharedRegions->data)->size;
+            shmSet = 2;
+        }
         else
         {
             printf("Error: bad command line arguments\n");
-            deleteList(guestFilenames, 1);
+            deleteEntryList(guestEntries);
+            deleteList(sharedFilenames, 1);
+            deleteList(attachedFilenames, 1);
+            deleteRegionList(sharedRegions);
+            return -1;
+        }
+    }
+    if (memorySet == 1 || pageSet == 1 || guestSet == 1 || sharedSet == 1 || shmSet == 1 || durabilitySet == 1 || scratchSet == 1 || manifestSet == 1 || policySet == 1 || recordSet == 1 || placementSet == 1 || profileSet == 1 || attachSet == 1 || hugeSet == 1 || checkpointSet == 1 || restoreSet == 1 || migrationSet == 1 || incomingSet == 1 || ioLimitSet == 1 || ioShareSet == 1 || workDirSet == 1 ||
+        (manifestSet == 0 && guestSet < 2))
+    {
+        printf("Bad command line arguments\n");
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        return -1;
+    }
+    if ((checkpointSet == 2 || restoreSet == 2 || migrationSet == 2 || incomingSet == 2) && scratchLimit > 0)
+    {
+        printf("Error: guests with scratch store can't be checkpointed or migrated\n");
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        return -1;
+    }
+    // both would read KVM_GET_DIRTY_LOG, which clears it, so each would miss pages the other took
+    if (checkpointSet == 2 && migrationSet == 2)
+    {
+        printf("Error: guests can't be both checkpointed and migrated out\n");
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        return -1;
+    }
+    if (restoreSet == 2 && incomingSet == 2)
+    {
+        printf("Error: guests can't be both restored and migrated in\n");
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        return -1;
+    }
+    if (workDir && (strlen(workDir) > MAX_PATH_LENGTH || (mkdir(workDir, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)))
+    {
+        printf("Error: cannot create work directory '%s'\n", workDir);
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        return -1;
+    }
+    if (manifestSet == 2 && parseManifest(manifestPath, &manifestEntries, &manifestCount) != 0)
+    {
+        deleteEntryList(guestEntries);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        deleteEntryList(manifestEntries);
+        return -1;
+    }
+    // from here on list of manifest entries holds all guests, guests from --guest first
+    if (guestEntries)
+    {
+        for (temp = guestEntries; temp->next; temp = temp->next)
+            ;
+        temp->next = manifestEntries;
+        manifestEntries = guestEntries;
+        guestEntries = NULL;
+    }
+    for (temp = manifestEntries; temp; temp = temp->next)
+    {
+        GuestEntry *entry = (GuestEntry *)temp->data;
+        if ((entry->memorySize == 0 && memorySet < 2) || (entry->pageSize == 0 && pageSet < 2))
+        {
+            printf("Error: memory or page size of guest '%s' is not specified\n", entry->image);
+            deleteEntryList(guestEntries);
             deleteList(sharedFilenames, 1);
+            deleteList(attachedFilenames, 1);
+            deleteRegionList(sharedRegions);
+            deleteEntryList(manifestEntries);
             return -1;
         }
     }
-    if (memorySet < 2 || pageSet < 2 || guestSet < 2 || sharedSet == 1)
+    int totalCount = guestCount + manifestCount;
+    if (totalCount == 0)
     {
         printf("Bad command line arguments\n");
-        deleteList(guestFilenames, 1);
         deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        deleteEntryList(manifestEntries);
         return -1;
     }
-    GuestSettings *settingsArr = (GuestSettings *)malloc(guestCount * sizeof(GuestSettings));
+    GuestSettings *settingsArr = (GuestSettings *)calloc(totalCount, sizeof(GuestSettings));
     if (settingsArr == NULL)
     {
         printf("Error: malloc failed\n");
-        deleteList(guestFilenames, 1);
+        deleteEntryList(guestEntries);
         deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        deleteEntryList(manifestEntries);
         return -1;
     }
-    temp = guestFilenames;
-    for (int i = 0; i < guestCount; i++)
+    LLNode *entryNode = manifestEntries;
+    int streamsOpened = 1;
+    for (int i = 0; i < totalCount; i++)
     {
-        settingsArr[i].memorySize = memorySize;
-        settingsArr[i].pageSize = pageSize;
-        settingsArr[i].guestFile = temp->data;
+        GuestEntry *entry = (GuestEntry *)entryNode->data;
+        entryNode = entryNode->next;
+        settingsArr[i].guestFile = entry->image;
+        entry->image = NULL;
+        settingsArr[i].memorySize = (entry->memorySize) ? entry->memorySize : memorySize;
+        settingsArr[i].pageSize = (entry->pageSize) ? entry->pageSize : pageSize;
+        settingsArr[i].cpu = entry->cpu;
+        settingsArr[i].memoryPolicy = (entry->memoryPolicy >= 0) ? entry->memoryPolicy : memoryPolicy;
+        settingsArr[i].backing = backing;
+        settingsArr[i].hugetlbfsPath = hugetlbfsPath;
+        settingsArr[i].vm.vm_fd = -1;
+        settingsArr[i].vm.vcpu_fd = -1;
         settingsArr[i].kvmFd = kvmFd;
         settingsArr[i].id = i;
-        settingsArr[i].sharedFileCount = sharedCount;
-        settingsArr[i].sharedFiles = sharedFilenames;
-        settingsArr[i].nextGuestFd = 0;
-        temp = temp->next;
+        settingsArr[i].sharedFileCount = (entry->filesSet) ? entry->sharedFileCount : sharedCount;
+        settingsArr[i].sharedFiles = (entry->filesSet) ? entry->sharedFiles : sharedFilenames;
+        settingsArr[i].sharedRegions = sharedRegions;
+        settingsArr[i].attachedFiles = attachedFilenames;
+        settingsArr[i].durability = durability;
+        settingsArr[i].scratchLimit = scratchLimit;
+        settingsArr[i].scratchExport = scratchExport;
+        settingsArr[i].recordPrefix = recordPrefix;
+        settingsArr[i].ioLimit = (entry->ioLimit.bytesPerSecond || entry->ioLimit.opsPerSecond) ? entry->ioLimit : ioLimit;
+        settingsArr[i].ioWeight = (entry->ioWeight) ? entry->ioWeight : 1;
+        if (entry->directory)
+        {
+            settingsArr[i].directory = entry->directory;
+            entry->directory = NULL;
+        }
+        else if (workDir && (settingsArr[i].directory = (char *)malloc(strlen(workDir) + 16)))
+            sprintf(settingsArr[i].directory, "%s/guest%d", workDir, i);
+        if (entry->group && !(settingsArr[i].syncGroup = joinSyncGroup(entry->group)))
+            printf("{Guest %d} Error: cannot join group '%s', guest can't open sync objects\n", i, entry->group);
+        settingsArr[i].checkpointLast = -1;
+        pthread_mutex_init(&settingsArr[i].console.lock, NULL);
+        pthread_mutex_init(&settingsArr[i].kickLock, NULL);
+        pthread_mutex_init(&settingsArr[i].snapshotLock, NULL);
+        pthread_cond_init(&settingsArr[i].runStateChanged, NULL);
+        settingsArr[i].console.state = INPUT_NONE;
+        settingsArr[i].console.eventFd = eventfd(0, EFD_CLOEXEC);
+        settingsArr[i].input = openGuestStream(entry->input, "r", stdin);
+        // restored or migrated guest continues its output file, it is cut back to position guest state was saved at
+        settingsArr[i].output = (checkpointer.restoreDirectory || migration.incomingPath) ? openGuestStream(entry->output, "r+", stdout) : NULL;
+        if (!settingsArr[i].output)
+            settingsArr[i].output = openGuestStream(entry->output, "w", stdout);
+        if ((entry->input && strcmp(entry->input, "none") != 0 && !settingsArr[i].input) ||
+            (entry->output && strcmp(entry->output, "none") != 0 && !settingsArr[i].output))
+        {
+            printf("Error: cannot open input or output file of guest '%s'\n", settingsArr[i].guestFile);
+            streamsOpened = 0;
+        }
     }
-    deleteList(guestFilenames, 0);
-    pthread_t *threads = (pthread_t *)malloc(guestCount * sizeof(pthread_t));
-    if (threads == NULL)
+    pthread_t *threads = (pthread_t *)malloc(totalCount * sizeof(pthread_t));
+    char *running = (char *)calloc(totalCount, sizeof(char));
+    if (!streamsOpened || threads == NULL || running == NULL)
     {
-        printf("Error: malloc failed\n");
-        for (int i = 0; i < guestCount; i++)
-            free(settingsArr[i].guestFile);
-        free(settingsArr);
-
+        if (streamsOpened)
+            printf("Error: malloc failed\n");
+        deleteSettings(settingsArr, totalCount);
+        free(threads);
+        free(running);
+        deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        deleteEntryList(manifestEntries);
+        return -1;
+    }
+    CpuTopology topology;
+    loadTopology(&topology);
+    placeGuests(settingsArr, totalCount, placement, &placementList, &topology);
+    if (placement != PLACEMENT_NONE)
+    {
+        char nodeUsed[CPU_SETSIZE] = {0};
+        int nodeCount = 0;
+        for (int i = 0; i < totalCount; i++)
+        {
+            if (settingsArr[i].node >= 0 && !nodeUsed[settingsArr[i].node])
+            {
+                nodeUsed[settingsArr[i].node] = 1;
+                nodeCount++;
+            }
+        }
+        printf("Placement: %d guest(s) pinned across %d NUMA node(s) of %d\n", totalCount, nodeCount, topology.nodeCount);
+    }
+    if (isolate)
+        isolateHousekeeping(settingsArr, totalCount, &topology);
+    inputQueue.capacity = totalCount;
+    inputQueue.requests = (GuestSettings **)malloc(totalCount * sizeof(GuestSettings *));
+    inputQueue.wakeFd = eventfd(0, EFD_CLOEXEC);
+    setvbuf(stdin, NULL, _IONBF, 0);
+    pthread_t inputThreadId;
+    if (inputQueue.requests == NULL || inputQueue.wakeFd < 0 || pthread_create(&inputThreadId, NULL, &inputThread, NULL) != 0)
+    {
+        printf("Error: failed to start input thread\n");
+        deleteSettings(settingsArr, totalCount);
+        free(threads);
+        free(running);
+        free(inputQueue.requests);
+        if (inputQueue.wakeFd >= 0)
+            close(inputQueue.wakeFd);
         deleteList(sharedFilenames, 1);
+        deleteList(attachedFilenames, 1);
+        deleteRegionList(sharedRegions);
+        deleteEntryList(manifestEntries);
         return -1;
     }
-    for (int i = 0; i < guestCount; i++)
+    if (durability == DURABILITY_PERIODIC && startFileSyncer(syncInterval) != 0)
+    {
+        printf("Error: failed to start syncer thread\n");
+        durability = DURABILITY_CLOSE;
+        for (int i = 0; i < totalCount; i++)
+            settingsArr[i].durability = durability;
+    }
+
+    // VMs are created and images loaded by worker pool, guest threads are then released together
+    struct timespec launchStart, launchEnd;
+    clock_gettime(CLOCK_MONOTONIC, &launchStart);
+    prepareQueue.guests = settingsArr;
+    prepareQueue.count = totalCount;
+    if (profiler.rate > 0 || checkpointer.directory || migration.path)
     {
-        pthread_create(&threads[i], NULL, &runGuest, &settingsArr[i]);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &kickHandler;
+        action.sa_flags = SA_RESTART; // only KVM_RUN should be interrupted by kicks
+        sigaction(SIGUSR1, &action, NULL);
+        int syncRegs = ioctl(kvmFd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+        profiler.syncRegs = (syncRegs > 0 && (syncRegs & KVM_SYNC_X86_REGS) != 0);
+        profiler.guests = settingsArr;
+        profiler.count = totalCount;
+        checkpointer.guests = settingsArr;
+        checkpointer.count = totalCount;
+        migration.guests = settingsArr;
+        migration.count = totalCount;
     }
-    for (int i = 0; i < guestCount; i++)
+    // VM setup mostly waits inside kernel (memslot updates), so pool is larger than number of cpus
+    long workerCount = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (workerCount < MIN_PREPARE_WORKERS)
+        workerCount = MIN_PREPARE_WORKERS;
+    if (workerCount > totalCount)
+        workerCount = totalCount;
+    int workersStarted = 0;
+    for (int i = 0; i < workerCount; i++)
     {
+        if (pthread_create(&threads[workersStarted], NULL, &prepareWorker, NULL) == 0)
+            workersStarted++;
+    }
+    if (workersStarted == 0)
+        prepareWorker(NULL);
+    for (int i = 0; i < workersStarted; i++)
         pthread_join(threads[i], NULL);
-        free(settingsArr[i].guestFile);
+    if (migration.incomingPath)
+    {
+        // guest starts as soon as it is taken over, while next one is still being sent
+        pthread_mutex_lock(&startGate.lock);
+        startGate.isOpen = 1;
+        pthread_mutex_unlock(&startGate.lock);
+        if (connectIncoming(settingsArr, totalCount) != 0)
+            printf("Error: cannot get guests from '%s'\n", migration.incomingPath);
     }
-    free(settingsArr);
+    if (migration.path && (migration.listenFd = openMigrationSocket(migration.path, 1)) < 0)
+    {
+        printf("Error: cannot listen for migration at '%s', guests can't be migrated\n", migration.path);
+        migration.path = NULL;
+    }
+    // every guest runs until its thread leaves channels, so none of them misses guests that start later
+    atomic_store(&msgLiveGuests, totalCount);
+    for (int i = 0; i < totalCount; i++)
+    {
+        if (migration.incomingPath)
+            takeIncomingGuest(&settingsArr[i]);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (settingsArr[i].cpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(settingsArr[i].cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        running[i] = (pthread_create(&threads[i], &attr, &runGuest, &settingsArr[i]) == 0);
+        if (!running[i] && settingsArr[i].cpu >= 0)
+        {
+            printf("{Guest %d} Warning: cannot pin guest to cpu %d\n", i, settingsArr[i].cpu);
+            running[i] = (pthread_create(&threads[i], NULL, &runGuest, &settingsArr[i]) == 0);
+        }
+        if (!running[i])
+        {
+            printf("{Guest %d} Error: failed to start guest thread\n", i);
+            leaveChannels();
+            leaveSyncGroup(settingsArr[i].syncGroup);
+            settingsArr[i].syncGroup = NULL;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_lock(&startGate.lock);
+    startGate.isOpen = 1;
+    pthread_cond_broadcast(&startGate.opened);
+    pthread_mutex_unlock(&startGate.lock);
+    if (migration.incomingPath)
+        closeIncoming();
+    clock_gettime(CLOCK_MONOTONIC, &launchEnd);
+    printf("Initialized %d guest(s) in %.1f ms\n", totalCount,
+           (launchEnd.tv_sec - launchStart.tv_sec) * 1000.0 + (launchEnd.tv_nsec - launchStart.tv_nsec) / 1000000.0);
+    if (profiler.rate > 0 && pthread_create(&profiler.thread, NULL, &samplerThread, NULL) != 0)
+    {
+        printf("Error: failed to start sampler thread, guests are not profiled\n");
+        profiler.rate = 0;
+    }
+    if (checkpointer.directory && pthread_create(&checkpointer.thread, NULL, &checkpointThread, NULL) != 0)
+    {
+        printf("Error: failed to start checkpoint thread, guests are not checkpointed\n");
+        checkpointer.directory = NULL;
+    }
+    if (migration.path && pthread_create(&migration.thread, NULL, &migrationThread, NULL) != 0)
+    {
+        printf("Error: failed to start migration thread, guests can't be migrated\n");
+        close(migration.listenFd);
+        unlink(migration.path);
+        migration.path = NULL;
+    }
+
+    size_t totalResident = 0;
+    for (int i = 0; i < totalCount; i++)
+    {
+        if (running[i])
+            pthread_join(threads[i], NULL);
+        totalResident += settingsArr[i].residentSize;
+    }
+    printf("Resident guest memory: %zu KB in total\n", totalResident / 1024);
+    if (profiler.rate > 0)
+    {
+        atomic_store(&profiler.stop, 1);
+        pthread_join(profiler.thread, NULL);
+    }
+    if (checkpointer.directory)
+    {
+        atomic_store(&checkpointer.stop, 1);
+        pthread_join(checkpointer.thread, NULL);
+    }
+    if (migration.path)
+    {
+        atomic_store(&migration.stop, 1);
+        pthread_join(migration.thread, NULL);
+        close(migration.listenFd);
+        unlink(migration.path);
+    }
+    if (durability == DURABILITY_PERIODIC)
+    {
+        stopFileSyncer();
+    }
+    FdCacheStats fdCacheStats;
+    getFdCacheStats(&fdCacheStats);
+    if (fdCacheStats.hits + fdCacheStats.misses > 0)
+        printf("Host fd cache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)fdCacheStats.hits,
+               (unsigned long long)fdCacheStats.misses, (unsigned long long)fdCacheStats.evictions);
+    closeFdCache();
+    // input thread uses console eventfds of guests
+    stopInputThread(inputThreadId);
+    deleteSettings(settingsArr, totalCount);
     free(threads);
+    free(running);
     deleteList(sharedFilenames, 1);
+    deleteList(attachedFilenames, 1);
+    deleteRegionList(sharedRegions);
+    deleteEntryList(manifestEntries);
+    deleteGuestImages();
     printf("\nProgram successfully closed\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "profiler.h"
+
+typedef struct
+{
+    uint64_t addr;
+    char *name;
+} Symbol;
+
+struct SymbolTable
+{
+    Symbol *symbols; // sorted by address
+    int count;
+    char *names;     // string table all names point into
+};
+
+typedef struct
+{
+    uint64_t hash;
+    long count;
+    int depth;
+    uint64_t pcs[PROFILE_MAX_DEPTH]; // pcs[0] - sampled rip, then return addresses of callers
+} StackEntry;
+
+struct GuestProfile
+{
+    SymbolTable *symbols; // NULL - addresses are written instead of names
+    StackEntry *stacks[PROFILE_MAX_STACKS];
+    int stackCount;
+    long sampleCount;
+    long droppedCount; // samples whose stack didn't fit in table
+};
+
+static int compareSymbols(const void *a, const void *b)
+{
+    uint64_t x = ((Symbol *)a)->addr, y = ((Symbol *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+static char *readWholeFile(char *path, size_t *size)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+    char *data = NULL;
+    long length = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+    if (length > 0 && fseek(file, 0, SEEK_SET) == 0 && (data = (char *)malloc(length)) != NULL)
+    {
+        if (fread(data, 1, length, file) != (size_t)length)
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    *size = (size_t)length;
+    return data;
+}
+
+// Functions and code labels from .symtab of ELF64 file, NULL if file is missing or has no symbols
+SymbolTable *loadSymbols(char *elfPath)
+{
+    size_t size = 0;
+    char *data = readWholeFile(elfPath, &size);
+    if (!data)
+        return NULL;
+    Elf64_Ehdr *header = (Elf64_Ehdr *)data;
+    if (size < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_shoff + (uint64_t)header->e_shnum * sizeof(Elf64_Shdr) > size)
+    {
+        free(data);
+        return NULL;
+    }
+    Elf64_Shdr *sections = (Elf64_Shdr *)(data + header->e_shoff);
+    SymbolTable *table = NULL;
+    for (int i = 0; i < header->e_shnum && !table; i++)
+    {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= header->e_shnum)
+            continue;
+        Elf64_Shdr *strings = &sections[sections[i].sh_link];
+        if (sections[i].sh_offset + sections[i].sh_size > size || strings->sh_offset + strings->sh_size > size || strings->sh_size == 0)
+            break;
+        Elf64_Sym *elfSymbols = (Elf64_Sym *)(data + sections[i].sh_offset);
+        int elfCount = sections[i].sh_size / sizeof(Elf64_Sym);
+        table = (SymbolTable *)calloc(1, sizeof(SymbolTable));
+        if (!table || !(table->symbols = (Symbol *)malloc(elfCount * sizeof(Symbol))) || !(table->names = (char *)malloc(strings->sh_size)))
+        {
+            deleteSymbols(table);
+            table = NULL;
+            break;
+        }
+        memcpy(table->names, data + strings->sh_offset, strings->sh_size);
+        table->names[strings->sh_size - 1] = '\0';
+        for (int j = 0; j < elfCount; j++)
+        {
+            int type = ELF64_ST_TYPE(elfSymbols[j].st_info);
+            if ((type != STT_FUNC && type != STT_NOTYPE) || elfSymbols[j].st_shndx == SHN_UNDEF ||
+                elfSymbols[j].st_shndx >= SHN_LORESERVE || elfSymbols[j].st_name == 0 || elfSymbols[j].st_name >= strings->sh_size)
+                continue;
+            table->symbols[table->count].addr = elfSymbols[j].st_value;
+            table->symbols[table->count].name = table->names + elfSymbols[j].st_name;
+            table->count++;
+        }
+        qsort(table->symbols, table->count, sizeof(Symbol), &compareSymbols);
+    }
+    free(data);
+    if (table && table->count == 0)
+    {
+        deleteSymbols(table);
+        table = NULL;
+    }
+    return table;
+}
+
+void deleteSymbols(SymbolTable *symbols)
+{
+    if (!symbols)
+        return;
+    free(symbols->symbols);
+    free(symbols->names);
+    free(symbols);
+}
+
+// Index of symbol containing addr (last symbol at or below it), -1 if there is none
+static int findSymbol(SymbolTable *symbols, uint64_t addr)
+{
+    if (!symbols)
+        return -1;
+    int low = 0, high = symbols->count - 1, found = -1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (symbols->symbols[mid].addr <= addr)
+        {
+            found = mid;
+            low = mid + 1;
+        }
+        else
+            high = mid - 1;
+    }
+    return found;
+}
+
+GuestProfile *createProfile(SymbolTable *symbols)
+{
+    GuestProfile *profile = (GuestProfile *)calloc(1, sizeof(GuestProfile));
+    if (profile)
+        profile->symbols = symbols;
+    return profile;
+}
+
+void deleteProfile(GuestProfile *profile)
+{
+    if (!profile)
+        return;
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++)
+        free(profile->stacks[i]);
+    free(profile);
+}
+
+void profileSample(GuestProfile *profile, uint64_t rip, uint64_t rbp, char *mem, size_t memSize)
+{
+    uint64_t pcs[PROFILE_MAX_DEPTH];
+    int depth = 0;
+    pcs[depth++] = rip;
+    // guest memory is identity mapped, frame is saved rbp followed by return address
+    uint64_t frame = rbp;
+    while (depth < PROFILE_MAX_DEPTH && frame != 0 && frame % 8 == 0 && frame + 16 <= memSize)
+    {
+        uint64_t next = *(uint64_t *)(mem + frame);
+        uint64_t ret = *(uint64_t *)(mem + frame + 8);
+        if (ret == 0)
+            break;
+        pcs[depth++] = ret;
+        if (next <= frame)
+            break;
+        frame = next;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ pcs[i]) * 1099511628211ULL;
+    profile->sampleCount++;
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++)
+    {
+        StackEntry **slot = &profile->stacks[(hash + i) & (PROFILE_MAX_STACKS - 1)];
+        if (*slot == NULL)
+        {
+            // table is never filled completely, so lookups of new stacks stay short
+            if (profile->stackCount >= PROFILE_MAX_STACKS * 3 / 4 || !(*slot = (StackEntry *)malloc(sizeof(StackEntry))))
+                break;
+            (*slot)->hash = hash;
+            (*slot)->count = 1;
+            (*slot)->depth = depth;
+            memcpy((*slot)->pcs, pcs, depth * sizeof(uint64_t));
+            profile->stackCount++;
+            return;
+        }
+        if ((*slot)->hash == hash && (*slot)->depth == depth && memcmp((*slot)->pcs, pcs, depth * sizeof(uint64_t)) == 0)
+        {
+            (*slot)->count++;
+            return;
+        }
+    }
+    profile->droppedCount++;
+}
+
+long profileSampleCount(GuestProfile *profile)
+{
+    return profile->sampleCount;
+}
+
+// Return addresses point after call instruction, so caller frames are symbolized one byte earlier
+static void frameName(GuestProfile *profile, StackEntry *stack, int level, char *name, size_t size)
+{
+    uint64_t pc = stack->pcs[level] - (level > 0 ? 1 : 0);
+    int index = findSymbol(profile->symbols, pc);
+    if (index >= 0)
+        snprintf(name, size, "%s", profile->symbols->symbols[index].name);
+    else
+        snprintf(name, size, "0x%llx", (unsigned long long)pc);
+}
+
+typedef struct
+{
+    char name[128];
+    long self;
+    long total;
+} FlatEntry;
+
+typedef struct
+{
+    char *line;
+    long count;
+} FoldedLine;
+
+static int compareFolded(const void *a, const void *b)
+{
+    return strcmp(((const FoldedLine *)a)->line, ((const FoldedLine *)b)->line);
+}
+
+static int compareFlat(const void *a, const void *b)
+{
+    const FlatEntry *x = (const FlatEntry *)a, *y = (const FlatEntry *)b;
+    if (x->self != y->self)
+        return (y->self > x->self) - (y->self < x->self);
+    return (y->total > x->total) - (y->total < x->total);
+}
+
+// Writes flat profile to <prefix>.<id>.txt and folded stacks (flamegraph input) to <prefix>.<id>.folded
+int writeProfile(GuestProfile *profile, char *prefix, int guestId)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.folded", prefix, guestId);
+    FILE *folded = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.%d.txt", prefix, guestId);
+    FILE *flat = fopen(path, "w");
+    FlatEntry *entries = (FlatEntry *)calloc(PROFILE_MAX_STACKS * PROFILE_MAX_DEPTH, sizeof(FlatEntry));
+    FoldedLine *lines = (FoldedLine *)calloc(PROFILE_MAX_STACKS, sizeof(FoldedLine));
+    if (!folded || !flat || !entries || !lines)
+    {
+        if (folded)
+            fclose(folded);
+        if (flat)
+            fclose(flat);
+        free(entries);
+        free(lines);
+        return -1;
+    }
+
+    int entryCount = 0, lineCount = 0;
+    char name[128];
+    char line[PROFILE_MAX_DEPTH * sizeof(name)];
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++)
+    {
+        StackEntry *stack = profile->stacks[i];
+        if (!stack)
+            continue;
+        int seen[PROFILE_MAX_DEPTH]; // entry of every frame, recursion counts once in total
+        int length = 0;
+        for (int level = stack->depth - 1; level >= 0; level--)
+        {
+            frameName(profile, stack, level, name, sizeof(name));
+            length += snprintf(line + length, sizeof(line) - length, "%s%s", name, level > 0 ? ";" : "");
+            int k = 0;
+            while (k < entryCount && strcmp(entries[k].name, name) != 0)
+                k++;
+            if (k == entryCount)
+                snprintf(entries[entryCount++].name, sizeof(entries[k].name), "%s", name);
+            int counted = 0;
+            for (int j = stack->depth - 1; j > level; j--)
+                if (seen[j] == k)
+                    counted = 1;
+            if (!counted)
+                entries[k].total += stack->count;
+            if (level == 0)
+                entries[k].self += stack->count;
+            seen[level] = k;
+        }
+        // stacks with different addresses inside same functions become one folded line
+        lines[lineCount].line = strdup(line);
+        lines[lineCount].count = stack->count;
+        if (lines[lineCount].line)
+            lineCount++;
+    }
+    qsort(lines, lineCount, sizeof(FoldedLine), &compareFolded);
+    for (int i = 0; i < lineCount; i++)
+    {
+        long count = lines[i].count;
+        while (i + 1 < lineCount && strcmp(lines[i].line, lines[i + 1].line) == 0)
+        {
+            free(lines[i].line);
+            count += lines[++i].count;
+        }
+        fprintf(folded, "%s %ld\n", lines[i].line, count);
+        free(lines[i].line);
+    }
+    free(lines);
+    if (profile->droppedCount)
+        fprintf(folded, "[dropped] %ld\n", profile->droppedCount);
+
+    qsort(entries, entryCount, sizeof(FlatEntry), &compareFlat);
+    long samples = profile->sampleCount ? profile->sampleCount : 1;
+    fprintf(flat, "Guest %d: %ld samples, %d distinct stacks, %ld dropped\n", guestId, profile->sampleCount, profile->stackCount,
+            profile->droppedCount);
+    fprintf(flat, "%10s %7s %10s %7s  %s\n", "self", "self%", "total", "total%", "function");
+    for (int k = 0; k < entryCount; k++)
+        fprintf(flat, "%10ld %6.2f%% %10ld %6.2f%%  %s\n", entries[k].self, 100.0 * entries[k].self / samples, entries[k].total,
+                100.0 * entries[k].total / samples, entries[k].name);
+    fclose(folded);
+    fclose(flat);
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sampling profile of guest code. Samples are stacks unwound through frame pointers in guest memory,
+// aggregated per distinct stack and symbolized against guest's ELF file when profile is written
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_STACKS 2048 // distinct stacks kept per guest, must be power of 2
+#define PROFILE_MAX_RATE 10000  // samples per second
+
+typedef struct SymbolTable SymbolTable;
+typedef struct GuestProfile GuestProfile;
+
+SymbolTable *loadSymbols(char *elfPath);
+void deleteSymbols(SymbolTable *symbols);
+
+GuestProfile *createProfile(SymbolTable *symbols);
+void deleteProfile(GuestProfile *profile);
+void profileSample(GuestProfile *profile, uint64_t rip, uint64_t rbp, char *mem, size_t memSize);
+long profileSampleCount(GuestProfile *profile);
+int writeProfile(GuestProfile *profile, char *prefix, int guestId);
+
+#endif
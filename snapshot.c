@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+#include "snapshot.h"
+
+#define MSR_IA32_TSC 0x10
+#define VCPU_STATE_MAGIC 0x55504356
+
+typedef struct
+{
+    uint32_t magic;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_lapic_state lapic;
+    struct kvm_vcpu_events events;
+    struct kvm_mp_state mpState;
+    struct kvm_irqchip chips[3]; // master PIC, slave PIC, IOAPIC
+    uint64_t tsc;
+} VcpuState;
+
+typedef struct
+{
+    struct kvm_msrs header;
+    struct kvm_msr_entry entry;
+} TscMsr;
+
+static char zeroPage[SNAPSHOT_PAGE_SIZE];
+
+static int writePage(FILE *out, uint64_t addr, char *page)
+{
+    int zero = (memcmp(page, zeroPage, SNAPSHOT_PAGE_SIZE) == 0);
+    if (zero)
+        addr |= SNAPSHOT_ZERO_PAGE;
+    if (fwrite(&addr, sizeof(addr), 1, out) != 1)
+        return -1;
+    if (!zero && fwrite(page, SNAPSHOT_PAGE_SIZE, 1, out) != 1)
+        return -1;
+    return 0;
+}
+
+int writeDirtyPages(FILE *out, int vmFd, SnapshotRegion *regions, int count, int all, uint64_t *pageCount)
+{
+    uint64_t written = 0;
+    for (int r = 0; r < count; r++)
+    {
+        SnapshotRegion *region = &regions[r];
+        uint64_t pages = region->size / SNAPSHOT_PAGE_SIZE;
+        uint64_t words = (pages + 63) / 64; // KVM fills bitmap in 64-bit words
+        if (!region->written && !(region->written = (uint64_t *)calloc(words, sizeof(uint64_t))))
+            return -1;
+        uint64_t *dirty = (uint64_t *)calloc(words, sizeof(uint64_t));
+        if (!dirty)
+            return -1;
+        struct kvm_dirty_log log;
+        memset(&log, 0, sizeof(log));
+        log.slot = region->slot;
+        log.dirty_bitmap = dirty;
+        // fetching log also clears it, so next round has only pages written after this one
+        if (ioctl(vmFd, KVM_GET_DIRTY_LOG, &log) < 0)
+        {
+            free(dirty);
+            return -1;
+        }
+        for (uint64_t w = 0; w < words; w++)
+        {
+            region->written[w] |= dirty[w];
+            uint64_t bits = all ? region->written[w] : dirty[w];
+            while (bits)
+            {
+                uint64_t page = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (writePage(out, region->guestAddr + page * SNAPSHOT_PAGE_SIZE, region->mem + page * SNAPSHOT_PAGE_SIZE) < 0)
+                {
+                    free(dirty);
+                    return -1;
+                }
+                written++;
+            }
+        }
+        free(dirty);
+    }
+    uint64_t end = SNAPSHOT_END_OF_PAGES;
+    if (fwrite(&end, sizeof(end), 1, out) != 1)
+        return -1;
+    if (pageCount)
+        *pageCount = written;
+    return 0;
+}
+
+// Pages are copied by host, so they are marked written here, KVM never logs them
+int readPages(FILE *in, SnapshotRegion *regions, int count, uint64_t *pageCount)
+{
+    uint64_t read = 0, addr;
+    while (fread(&addr, sizeof(addr), 1, in) == 1)
+    {
+        if (addr == SNAPSHOT_END_OF_PAGES)
+        {
+            if (pageCount)
+                *pageCount = read;
+            return 0;
+        }
+        uint64_t page = addr & ~(uint64_t)(SNAPSHOT_PAGE_SIZE - 1);
+        SnapshotRegion *region = NULL;
+        for (int r = 0; r < count && !region; r++)
+            if (page >= regions[r].guestAddr && page + SNAPSHOT_PAGE_SIZE <= regions[r].guestAddr + regions[r].size)
+                region = &regions[r];
+        if (!region)
+            return -1;
+        uint64_t index = (page - region->guestAddr) / SNAPSHOT_PAGE_SIZE;
+        char *target = region->mem + index * SNAPSHOT_PAGE_SIZE;
+        if (addr & SNAPSHOT_ZERO_PAGE)
+            memset(target, 0, SNAPSHOT_PAGE_SIZE);
+        else if (fread(target, SNAPSHOT_PAGE_SIZE, 1, in) != 1)
+            return -1;
+        if (!region->written && !(region->written = (uint64_t *)calloc((region->size / SNAPSHOT_PAGE_SIZE + 63) / 64, sizeof(uint64_t))))
+            return -1;
+        region->written[index / 64] |= 1ULL << (index % 64);
+        read++;
+    }
+    return -1;
+}
+
+void releaseSnapshotRegions(SnapshotRegion *regions, int count)
+{
+    for (int r = 0; r < count; r++)
+    {
+        free(regions[r].written);
+        regions[r].written = NULL;
+    }
+}
+
+int writeVcpuState(FILE *out, int vmFd, int vcpuFd)
+{
+    VcpuState state;
+    memset(&state, 0, sizeof(state));
+    state.magic = VCPU_STATE_MAGIC;
+    TscMsr tsc;
+    memset(&tsc, 0, sizeof(tsc));
+    tsc.header.nmsrs = 1;
+    tsc.entry.index = MSR_IA32_TSC;
+    if (ioctl(vcpuFd, KVM_GET_REGS, &state.regs) < 0 || ioctl(vcpuFd, KVM_GET_SREGS, &state.sregs) < 0 ||
+        ioctl(vcpuFd, KVM_GET_FPU, &state.fpu) < 0 || ioctl(vcpuFd, KVM_GET_LAPIC, &state.lapic) < 0 ||
+        ioctl(vcpuFd, KVM_GET_VCPU_EVENTS, &state.events) < 0 || ioctl(vcpuFd, KVM_GET_MP_STATE, &state.mpState) < 0 ||
+        ioctl(vcpuFd, KVM_GET_MSRS, &tsc) != 1)
+        return -1;
+    state.tsc = tsc.entry.data;
+    for (int i = 0; i < 3; i++)
+    {
+        state.chips[i].chip_id = i;
+        if (ioctl(vmFd, KVM_GET_IRQCHIP, &state.chips[i]) < 0)
+            return -1;
+    }
+    return fwrite(&state, sizeof(state), 1, out) == 1 ? 0 : -1;
+}
+
+// Segment registers go first, they decide how the rest of state is interpreted
+int readVcpuState(FILE *in, int vmFd, int vcpuFd)
+{
+    VcpuState state;
+    if (fread(&state, sizeof(state), 1, in) != 1 || state.magic != VCPU_STATE_MAGIC)
+        return -1;
+    TscMsr tsc;
+    memset(&tsc, 0, sizeof(tsc));
+    tsc.header.nmsrs = 1;
+    tsc.entry.index = MSR_IA32_TSC;
+    tsc.entry.data = state.tsc;
+    if (ioctl(vcpuFd, KVM_SET_SREGS, &state.sregs) < 0 || ioctl(vcpuFd, KVM_SET_REGS, &state.regs) < 0 ||
+        ioctl(vcpuFd, KVM_SET_FPU, &state.fpu) < 0 || ioctl(vcpuFd, KVM_SET_LAPIC, &state.lapic) < 0)
+        return -1;
+    for (int i = 0; i < 3; i++)
+        if (ioctl(vmFd, KVM_SET_IRQCHIP, &state.chips[i]) < 0)
+            return -1;
+    if (ioctl(vcpuFd, KVM_SET_VCPU_EVENTS, &state.events) < 0 || ioctl(vcpuFd, KVM_SET_MP_STATE, &state.mpState) < 0 ||
+        ioctl(vcpuFd, KVM_SET_MSRS, &tsc) != 1)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Guest state as stream of records: memory pages tracked with KVM dirty page logging, followed by vCPU state.
+// Same stream is written to checkpoint files and sent to another hypervisor during live migration
+
+#define SNAPSHOT_PAGE_SIZE 4096
+#define SNAPSHOT_END_OF_PAGES UINT64_MAX
+#define SNAPSHOT_ZERO_PAGE 1 // set in address of page record that has no data, page is all zeroes
+
+// Writable memory slot of guest, registered with KVM_MEM_LOG_DIRTY_PAGES before guest first runs. Pages hypervisor
+// writes itself (image, page tables) are not logged, they are recreated by loading the same guest again
+typedef struct
+{
+    int slot;
+    uint64_t guestAddr;
+    uint64_t size;
+    char *mem;
+    uint64_t *written; // pages written since slot was created, NULL until first round
+} SnapshotRegion;
+
+// Writes pages written since previous round, or all pages ever written when all is set
+int writeDirtyPages(FILE *out, int vmFd, SnapshotRegion *regions, int count, int all, uint64_t *pageCount);
+int readPages(FILE *in, SnapshotRegion *regions, int count, uint64_t *pageCount);
+void releaseSnapshotRegions(SnapshotRegion *regions, int count);
+int writeVcpuState(FILE *out, int vmFd, int vcpuFd);
+int readVcpuState(FILE *in, int vmFd, int vcpuFd);
+
+#endif
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "sync_device.h"
+
+#define SYNC_REQUEST_SIZE 9 // operation, id and value
+#define SYNC_ERROR UINT64_MAX
+
+#define SSTATE_NONE 0
+#define SSTATE_ARGS 1 // id and value, or type and initial value of SYNC_OPEN
+#define SSTATE_NAME 2
+
+typedef struct
+{
+    char name[SYNC_NAME_LENGTH + 1];
+    int type;
+    uint32_t value;      // semaphore count or event flags
+    int arrived;         // members waiting at barrier
+    uint64_t generation; // barrier round, waiters leave once it changes
+    pthread_cond_t changed;
+} SyncObject;
+
+// All objects of group are protected by its lock, waiters sleep on condition variable of their object
+struct SyncGroup
+{
+    char name[SYNC_NAME_LENGTH + 1];
+    pthread_mutex_t lock;
+    int members;
+    SyncObject *objects[SYNC_MAX_OBJECTS];
+    int objectCount;
+    SyncDevice *waiting; // devices of members sleeping in a wait
+    SyncGroup *next;
+};
+
+struct SyncDevice
+{
+    int guestId;
+    SyncGroup *group;
+    volatile uint8_t *kickPending;
+    uint64_t waits;  // requests that had to wait, not counting repeated ones
+    uint64_t waitNs; // time guest spent waiting
+    // wait in progress, guarded by group lock
+    SyncObject *waitingOn;
+    uint32_t waitValue;      // event flags waited for
+    uint64_t waitGeneration; // barrier round waited for
+    char stuck;              // every member waits, so nobody can end this wait
+    char interrupted;        // last request was interrupted, guest repeats it
+    SyncDevice *nextWaiting;
+    // barrier arrival kept while interrupted wait is repeated
+    SyncObject *pendingBarrier;
+    uint64_t pendingGeneration;
+    // state of request in progress
+    int state;
+    uint8_t request[SYNC_REQUEST_SIZE];
+    int requestBytes;
+    char name[SYNC_NAME_LENGTH + 1];
+    int nameLength; // SYNC_NAME_LENGTH + 1 once name is too long
+    uint8_t reply[8];
+    int replyBytes;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    SyncGroup *groups;
+} registry = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static uint64_t nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+SyncGroup *joinSyncGroup(char *name)
+{
+    if (strlen(name) > SYNC_NAME_LENGTH)
+        return NULL;
+    pthread_mutex_lock(&registry.lock);
+    SyncGroup *group = registry.groups;
+    while (group && strcmp(group->name, name) != 0)
+        group = group->next;
+    if (!group && (group = (SyncGroup *)calloc(1, sizeof(SyncGroup))))
+    {
+        strcpy(group->name, name);
+        pthread_mutex_init(&group->lock, NULL);
+        group->next = registry.groups;
+        registry.groups = group;
+    }
+    if (group)
+    {
+        pthread_mutex_lock(&group->lock);
+        group->members++;
+        pthread_mutex_unlock(&group->lock);
+    }
+    pthread_mutex_unlock(&registry.lock);
+    return group;
+}
+
+// Last member to arrive starts next round of barrier, caller holds group lock
+static void releaseBarrier(SyncObject *object)
+{
+    object->arrived = 0;
+    object->generation++;
+    pthread_cond_broadcast(&object->changed);
+}
+
+// Caller holds group lock
+static int waitSatisfied(SyncDevice *device)
+{
+    SyncObject *object = device->waitingOn;
+    if (object->type == SYNC_TYPE_BARRIER)
+        return object->generation != device->waitGeneration;
+    if (object->type == SYNC_TYPE_SEMAPHORE)
+        return object->value > 0;
+    return (object->value & device->waitValue) == device->waitValue;
+}
+
+// Only members can release objects, so once every remaining member waits for something that isn't there,
+// their waits fail instead of hanging guests and the final join. Caller holds group lock
+static void failStuckWaiters(SyncGroup *group)
+{
+    int stuck = 0;
+    for (SyncDevice *device = group->waiting; device; device = device->nextWaiting)
+        stuck += !waitSatisfied(device);
+    if (stuck == 0 || stuck < group->members)
+        return;
+    for (SyncDevice *device = group->waiting; device; device = device->nextWaiting)
+        device->stuck = 1;
+    for (int i = 0; i < group->objectCount; i++)
+        pthread_cond_broadcast(&group->objects[i]->changed);
+}
+
+void leaveSyncGroup(SyncGroup *group)
+{
+    if (!group)
+        return;
+    pthread_mutex_lock(&group->lock);
+    group->members--;
+    for (int i = 0; i < group->objectCount; i++)
+    {
+        SyncObject *object = group->objects[i];
+        if (object->type == SYNC_TYPE_BARRIER && object->arrived > 0 && object->arrived >= group->members)
+            releaseBarrier(object);
+    }
+    failStuckWaiters(group);
+    pthread_mutex_unlock(&group->lock);
+}
+
+void deleteSyncGroups()
+{
+    pthread_mutex_lock(&registry.lock);
+    while (registry.groups)
+    {
+        SyncGroup *group = registry.groups;
+        registry.groups = group->next;
+        for (int i = 0; i < group->objectCount; i++)
+        {
+            pthread_cond_destroy(&group->objects[i]->changed);
+            free(group->objects[i]);
+        }
+        pthread_mutex_destroy(&group->lock);
+        free(group);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+SyncDevice *createSyncDevice(int guestId, SyncGroup *group, volatile uint8_t *kickPending)
+{
+    SyncDevice *device = (SyncDevice *)calloc(1, sizeof(SyncDevice));
+    if (!device)
+        return NULL;
+    device->guestId = guestId;
+    device->group = group;
+    device->kickPending = kickPending;
+    // guest restored or migrated in the middle of a wait reads reply of new device, so it repeats the request
+    for (int i = 0; i < 8; i++)
+        device->reply[i] = (uint8_t)(SYNC_INTERRUPTED >> (56 - 8 * i));
+    device->replyBytes = 8;
+    return device;
+}
+
+// Guest that doesn't come back to barrier it left on interrupt no longer counts as arrived. Caller holds group lock
+static void cancelPendingBarrier(SyncDevice *device)
+{
+    SyncObject *object = device->pendingBarrier;
+    if (object && object->generation == device->pendingGeneration)
+        object->arrived--;
+    device->pendingBarrier = NULL;
+}
+
+void deleteSyncDevice(SyncDevice *device)
+{
+    if (!device)
+        return;
+    if (device->group)
+    {
+        pthread_mutex_lock(&device->group->lock);
+        cancelPendingBarrier(device);
+        pthread_mutex_unlock(&device->group->lock);
+    }
+    if (device->waits > 0)
+        printf("{Guest %d} Sync: waited %llu times for %.1f ms in group '%s'\n", device->guestId,
+               (unsigned long long)device->waits, device->waitNs / 1000000.0, device->group->name);
+    free(device);
+}
+
+static uint32_t getBigEndian32(uint8_t *bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+// Objects are never removed, so id stays valid for the whole run. Object of same name and other type is an error
+static uint64_t openObject(SyncDevice *device, int type, uint32_t value)
+{
+    SyncGroup *group = device->group;
+    if (!group)
+    {
+        printf("{Guest %d} Sync device error - guest is not in any group\n", device->guestId);
+        return SYNC_ERROR;
+    }
+    if (device->nameLength == 0 || device->nameLength > SYNC_NAME_LENGTH || type < SYNC_TYPE_BARRIER || type > SYNC_TYPE_EVENT)
+        return SYNC_ERROR;
+    uint64_t result = SYNC_ERROR;
+    pthread_mutex_lock(&group->lock);
+    int id = 0;
+    while (id < group->objectCount && strcmp(group->objects[id]->name, device->name) != 0)
+        id++;
+    if (id < group->objectCount)
+        result = (group->objects[id]->type == type) ? (uint64_t)id : SYNC_ERROR;
+    else if (id < SYNC_MAX_OBJECTS && (group->objects[id] = (SyncObject *)calloc(1, sizeof(SyncObject))))
+    {
+        SyncObject *object = group->objects[id];
+        strcpy(object->name, device->name);
+        object->type = type;
+        object->value = value;
+        pthread_cond_init(&object->changed, NULL);
+        group->objectCount++;
+        result = (uint64_t)id;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
+
+static void startWait(SyncDevice *device, uint64_t *start)
+{
+    if (*start == 0)
+    {
+        *start = nowNs();
+        device->waits += !device->interrupted;
+    }
+}
+
+// Sleeps with group lock released until object is ready. Returns 0, SYNC_ERROR when no member can make it ready or
+// SYNC_INTERRUPTED when host kicked guest thread. Caller holds group lock
+static uint64_t waitForObject(SyncDevice *device, SyncObject *object, uint32_t value, uint64_t generation, uint64_t *start)
+{
+    SyncGroup *group = device->group;
+    device->waitingOn = object;
+    device->waitValue = value;
+    device->waitGeneration = generation;
+    if (waitSatisfied(device))
+    {
+        device->waitingOn = NULL;
+        return 0;
+    }
+    device->stuck = 0;
+    device->nextWaiting = group->waiting;
+    group->waiting = device;
+    failStuckWaiters(group);
+    uint64_t result = 0;
+    while (!waitSatisfied(device))
+    {
+        if (device->stuck || *device->kickPending)
+        {
+            result = device->stuck ? SYNC_ERROR : SYNC_INTERRUPTED;
+            break;
+        }
+        startWait(device, start);
+        pthread_cond_wait(&object->changed, &group->lock);
+    }
+    SyncDevice **link = &group->waiting;
+    while (*link != device)
+        link = &(*link)->nextWaiting;
+    *link = device->nextWaiting;
+    device->waitingOn = NULL;
+    return result;
+}
+
+void interruptSyncDevice(SyncDevice *device)
+{
+    if (!device || !device->group)
+        return;
+    pthread_mutex_lock(&device->group->lock);
+    if (device->waitingOn)
+        pthread_cond_broadcast(&device->waitingOn->changed);
+    pthread_mutex_unlock(&device->group->lock);
+}
+
+// Serves request on object, waits with group lock released while object isn't ready
+static uint64_t useObject(SyncDevice *device, int op, uint32_t id, uint32_t value)
+{
+    SyncGroup *group = device->group;
+    if (!group || id >= (uint32_t)SYNC_MAX_OBJECTS)
+        return SYNC_ERROR;
+    uint64_t result = SYNC_ERROR;
+    uint64_t start = 0;
+    pthread_mutex_lock(&group->lock);
+    SyncObject *object = (id < (uint32_t)group->objectCount) ? group->objects[id] : NULL;
+    if (!object)
+    {
+        pthread_mutex_unlock(&group->lock);
+        return SYNC_ERROR;
+    }
+    if (device->pendingBarrier != object || op != SYNC_BARRIER)
+        cancelPendingBarrier(device);
+    if (op == SYNC_BARRIER && object->type == SYNC_TYPE_BARRIER)
+    {
+        // repeated request after interrupt waits for round guest already arrived at
+        uint64_t generation = device->pendingBarrier ? device->pendingGeneration : object->generation;
+        if (!device->pendingBarrier && ++object->arrived >= group->members)
+            releaseBarrier(object);
+        device->pendingBarrier = NULL;
+        result = waitForObject(device, object, 0, generation, &start);
+        if (result == SYNC_INTERRUPTED)
+        {
+            device->pendingBarrier = object;
+            device->pendingGeneration = generation;
+        }
+        else if (result == SYNC_ERROR)
+            object->arrived--;
+    }
+    else if (op == SYNC_SEM_WAIT && object->type == SYNC_TYPE_SEMAPHORE)
+    {
+        result = waitForObject(device, object, 0, 0, &start);
+        if (result == 0)
+            object->value--;
+    }
+    else if (op == SYNC_SEM_POST && object->type == SYNC_TYPE_SEMAPHORE)
+    {
+        object->value += value;
+        // one waiter per posted unit
+        if (value == 1)
+            pthread_cond_signal(&object->changed);
+        else if (value > 1)
+            pthread_cond_broadcast(&object->changed);
+        result = object->value;
+    }
+    else if ((op == SYNC_EVENT_SET || op == SYNC_EVENT_CLEAR) && object->type == SYNC_TYPE_EVENT)
+    {
+        object->value = (op == SYNC_EVENT_SET) ? (object->value | value) : (object->value & ~value);
+        if (op == SYNC_EVENT_SET && value != 0)
+            pthread_cond_broadcast(&object->changed);
+        result = object->value;
+    }
+    else if (op == SYNC_EVENT_WAIT && object->type == SYNC_TYPE_EVENT)
+    {
+        result = waitForObject(device, object, value, 0, &start);
+        if (result == 0)
+            result = object->value;
+    }
+    device->interrupted = (result == SYNC_INTERRUPTED);
+    pthread_mutex_unlock(&group->lock);
+    if (start)
+        device->waitNs += nowNs() - start;
+    return result;
+}
+
+static void setReply(SyncDevice *device, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        device->reply[i] = (uint8_t)(value >> (56 - 8 * i));
+    device->replyBytes = 8;
+    device->requestBytes = 0;
+    device->state = SSTATE_NONE;
+}
+
+static void syncDeviceOutByte(SyncDevice *device, uint8_t c)
+{
+    switch (device->state)
+    {
+    case SSTATE_NONE:
+        device->replyBytes = 0;
+        if (c < SYNC_OPEN || c > SYNC_EVENT_WAIT)
+        {
+            printf("{Guest %d} Sync device error - undefined operation code\n", device->guestId);
+            break;
+        }
+        device->request[0] = c;
+        device->requestBytes = 1;
+        device->state = SSTATE_ARGS;
+        break;
+    case SSTATE_ARGS:
+        device->request[device->requestBytes++] = c;
+        if (device->request[0] == SYNC_OPEN && device->requestBytes == 6)
+        {
+            device->nameLength = 0;
+            device->state = SSTATE_NAME;
+        }
+        else if (device->requestBytes == SYNC_REQUEST_SIZE)
+            setReply(device, useObject(device, device->request[0], getBigEndian32(device->request + 1), getBigEndian32(device->request + 5)));
+        break;
+    case SSTATE_NAME:
+        if (c == '\0')
+        {
+            device->name[(device->nameLength <= SYNC_NAME_LENGTH) ? device->nameLength : SYNC_NAME_LENGTH] = '\0';
+            setReply(device, openObject(device, device->request[1], getBigEndian32(device->request + 2)));
+        }
+        else
+        {
+            if (device->nameLength < SYNC_NAME_LENGTH)
+                device->name[device->nameLength] = (char)c;
+            if (device->nameLength <= SYNC_NAME_LENGTH)
+                device->nameLength++;
+        }
+        break;
+    }
+}
+
+void syncDeviceOut(SyncDevice *device, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        syncDeviceOutByte(device, data[i]);
+}
+
+void syncDeviceIn(SyncDevice *device, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        data[i] = (device->replyBytes > 0) ? device->reply[8 - device->replyBytes--] : 0;
+}
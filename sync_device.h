@@ -0,0 +1,49 @@
+#ifndef SYNC_DEVICE_H
+#define SYNC_DEVICE_H
+
+#include <stdint.h>
+
+// Synchronization of guests in a group declared at launch: named barriers, counting semaphores and event flags.
+// Guest thread waiting on an object sleeps on condition variable in hypervisor until another guest releases it
+
+#define PORT_SYNC 0x0283
+
+#define SYNC_OPEN 0x1        // 1 byte type, 4 byte initial value and name terminated with '\0' follow, reply is object id
+#define SYNC_BARRIER 0x2     // 4 byte id and 4 byte value (ignored) follow, reply is 0 once every member arrived
+#define SYNC_SEM_WAIT 0x3    // reply is 0 once semaphore count was positive and guest took 1 from it
+#define SYNC_SEM_POST 0x4    // value is added to semaphore count, reply is new count
+#define SYNC_EVENT_SET 0x5   // value bits are set in event flags, reply is new flags
+#define SYNC_EVENT_CLEAR 0x6 // value bits are cleared in event flags, reply is new flags
+#define SYNC_EVENT_WAIT 0x7  // reply is flags once all value bits are set
+
+#define SYNC_INTERRUPTED (UINT64_MAX - 1) // reply to wait that host interrupted, guest sends the same request again
+
+#define SYNC_TYPE_BARRIER 0
+#define SYNC_TYPE_SEMAPHORE 1
+#define SYNC_TYPE_EVENT 2
+
+#define SYNC_NAME_LENGTH 32 // longest name of group or object
+#define SYNC_MAX_OBJECTS 64 // objects in one group
+
+typedef struct SyncGroup SyncGroup;
+typedef struct SyncDevice SyncDevice;
+
+// Adds one member to group with given name, group is created by its first member. Barriers of group wait for all
+// members, so every guest of group has to join before any guest runs
+SyncGroup *joinSyncGroup(char *name);
+// Member that stopped no longer holds barriers back, and waits it alone could end fail
+void leaveSyncGroup(SyncGroup *group);
+void deleteSyncGroups();
+
+// Guest without group (NULL) can't open objects. While kickPending is nonzero waits end with SYNC_INTERRUPTED,
+// so host can get guest thread back
+SyncDevice *createSyncDevice(int guestId, SyncGroup *group, volatile uint8_t *kickPending);
+// Prints how long guest waited if it used device
+void deleteSyncDevice(SyncDevice *device);
+// Wakes guest thread waiting on object once kickPending was set
+void interruptSyncDevice(SyncDevice *device);
+// Blocks calling guest thread while request it completes has to wait. Wait fails once every member of group waits
+void syncDeviceOut(SyncDevice *device, uint8_t *data, uint32_t count);
+void syncDeviceIn(SyncDevice *device, uint8_t *data, uint32_t count);
+
+#endif